@@ -1,81 +1,623 @@
 #include "bp.h"
 #include "pipe.h"
 #include "utils.h"
+#include "checkpoint.h"
+#include "repl.h"
+#include "stats.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
-
-// must define here because of extern declaration in pipe.h
-pipe_reg_DE_EX_t pipe_reg_DE_EX;
-pipe_reg_IF_DE_t pipe_reg_IF_DE;
+#include <inttypes.h>
 
 bp_t BP_data;
 
+static const bp_engine_t *bp_engines[] = { &gshare_engine, &tage_engine, &perceptron_engine };
+
+#define BP_NUM_ENGINES (int)(sizeof(bp_engines) / sizeof(bp_engines[0]))
+
+const bp_engine_t *bp_engine = &gshare_engine;
+
+static int bp_ras_depth = 16;
+
+/*
+ * The BTB is set-associative, `ways` entries per set, with the set picked
+ * by the PC's low bits. Entries hold what hardware would: a partial tag
+ * (the rest of the PC XOR-folded down to tagbits, so two branches can
+ * alias) and the target as a signed offset from the branch in
+ * instructions, cut to offsetbits (so a target further away than that
+ * comes back wrong). That is 1 + 3 + tagbits + offsetbits modeled bits an
+ * entry, held in 8 bytes.
+ */
+typedef struct {
+    int sets, ways, tag_bits, offset_bits;
+    repl_policy_t repl;
+} btb_config_t;
+
+typedef struct {
+    uint16_t tag;
+    uint8_t valid;
+    uint8_t kind;   // bp_kind_t
+    int32_t offset; // (target - PC) / 4, sign-extended from offset_bits
+} BTB_entry_t;
+
+static btb_config_t btb_config = {
+    .sets = 256,
+    .ways = 4,
+    .tag_bits = 16,
+    .offset_bits = 26,
+    .repl = REPL_TREE_PLRU,
+};
+
+static int btb_log_sets;
+static BTB_entry_t *BTB = NULL; // sets * ways, set by set
+static repl_t btb_repl;
+static void *btb_repl_state = NULL;
+
+// Lookups are every fetch, hits the ones that found an entry
+static uint64_t stat_btb_lookups, stat_btb_hits;
+
+
+/*
+ * gshare: a PHT of 2-bit counters indexed by the global history XOR the PC.
+ * hist is how many outcomes the history holds, up to GSHARE_MAX_HIST, and
+ * pht how many counters there are, a power of 2; the history is XOR-folded
+ * down to the index width, so the two are independent. Counters are packed
+ * 4 to a byte, so pht=1024 is 256 B and pht=262144 is 64 KB.
+ */
+#define GSHARE_MAX_HIST  1024
+#define GSHARE_GHR_WORDS (GSHARE_MAX_HIST / 64 + 1) // Room for the bit leaving
+
+typedef struct {
+    int hist, pht;
+} gshare_config_t;
+
+static gshare_config_t gshare_config = {
+    .hist = 8,
+    .pht = 256,
+};
+
+static int gshare_log_pht; // Worked out by gshare_check
+
+// Bit i of the history (0 the latest) is bit i % 64 of GHR[i / 64]
+static uint64_t gshare_ghr[GSHARE_GHR_WORDS];
+static uint32_t gshare_fold; // The history folded down to gshare_log_pht bits
+static uint8_t *gshare_pht = NULL;
+
+static bool gshare_set(const char *key, int value)
+{
+    if (strcmp(key, "hist") == 0)
+        gshare_config.hist = value;
+    else if (strcmp(key, "pht") == 0)
+        gshare_config.pht = value;
+    else {
+        printf("Error: gshare has no setting \"%s\"\n", key);
+        return false;
+    }
+    return true;
+}
+
+static bool gshare_check()
+{
+    const gshare_config_t *c = &gshare_config;
+
+    if (c->hist < 0 || c->hist > GSHARE_MAX_HIST) {
+        printf("Error: gshare hist must be 0 to %d\n", GSHARE_MAX_HIST);
+        return false;
+    }
+    if (c->pht < 4 || c->pht > (1 << 24) || (c->pht & (c->pht - 1)) != 0) {
+        printf("Error: gshare pht must be a power of 2 from 4 to 2^24\n");
+        return false;
+    }
+    for (gshare_log_pht = 0; (1 << gshare_log_pht) < c->pht; gshare_log_pht++)
+        ;
+    return true;
+}
+
+static void gshare_init()
+{
+    // Sizes the PHT; the defaults don't go through bp_config_parse
+    if (!gshare_check())
+        exit(1);
+
+    memset(gshare_ghr, 0, sizeof(gshare_ghr));
+    gshare_fold = 0;
+    free(gshare_pht);
+    gshare_pht = calloc((size_t)gshare_config.pht / 4, 1);
+    if (gshare_pht == NULL) {
+        printf("malloc failed to init gshare\n");
+        exit(1);
+    }
+}
+
+static uint32_t gshare_index(uint64_t PC)
+{
+    return gshare_fold ^ (uint32_t)truncator64(PC, 2, 2 + gshare_log_pht);
+}
+
+static int gshare_ctr(uint32_t i)
+{
+    return (gshare_pht[i >> 2] >> (i & 3) * 2) & 3;
+}
+
+static bool gshare_predict(uint64_t PC)
+{
+    return gshare_ctr(gshare_index(PC)) > 1;
+}
+
+static void gshare_update(uint64_t PC, bool taken)
+{
+    uint32_t i = gshare_index(PC);
+    int ctr = gshare_ctr(i), hist = gshare_config.hist, width = gshare_log_pht;
+
+    if (taken && ctr < 3)
+        ctr++;
+    else if (!taken && ctr > 0)
+        ctr--;
+    gshare_pht[i >> 2] &= ~(3 << (i & 3) * 2);
+    gshare_pht[i >> 2] |= ctr << (i & 3) * 2;
+
+    /* Update global history register, only the words the history uses */
+    uint64_t carry = taken;
+    for (int w = 0; w <= hist / 64; w++) {
+        uint64_t out = gshare_ghr[w] >> 63;
+        gshare_ghr[w] = (gshare_ghr[w] << 1) | carry;
+        carry = out;
+    }
+
+    // Bit hist has just left the history
+    uint32_t old = (gshare_ghr[hist / 64] >> (hist % 64)) & 1;
+    gshare_fold = (gshare_fold << 1) | (uint32_t)taken;
+    gshare_fold ^= old << (hist % width);
+    gshare_fold ^= gshare_fold >> width;
+    gshare_fold &= (1u << width) - 1;
+}
+
+static const ckpt_item_t gshare_state[] = {
+    CKPT_ITEM(gshare_ghr),
+    CKPT_ITEM(gshare_fold),
+};
+
+#define NUM_GSHARE_STATE (int)(sizeof(gshare_state) / sizeof(gshare_state[0]))
+
+static bool gshare_save(FILE *fp)
+{
+    return ckpt_write(fp, gshare_pht, (size_t)gshare_config.pht / 4) &&
+           ckpt_write_items(fp, gshare_state, NUM_GSHARE_STATE);
+}
+
+static bool gshare_load(FILE *fp)
+{
+    return ckpt_read(fp, gshare_pht, (size_t)gshare_config.pht / 4) &&
+           ckpt_read_items(fp, gshare_state, NUM_GSHARE_STATE);
+}
+
+void gshare_print(FILE *fp)
+{
+    if (bp_engine != &gshare_engine)
+        return;
+    fprintf(fp, "GHR:");
+    for (int w = gshare_config.hist / 64; w >= 0; w--)
+        fprintf(fp, " %016" PRIx64, gshare_ghr[w]);
+    fprintf(fp, "\n");
+
+    fprintf(fp, "PHT:\n");
+    for (int i = 0; i < gshare_config.pht; ++i) {
+        fprintf(fp, "%d ", gshare_ctr(i));
+        if ((i + 1) % 16 == 0) fprintf(fp, "\n");
+    }
+}
+
+const bp_engine_t gshare_engine = {
+    .name = "gshare",
+    .set = gshare_set,
+    .check = gshare_check,
+    .init = gshare_init,
+    .predict = gshare_predict,
+    .update = gshare_update,
+    .save = gshare_save,
+    .load = gshare_load,
+    .config = &gshare_config,
+    .config_size = sizeof(gshare_config),
+};
+
+bool bp_config_parse(const char *spec)
+{
+    char name[16], key[16];
+    int value, len;
+    const bp_engine_t *engine = NULL;
+
+    if (sscanf(spec, " %15[a-z0-9_]%n", name, &len) != 1) {
+        printf("Error: malformed predictor setting \"%s\"\n", spec);
+        return false;
+    }
+    for (int i = 0; i < BP_NUM_ENGINES; i++)
+        if (strcmp(bp_engines[i]->name, name) == 0)
+            engine = bp_engines[i];
+    if (engine == NULL) {
+        printf("Error: unknown branch predictor \"%s\"\n", name);
+        return false;
+    }
+    spec += len;
+
+    while (*spec != '\0') {
+        if (*spec == ',' || *spec == ' ' || *spec == '\t' || *spec == '\n') {
+            spec++;
+            continue;
+        }
+        if (sscanf(spec, "%15[a-z_]=%i%n", key, &value, &len) != 2) {
+            printf("Error: malformed predictor setting \"%s\"\n", spec);
+            return false;
+        }
+        spec += len;
+        if (!engine->set(key, value))
+            return false;
+    }
+    if (!engine->check())
+        return false;
+    bp_engine = engine;
+    return true;
+}
+
+static bool btb_check(const btb_config_t *c)
+{
+    if (c->sets < 1 || c->sets > (1 << 20) || (c->sets & (c->sets - 1)) != 0) {
+        printf("Error: the BTB needs a power of 2 of sets, up to 2^20\n");
+        return false;
+    }
+    if (c->ways < 1 || c->ways > REPL_MAX_PACKED_WAYS) {
+        printf("Error: the BTB can have 1 to %d ways\n", REPL_MAX_PACKED_WAYS);
+        return false;
+    }
+    if (c->tag_bits < 1 || c->tag_bits > 16) {
+        printf("Error: BTB tagbits must be 1 to 16\n");
+        return false;
+    }
+    if (c->offset_bits < 4 || c->offset_bits > 32) {
+        printf("Error: BTB offsetbits must be 4 to 32\n");
+        return false;
+    }
+    return repl_check_ways(c->repl, c->ways);
+}
+
+bool btb_config_parse(const char *spec)
+{
+    btb_config_t c = btb_config;
+    char key[16], value[16];
+    int len;
+
+    while (*spec != '\0') {
+        if (*spec == ',' || *spec == ' ' || *spec == '\t' || *spec == '\n') {
+            spec++;
+            continue;
+        }
+        if (sscanf(spec, "%15[a-z]=%15[a-z0-9]%n", key, value, &len) != 2) {
+            printf("Error: malformed BTB setting \"%s\"\n", spec);
+            return false;
+        }
+        spec += len;
+        if (strcmp(key, "repl") == 0) {
+            if (!repl_parse(value, &c.repl)) {
+                printf("Error: unknown replacement policy \"%s\"\n", value);
+                return false;
+            }
+            continue;
+        }
+        int n = atoi(value);
+        if (strcmp(key, "sets") == 0)
+            c.sets = n;
+        else if (strcmp(key, "ways") == 0)
+            c.ways = n;
+        else if (strcmp(key, "tagbits") == 0)
+            c.tag_bits = n;
+        else if (strcmp(key, "offsetbits") == 0)
+            c.offset_bits = n;
+        else {
+            printf("Error: the BTB has no setting \"%s\"\n", key);
+            return false;
+        }
+    }
+    if (!btb_check(&c))
+        return false;
+    btb_config = c;
+    return true;
+}
+
+static void btb_init()
+{
+    const btb_config_t *c = &btb_config;
+    size_t state_size = repl_state_size(c->repl, c->sets, c->ways);
+
+    free(BTB);
+    free(btb_repl_state);
+    BTB = calloc((size_t)c->sets * c->ways, sizeof(BTB_entry_t));
+    btb_repl_state = calloc(1, state_size ? state_size : 1);
+    if (BTB == NULL || btb_repl_state == NULL) {
+        printf("malloc failed to init the BTB\n");
+        exit(1);
+    }
+    repl_init(&btb_repl, c->repl, c->ways, btb_repl_state);
+    for (btb_log_sets = 0; (1 << btb_log_sets) < c->sets; btb_log_sets++)
+        ;
+    stat_btb_lookups = stat_btb_hits = 0;
+}
+
+static inline int btb_set(uint64_t PC)
+{
+    return (int)(PC >> 2) & (btb_config.sets - 1);
+}
+
+static inline uint16_t btb_tag(uint64_t PC)
+{
+    uint64_t rest = PC >> (2 + btb_log_sets);
+    uint16_t tag = 0;
 
-void _2_bit_incr(uint2_t *data) {
-    if(*data < 3)
-        (*data)++;
+    for (; rest != 0; rest >>= btb_config.tag_bits)
+        tag ^= rest & ((1u << btb_config.tag_bits) - 1);
+    return tag;
 }
 
-void _2_bit_decr(uint2_t *data) {
-    if(*data > 0)
-        (*data)--;
+// PC's entry, or NULL
+static BTB_entry_t *btb_find(uint64_t PC, int *way)
+{
+    BTB_entry_t *set = &BTB[(size_t)btb_set(PC) * btb_config.ways];
+    uint16_t tag = btb_tag(PC);
+
+    for (int w = 0; w < btb_config.ways; w++) {
+        if (set[w].valid && set[w].tag == tag) {
+            *way = w;
+            return &set[w];
+        }
+    }
+    return NULL;
+}
+
+static inline uint64_t btb_target(const BTB_entry_t *e, uint64_t PC)
+{
+    return PC + (uint64_t)((int64_t)e->offset * 4);
+}
+
+static inline int32_t btb_offset(uint64_t PC, uint64_t target)
+{
+    int shift = 64 - btb_config.offset_bits;
+    return (int32_t)((int64_t)((target - PC) >> 2 << shift) >> shift);
+}
+
+// Fills in PC's entry, taking the replacement policy's victim if the set
+// has no room, and returns the target it held before (PC + 4 if none)
+static uint64_t btb_update(uint64_t PC, bp_kind_t kind, uint64_t target)
+{
+    int set = btb_set(PC), way;
+    BTB_entry_t *e = btb_find(PC, &way);
+    uint64_t old_target = PC + 4;
+
+    if (e != NULL) {
+        old_target = btb_target(e, PC);
+        repl_touch(&btb_repl, set, way);
+    } else {
+        BTB_entry_t *ways = &BTB[(size_t)set * btb_config.ways];
+        for (way = 0; way < btb_config.ways && ways[way].valid; way++)
+            ;
+        if (way == btb_config.ways)
+            way = repl_victim(&btb_repl, set);
+        e = &ways[way];
+        e->valid = true;
+        e->tag = btb_tag(PC);
+        repl_insert(&btb_repl, set, way);
+    }
+    e->kind = kind;
+    e->offset = btb_offset(PC, target);
+    return old_target;
+}
+
+void btb_print(FILE *fp)
+{
+    for (int set = 0; set < btb_config.sets; set++) {
+        for (int w = 0; w < btb_config.ways; w++) {
+            const BTB_entry_t *e = &BTB[(size_t)set * btb_config.ways + w];
+            if (e->valid)
+                fprintf(fp, "Set %d way %d: tag 0x%x kind %d offset %d\n",
+                        set, w, e->tag, e->kind, e->offset);
+        }
+    }
+}
+
+bool bp_ras_config(int depth)
+{
+    if (depth < 0 || depth > RAS_MAX_DEPTH) {
+        printf("Error: the RAS can hold 0 to %d return addresses\n", RAS_MAX_DEPTH);
+        return false;
+    }
+    bp_ras_depth = depth;
+    return true;
 }
 
 void bp_init() {
-    BP_data.GHR = 0;
-    for(size_t i=0; i<PHTSIZE; i++)
-        BP_data.PHT[i] = 0;
-    for(size_t i=0; i<BTBSIZE; i++)
-        BP_data.BTB[i] = (BTB_entry_t) { // This is not actually necessary
-            .tag=0,                      // since C default initializes static
-            .valid=0,                    // vars to 0. This is here just for explicitness.
-            .is_conditional=0,
-            .target=0
-        };
+    bp_engine->init();
+    ittage_init();
+    btb_init();
+    stats_register_u64("BTB.lookups", &stat_btb_lookups);
+    stats_register_u64("BTB.hits", &stat_btb_hits);
+    memset(BP_data.RAS, 0, sizeof(BP_data.RAS));
+    BP_data.RAS_top = 0;
 }
 
-void bp_predict(uint64_t PC, uint64_t* predicted_pc, bool* predicted_taken)
+static void ras_push(uint64_t addr)
 {
-    BTB_entry_t e = BP_data.BTB[truncator64(PC, 2, 12)];
-    uint8_t pht_idx = BP_data.GHR ^ (uint8_t)truncator64(PC, 2, 10);
+    BP_data.RAS_top = (BP_data.RAS_top + 1) % bp_ras_depth;
+    BP_data.RAS[BP_data.RAS_top] = addr;
+}
+
+static uint64_t ras_pop()
+{
+    uint64_t addr = BP_data.RAS[BP_data.RAS_top];
+    BP_data.RAS_top = (BP_data.RAS_top + bp_ras_depth - 1) % bp_ras_depth;
+    return addr;
+}
+
+void bp_ras_follow(bp_kind_t kind, uint64_t PC)
+{
+    if (bp_ras_depth == 0)
+        return;
+    if (kind == BP_CALL)
+        ras_push(PC + 4);
+    else if (kind == BP_RETURN)
+        ras_pop();
+}
+
+void bp_predict(uint64_t PC, uint64_t* predicted_pc, bool* predicted_taken, bp_ckpt_t *ckpt)
+{
+    int way;
+    const BTB_entry_t *e = btb_find(PC, &way);
+    uint64_t target;
+
+    ckpt->top = BP_data.RAS_top;
+    ckpt->saved[0] = BP_data.RAS[ckpt->top];
+    ckpt->saved[1] = bp_ras_depth ? BP_data.RAS[(ckpt->top + 1) % bp_ras_depth] : 0;
+
+    ckpt->btb_hit = e != NULL;
 
     *predicted_taken = false;
-    if(e.tag != PC || !e.valid) { // BTB miss
+    stat_btb_lookups++;
+    if(e == NULL) { // BTB miss
         *predicted_pc = PC + 4;
         return;
     }
+    stat_btb_hits++;
+    target = btb_target(e, PC);
 
-    if(e.is_conditional == false || BP_data.PHT[pht_idx] > 1) {
-        *predicted_pc = e.target;
-        *predicted_taken = true;
-        return;
+    switch (e->kind) {
+    case BP_CONDITIONAL:
+        if (!bp_engine->predict(PC)) {
+            *predicted_pc = PC + 4;
+            return;
+        }
+        *predicted_pc = target;
+        break;
+    case BP_CALL:
+        if (bp_ras_depth > 0)
+            ras_push(PC + 4);
+        *predicted_pc = target;
+        break;
+    case BP_RETURN:
+        *predicted_pc = bp_ras_depth > 0 ? ras_pop() : target;
+        break;
+    case BP_INDIRECT:
+        *predicted_pc = ittage_enabled() ? ittage_predict(PC, target) : target;
+        break;
+    default:
+        *predicted_pc = target;
+        break;
     }
-    *predicted_pc = PC + 4;
-    return;
+    *predicted_taken = true;
+}
+
+void bp_repair(const bp_ckpt_t *ckpt, bp_kind_t kind, uint64_t PC)
+{
+    if (bp_ras_depth == 0)
+        return;
+    BP_data.RAS_top = ckpt->top;
+    BP_data.RAS[ckpt->top] = ckpt->saved[0];
+    BP_data.RAS[(ckpt->top + 1) % bp_ras_depth] = ckpt->saved[1];
+    bp_ras_follow(kind, PC);
+}
+
+void bp_update(bp_kind_t kind, bool taken, uint64_t PC, uint64_t target)
+{
+    uint64_t btb_old_target = btb_update(PC, kind, target);
+
+    // The BTB's last target is where ITTAGE started from
+    if (kind == BP_INDIRECT && ittage_enabled())
+        ittage_update(PC, target, btb_old_target);
+
+    if(kind == BP_CONDITIONAL)
+        bp_engine->update(PC, taken);
+    if (ittage_enabled())
+        ittage_history(kind, taken, target);
 }
 
-void bp_update(bool is_conditional, bool taken, uint64_t PC, uint64_t target)
+typedef struct {
+    char engine[16];
+    int32_t ras_depth;
+    btb_config_t btb;
+} bp_ckpt_config_t;
+
+bool bp_save_config(FILE *fp)
 {
-    /* Update BTB */
-    BTB_entry_t* e = &BP_data.BTB[truncator64(PC, 2, 12)];
-    uint8_t pht_idx = BP_data.GHR ^ truncator64(PC, 2, 10);
-    e->tag = PC;
-    e->valid = true;
-    e->is_conditional = is_conditional;
-    e->target = target;
+    bp_ckpt_config_t config;
+
+    memset(&config, 0, sizeof(config));
+    snprintf(config.engine, sizeof(config.engine), "%s", bp_engine->name);
+    config.ras_depth = bp_ras_depth;
+    config.btb = btb_config;
+    return ckpt_write(fp, &config, sizeof(config)) &&
+           ckpt_write(fp, bp_engine->config, bp_engine->config_size) &&
+           ittage_save_config(fp);
+}
 
-    if(is_conditional) {
-        /* Update gshare directional predictor */
-        if(taken)
-            _2_bit_incr(&(BP_data.PHT[pht_idx]));
-        else
-            _2_bit_decr(&(BP_data.PHT[pht_idx]));
+bool bp_check_config(FILE *fp)
+{
+    bp_ckpt_config_t config, saved;
+    uint8_t settings[256];
 
-        /* Update global history register */
-        BP_data.GHR <<= 1;
-        BP_data.GHR |= (uint8_t)taken;
+    memset(&config, 0, sizeof(config));
+    snprintf(config.engine, sizeof(config.engine), "%s", bp_engine->name);
+    config.ras_depth = bp_ras_depth;
+    config.btb = btb_config;
+    if (!ckpt_read(fp, &saved, sizeof(saved)))
+        return false;
+    if (memcmp(config.engine, saved.engine, sizeof(config.engine)) != 0) {
+        printf("Error: the checkpoint was taken with the %.16s predictor, not %s\n",
+               saved.engine, bp_engine->name);
+        return false;
+    }
+    if (saved.ras_depth != config.ras_depth) {
+        printf("Error: the checkpoint was taken with a RAS of %d, not %d\n",
+               saved.ras_depth, config.ras_depth);
+        return false;
+    }
+    if (memcmp(&saved.btb, &config.btb, sizeof(config.btb)) != 0) {
+        printf("Error: the checkpoint was taken with other BTB settings\n");
+        return false;
     }
+    assert(bp_engine->config_size <= sizeof(settings));
+    if (!ckpt_read(fp, settings, bp_engine->config_size))
+        return false;
+    if (memcmp(settings, bp_engine->config, bp_engine->config_size) != 0) {
+        printf("Error: the checkpoint was taken with other %s settings\n", bp_engine->name);
+        return false;
+    }
+    return ittage_check_config(fp);
+}
+
+static const ckpt_item_t btb_state[] = {
+    CKPT_ITEM(btb_repl.rng),
+    CKPT_ITEM(stat_btb_lookups),
+    CKPT_ITEM(stat_btb_hits),
+};
+
+#define NUM_BTB_STATE (int)(sizeof(btb_state) / sizeof(btb_state[0]))
+
+bool bp_save(FILE *fp)
+{
+    const btb_config_t *c = &btb_config;
+
+    return ckpt_write(fp, &BP_data, sizeof(BP_data)) &&
+           ckpt_write(fp, BTB, (size_t)c->sets * c->ways * sizeof(BTB_entry_t)) &&
+           ckpt_write(fp, btb_repl_state, repl_state_size(c->repl, c->sets, c->ways)) &&
+           ckpt_write_items(fp, btb_state, NUM_BTB_STATE) &&
+           bp_engine->save(fp) && ittage_save(fp);
+}
+
+bool bp_load(FILE *fp)
+{
+    const btb_config_t *c = &btb_config;
+
+    return ckpt_read(fp, &BP_data, sizeof(BP_data)) &&
+           ckpt_read(fp, BTB, (size_t)c->sets * c->ways * sizeof(BTB_entry_t)) &&
+           ckpt_read(fp, btb_repl_state, repl_state_size(c->repl, c->sets, c->ways)) &&
+           ckpt_read_items(fp, btb_state, NUM_BTB_STATE) &&
+           bp_engine->load(fp) && ittage_load(fp);
 }
 
 /*
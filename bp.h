@@ -3,36 +3,122 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
 
-#define PHTSIZE 256
-#define BTBSIZE 1024
+#define RAS_MAX_DEPTH 64
 
-typedef struct {
-    uint64_t tag;
-    bool valid;
-    bool is_conditional;
-    uint64_t target;
-} BTB_entry_t;
-
-typedef uint8_t uint2_t; // Would have liked to use uint2_t if C had it.
+// What a control instruction is to the predictors
+typedef enum {
+    BP_CONDITIONAL, // CBZ, CBNZ, B.cond
+    BP_DIRECT,      // B
+    BP_CALL,        // BL
+    BP_RETURN,      // BR X30
+    BP_INDIRECT,    // Any other BR
+    BP_KINDS
+} bp_kind_t;
 
 typedef struct
 {
-    /* gshare */
-    uint8_t GHR;
-    uint2_t PHT[PHTSIZE];
-    /* BTB */
-    BTB_entry_t BTB[BTBSIZE];
+    /* Return address stack: RAS[RAS_top] is the latest return address,
+       and it wraps around, losing the oldest, when a call finds it full */
+    uint64_t RAS[RAS_MAX_DEPTH];
+    uint32_t RAS_top;
 } bp_t;
 
-extern bp_t BP_data; // Holds the full state needed for branch prediction
+extern bp_t BP_data; // The RAS
+
+// What bp_predict did to the RAS, for bp_repair to undo: a prediction
+// moves the top at most one slot, and the one after it can only write
+// those two slots before it is found out.
+typedef struct {
+    uint32_t top;
+    uint64_t saved[2]; // RAS[top] and the slot above it
+    bool btb_hit;      // Whether the BTB had an entry for the PC
+} bp_ckpt_t;
+
+// Direction predictors. The BTB says whether there is a branch and where
+// it goes; for a conditional one, bp_predict asks the engine picked with
+// --bp whether it is taken, and bp_update trains that engine with the
+// outcome. Engines keep their own history.
+typedef struct bp_engine bp_engine_t;
+struct bp_engine {
+    const char *name;
+    // Applies one "key=value" setting; prints the problem and returns
+    // false if the engine has no such setting
+    bool (*set)(const char *key, int value);
+    // Prints the problem and returns false if the settings don't work
+    bool (*check)(void);
+    void (*init)(void);
+    bool (*predict)(uint64_t PC);
+    void (*update)(uint64_t PC, bool taken);
+    // The engine's part of a checkpoint, after BP_data
+    bool (*save)(FILE *fp);
+    bool (*load)(FILE *fp);
+    // The settings; a checkpoint can only be restored with the same ones
+    const void *config;
+    size_t config_size;
+};
+
+extern const bp_engine_t gshare_engine, tage_engine, perceptron_engine;
+extern const bp_engine_t *bp_engine; // gshare unless --bp says otherwise
 
-void _2_bit_incr(uint2_t *data);
-void _2_bit_decr(uint2_t *data);
+// gshare's GHR and PHT, for debugging; nothing if another engine is in use
+void gshare_print(FILE *fp);
+
+// Picks and sets up an engine from a spec such as "tage,tables=8,budget=32":
+// the engine's name, then its settings. Prints the problem and returns
+// false if the spec is bad. Takes effect at the next bp_init.
+bool bp_config_parse(const char *spec);
+
+// Sets up the BTB (see bp.c) from a spec such as "sets=256,ways=4,repl=plru";
+// keys are sets, ways, tagbits, offsetbits and repl (a cache policy name).
+// Prints the problem and returns false if the spec is bad. Takes effect at
+// the next bp_init.
+bool btb_config_parse(const char *spec);
+void btb_print(FILE *fp); // Every valid entry, for debugging
+
+// Sets how many return addresses the RAS holds, up to RAS_MAX_DEPTH; with
+// 0 there is no RAS and returns are predicted like any other BR. Prints
+// the problem and returns false if depth is out of range. Takes effect at
+// the next bp_init.
+bool bp_ras_config(int depth);
+
+// Targets of BRs other than returns: with "ittage", ITTAGE (Seznec, "A
+// 64-Kbytes ITTAGE indirect branch predictor", JWAC-2 2011) in ittage.c,
+// the default; with "btb", wherever the BTB says the BR went last. The
+// spec is as for bp_config_parse, e.g. "ittage,tables=4,budget=4".
+bool ittage_config_parse(const char *spec);
+bool ittage_enabled();
+void ittage_init();
+uint64_t ittage_predict(uint64_t PC, uint64_t btb_target);
+void ittage_update(uint64_t PC, uint64_t target, uint64_t btb_target);
+// Every resolved branch, in order; the history ittage_predict hashes
+void ittage_history(bp_kind_t kind, bool taken, uint64_t target);
+bool ittage_save_config(FILE *fp);
+bool ittage_check_config(FILE *fp);
+bool ittage_save(FILE *fp);
+bool ittage_load(FILE *fp);
 
 void bp_init();
-void bp_predict(uint64_t PC, uint64_t* predicted_pc, bool* predicted_taken);
-void bp_update(bool is_conditional, bool taken, uint64_t PC, uint64_t target);
+// Predicts the instruction fetched at PC, pushing and popping the RAS
+// speculatively for the calls and returns the BTB knows; *ckpt is what
+// bp_repair needs if the prediction or one after it turns out wrong.
+void bp_predict(uint64_t PC, uint64_t* predicted_pc, bool* predicted_taken, bp_ckpt_t *ckpt);
+// For a branch that was mispredicted: puts the RAS back as it was before
+// the branch was predicted, then does what the branch really does to it
+void bp_repair(const bp_ckpt_t *ckpt, bp_kind_t kind, uint64_t PC);
+// Moves the RAS as a branch of this kind at PC does, for code that runs
+// branches without predicting them (warming)
+void bp_ras_follow(bp_kind_t kind, uint64_t PC);
+void bp_update(bp_kind_t kind, bool taken, uint64_t PC, uint64_t target);
+
+// Write or read the predictor as part of a checkpoint (see checkpoint.h).
+// bp_check_config reads back what bp_save_config wrote and prints the
+// problem and returns false unless it matches the current settings.
+bool bp_save_config(FILE *fp);
+bool bp_check_config(FILE *fp);
+bool bp_save(FILE *fp);
+bool bp_load(FILE *fp);
 
 void flush_pipeline();
 
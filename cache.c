@@ -1,254 +1,738 @@
 #include "cache.h"
-#include "shell.h" // Mostly for mem_read_32
+#include "shell.h" // Mostly for the mem_read/mem_write accessors
 #include "utils.h"
+#include "trace.h"
+#include "tag_match.h"
+#include "checkpoint.h"
+#include "stats.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <limits.h>
 
 cache_t *i_cache, *d_cache;
+cache_t *l2_cache = NULL, *l3_cache = NULL;
 
-uint64_t timestamp_counter = 0;
+cache_t *global_cache_list[MAX_CACHES];
+int global_cache_count = 0;
 
-query_state_list_heads_list_t *global_query_state_list_heads_list_head = NULL;
+// Set while cache_warm runs. Warming moves lines between the levels like
+// a real miss does, but none of it may show up in the statistics.
+static bool cache_warming = false;
+
+static size_t round_up(size_t n, size_t align)
+{
+    return (n + align - 1) / align * align;
+}
+
+cache_config_t i_cache_config = {
+    .sets = 64, .ways = 4, .block_size = BLOCK_SIZE,
+    .hit_latency = 0, .miss_latency = INST_MISS_DELAY, .mshrs = INST_MSHRS,
+    .repl = REPL_LRU, .write_back = false, .enabled = true
+};
+cache_config_t d_cache_config = {
+    .sets = 256, .ways = 8, .block_size = BLOCK_SIZE,
+    .hit_latency = 0, .miss_latency = DATA_MISS_DELAY, .mshrs = DATA_MSHRS,
+    .repl = REPL_LRU, .write_back = false, .enabled = true
+};
+// Lower levels are probed in the cycle of the L1 miss and never have
+// misses of their own outstanding, so one MSHR is plenty.
+cache_config_t l2_cache_config = {
+    .sets = 2048, .ways = 16, .block_size = BLOCK_SIZE,
+    .hit_latency = L2_HIT_DELAY, .miss_latency = MEM_DELAY, .mshrs = 1,
+    .repl = REPL_LRU, .write_back = true, .inclusion = INCL_NINE, .enabled = false
+};
+cache_config_t l3_cache_config = {
+    .sets = 8192, .ways = 16, .block_size = BLOCK_SIZE,
+    .hit_latency = L3_HIT_DELAY, .miss_latency = MEM_DELAY, .mshrs = 1,
+    .repl = REPL_LRU, .write_back = true, .inclusion = INCL_NINE, .enabled = false
+};
+
+static int log2_exact(int n)
+{
+    int bits = 0;
+    while ((1 << bits) < n)
+        bits++;
+    return (1 << bits) == n ? bits : -1;
+}
+
+static void cache_link(cache_t *upper, cache_t *lower)
+{
+    assert(lower->num_upper < MAX_UPPER_CACHES);
+    upper->next = lower;
+    lower->upper[lower->num_upper++] = upper;
+}
+
+// Registers c's counters as "<name>.<counter>" (see stats.h)
+static void cache_register_stats(cache_t *c)
+{
+    static const struct {
+        const char *name;
+        size_t offset;
+    } counters[] = {
+        { "accesses",       offsetof(cache_t, stat_accesses) },
+        { "hits",           offsetof(cache_t, stat_hits) },
+        { "misses",         offsetof(cache_t, stat_misses) },
+        { "evictions",      offsetof(cache_t, stat_evictions) },
+        { "writebacks",     offsetof(cache_t, stat_writebacks) },
+        { "mshr_occupancy", offsetof(cache_t, stat_mshr_occupancy) },
+        { "mshr_full",      offsetof(cache_t, stat_mshr_full) },
+    };
+    char name[64];
+
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        snprintf(name, sizeof(name), "%s.%s", c->name, counters[i].name);
+        stats_register_u64(name, (const uint64_t*)((const char*)c + counters[i].offset));
+    }
+}
 
 void cache_init_all() {
-    i_cache = cache_new(64, 4, 32);
-    d_cache = cache_new(256, 8, 32);
-    global_query_state_list_heads_list_head = (query_state_list_heads_list_t*)malloc(sizeof(query_state_list_heads_list_t));
-    if (global_query_state_list_heads_list_head == NULL) {
-        printf("malloc failed to init global_query_state_list_heads_list_head\n");
+    if (l3_cache_config.enabled && !l2_cache_config.enabled) {
+        printf("Error: an L3 needs an L2\n");
         exit(1);
     }
-    global_query_state_list_heads_list_head->cache = i_cache;
-    global_query_state_list_heads_list_head->head = NULL;
-    global_query_state_list_heads_list_head->next = (query_state_list_heads_list_t*)malloc(sizeof(query_state_list_heads_list_t));
-    global_query_state_list_heads_list_head->next->cache = d_cache;
-    global_query_state_list_heads_list_head->next->head = NULL;
-    global_query_state_list_heads_list_head->next->next = NULL;
+    // Lines move between levels whole
+    if ((l2_cache_config.enabled &&
+         (l2_cache_config.block_size != i_cache_config.block_size ||
+          l2_cache_config.block_size != d_cache_config.block_size)) ||
+        (l3_cache_config.enabled &&
+         l3_cache_config.block_size != l2_cache_config.block_size)) {
+        printf("Error: all cache levels need the same block size\n");
+        exit(1);
+    }
+
+    i_cache = cache_new(i_cache_config);
+    i_cache->name = "L1I";
+    d_cache = cache_new(d_cache_config);
+    d_cache->name = "L1D";
+    if (l2_cache_config.enabled) {
+        l2_cache = cache_new(l2_cache_config);
+        l2_cache->name = "L2";
+        cache_link(i_cache, l2_cache);
+        cache_link(d_cache, l2_cache);
+    }
+    if (l3_cache_config.enabled) {
+        l3_cache = cache_new(l3_cache_config);
+        l3_cache->name = "L3";
+        cache_link(l2_cache, l3_cache);
+    }
+
+    for (int k = 0; k < global_cache_count; k++)
+        cache_register_stats(global_cache_list[k]);
 }
 
-cache_t *cache_new(int sets, int ways, int block)
+cache_t *cache_new(cache_config_t config)
 {
     cache_t *new_cache = (cache_t*)malloc(sizeof(cache_t));
+    int sets = config.sets, ways = config.ways, mshrs = config.mshrs;
     new_cache->num_sets = sets;
-    new_cache->num_lines = block;
-
-    new_cache->lines = (cache_line_t**)malloc(sizeof(cache_line_t*) * sets);
-    for (int i = 0; i < sets; i++) {
-        // we use calloc here to init cache_line vals to 0
-        new_cache->lines[i] = (cache_line_t*)calloc(block, sizeof(cache_line_t));
+    new_cache->num_lines = ways;
+    new_cache->block_size = config.block_size;
+    new_cache->hit_latency = config.hit_latency;
+    new_cache->miss_latency = config.miss_latency;
+    new_cache->write_back = config.write_back;
+    new_cache->name = "cache";
+    new_cache->next = NULL;
+    new_cache->num_upper = 0;
+    new_cache->inclusion = config.inclusion;
+    new_cache->stat_accesses = 0;
+    new_cache->stat_hits = 0;
+    new_cache->stat_misses = 0;
+    new_cache->stat_evictions = 0;
+    new_cache->stat_writebacks = 0;
+    new_cache->stat_mshr_occupancy = 0;
+    new_cache->stat_mshr_full = 0;
+
+    new_cache->offset_bits = log2_exact(config.block_size);
+    new_cache->index_bits = log2_exact(sets);
+    assert(new_cache->offset_bits >= 2 && new_cache->index_bits >= 0);
+    assert(config.block_size <= MAX_BLOCK_SIZE && ways > 0);
+    new_cache->offset_mask = (uint64_t)config.block_size - 1;
+    new_cache->index_mask = (uint64_t)sets - 1;
+
+    size_t n = (size_t)sets * ways;
+    size_t tags_size = round_up(n * sizeof(uint64_t), HOST_LINE_SIZE);
+    size_t repl_size = round_up(repl_state_size(config.repl, sets, ways), HOST_LINE_SIZE);
+    size_t dirty_size = round_up(n, HOST_LINE_SIZE);
+    size_t data_size = round_up(n * config.block_size, HOST_LINE_SIZE);
+    size_t total_size = tags_size + repl_size + dirty_size + data_size;
+    uint8_t *storage = aligned_alloc(HOST_LINE_SIZE, total_size);
+    if (storage == NULL) {
+        printf("malloc failed to init cache\n");
+        exit(1);
     }
+    // all lines start invalid and clean, with zeroed replacement state
+    memset(storage, 0, total_size);
+    new_cache->storage = storage;
+    new_cache->storage_size = total_size;
+    new_cache->tags = (uint64_t*)storage;
+    repl_init(&new_cache->repl, config.repl, ways, storage + tags_size);
+    new_cache->dirty = storage + tags_size + repl_size;
+    new_cache->data = storage + tags_size + repl_size + dirty_size;
+
+    assert(mshrs > 0);
+    new_cache->num_mshrs = mshrs;
+    new_cache->mshr_slots = 1;
+    while (new_cache->mshr_slots < 2 * mshrs)
+        new_cache->mshr_slots <<= 1;
+    // calloc leaves every slot MSHR_FREE
+    new_cache->mshrs = (mshr_t*)calloc(new_cache->mshr_slots, sizeof(mshr_t));
+    new_cache->mshrs_busy = 0;
+    new_cache->mshrs_deleted = 0;
+
+    if (new_cache->mshrs == NULL) {
+        printf("malloc failed to init cache\n");
+        exit(1);
+    }
+
+    assert(global_cache_count < MAX_CACHES);
+    global_cache_list[global_cache_count++] = new_cache;
 
     return new_cache;
 }
 
-void cache_destroy_all() {
-    // We need to destroy both the cache (*proper*) structs
-    // and the query state structs.
+bool cache_config_parse(cache_config_t *config, const char *spec)
+{
+    char key[16], value_str[16];
+    int value, len;
 
-    // Cache structs
-    cache_destroy(i_cache);
-    cache_destroy(d_cache);
+    while (*spec != '\0') {
+        if (*spec == ',' || *spec == ' ' || *spec == '\t' || *spec == '\n') {
+            spec++;
+            continue;
+        }
+        if (sscanf(spec, "%15[a-z_]=%15[a-z0-9x]%n", key, value_str, &len) != 2) {
+            printf("Error: malformed cache setting \"%s\"\n", spec);
+            return false;
+        }
+        spec += len;
+
+        if (strcmp(key, "repl") == 0) {
+            if (!repl_parse(value_str, &config->repl)) {
+                printf("Error: unknown replacement policy \"%s\"\n", value_str);
+                return false;
+            }
+            continue;
+        }
+        if (strcmp(key, "incl") == 0) {
+            if (strcmp(value_str, "inclusive") == 0)
+                config->inclusion = INCL_INCLUSIVE;
+            else if (strcmp(value_str, "exclusive") == 0)
+                config->inclusion = INCL_EXCLUSIVE;
+            else if (strcmp(value_str, "nine") == 0)
+                config->inclusion = INCL_NINE;
+            else {
+                printf("Error: incl must be inclusive, exclusive or nine\n");
+                return false;
+            }
+            continue;
+        }
+        if (strcmp(key, "write") == 0) {
+            if (strcmp(value_str, "back") == 0)
+                config->write_back = true;
+            else if (strcmp(value_str, "through") == 0)
+                config->write_back = false;
+            else {
+                printf("Error: write must be back or through\n");
+                return false;
+            }
+            continue;
+        }
+        char *end;
+        value = (int)strtol(value_str, &end, 0);
+        if (*end != '\0') {
+            printf("Error: malformed cache setting \"%s=%s\"\n", key, value_str);
+            return false;
+        }
+
+        if (strcmp(key, "sets") == 0)
+            config->sets = value;
+        else if (strcmp(key, "ways") == 0)
+            config->ways = value;
+        else if (strcmp(key, "block") == 0)
+            config->block_size = value;
+        else if (strcmp(key, "hit") == 0)
+            config->hit_latency = value;
+        else if (strcmp(key, "miss") == 0)
+            config->miss_latency = value;
+        else if (strcmp(key, "mshrs") == 0)
+            config->mshrs = value;
+        else {
+            printf("Error: unknown cache setting \"%s\"\n", key);
+            return false;
+        }
+    }
 
-    // Query structs
-    query_state_list_heads_list_t *l_of_l_ptr = global_query_state_list_heads_list_head;
-    while(l_of_l_ptr != NULL) {
-        // Logically all reads should be finished,
-        // so we must have a bug if this is not empty.
-        assert(l_of_l_ptr->head == NULL);
+    if (config->sets <= 0 || log2_exact(config->sets) < 0 ||
+            config->block_size < 4 || config->block_size > MAX_BLOCK_SIZE ||
+            log2_exact(config->block_size) < 0) {
+        printf("Error: sets and block size must be powers of 2 (block 4..%d)\n", MAX_BLOCK_SIZE);
+        return false;
+    }
+    if (config->ways <= 0 || config->mshrs <= 0 ||
+            config->hit_latency < 0 || config->miss_latency < 1) {
+        printf("Error: need ways > 0, mshrs > 0, hit >= 0 and miss >= 1\n");
+        return false;
+    }
+    return repl_check_ways(config->repl, config->ways);
+}
 
-        query_state_list_heads_list_t *next = l_of_l_ptr->next;
-        free(l_of_l_ptr);
-        l_of_l_ptr = next;
+bool cache_config_line(const char *line)
+{
+    char name[16];
+    int len;
+
+    if (sscanf(line, " %15s%n", name, &len) != 1 || name[0] == '#')
+        return true;
+
+    cache_config_t *config;
+    if (strcmp(name, "icache") == 0)
+        config = &i_cache_config;
+    else if (strcmp(name, "dcache") == 0)
+        config = &d_cache_config;
+    else if (strcmp(name, "l2") == 0)
+        config = &l2_cache_config;
+    else if (strcmp(name, "l3") == 0)
+        config = &l3_cache_config;
+    else {
+        printf("Error: unknown cache \"%s\"\n", name);
+        return false;
     }
+
+    config->enabled = true;
+    return cache_config_parse(config, line + len);
+}
+
+bool cache_config_load(const char *filename)
+{
+    FILE *fp = fopen(filename, "r");
+    char line[256];
+
+    if (fp == NULL) {
+        printf("Error: Can't open cache config file %s\n", filename);
+        return false;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (!cache_config_line(line)) {
+            fclose(fp);
+            return false;
+        }
+    }
+
+    fclose(fp);
+    return true;
+}
+
+void cache_destroy_all() {
+    // cache_destroy unregisters the cache, so always take the last one
+    while (global_cache_count > 0)
+        cache_destroy(global_cache_list[global_cache_count - 1]);
 }
 
 void cache_destroy(cache_t *c)
 {
-    for (int i = 0; i < c->num_sets; i++)
-        free(c->lines[i]);
-    free(c->lines);
+    // Logically all reads should be finished,
+    // so we must have a bug if this is not empty.
+    assert(c->mshrs_busy == 0);
+
+    for (int i = 0; i < global_cache_count; i++) {
+        if (global_cache_list[i] == c) {
+            global_cache_list[i] = global_cache_list[--global_cache_count];
+            break;
+        }
+    }
+
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "%s.", c->name);
+    stats_unregister(prefix);
+
+    free(c->storage);
+    free(c->mshrs);
     free(c);
 }
 
 
 /*
-* this function searches for the requested data in the cache. on a hit, this data
-* is immediately returned to the calling pipeline stage. on a miss, this function
-* returns NULL and the pipeline should begin a 10-cycle stall
-*/
-cache_line_t* search_cache(cache_t *c, uint64_t addr) {
-    int set_idx = truncator64(addr, 5, 11);
-    uint64_t tag = truncator64(addr, 11, 64);
-    cache_line_t* curr;
+ * MSHR table helpers. Block addresses of consecutive misses differ in their
+ * low bits, so a multiplicative hash spreads them over the table.
+ */
+static inline int mshr_home(cache_t *c, uint64_t block_addr)
+{
+    return (int)((block_addr * 0x9E3779B97F4A7C15ull) >> 40) & (c->mshr_slots - 1);
+}
 
-    for (int i = 0; i < c->num_lines; i++) {
-        curr = &c->lines[set_idx][i];
-        if ((curr->tag == tag) && curr->valid_bit)
-            return curr;
+// Returns the busy MSHR tracking addr's block, or NULL
+static mshr_t* mshr_find(cache_t *c, uint64_t addr)
+{
+    if (c->mshrs_busy == 0)
+        return NULL;
+
+    uint64_t block_addr = cache_block_addr(c, addr);
+    int slot = mshr_home(c, block_addr);
+    for (int i = 0; i < c->mshr_slots; i++) {
+        mshr_t *m = &c->mshrs[slot];
+        if (m->status == MSHR_FREE)
+            return NULL;
+        if (m->status == MSHR_BUSY && m->block_addr == block_addr)
+            return m;
+        slot = (slot + 1) & (c->mshr_slots - 1);
     }
-
     return NULL;
 }
 
+// Claims an MSHR for addr's block; returns NULL if all num_mshrs are busy.
+// The caller must have checked that the block has no MSHR yet.
+static mshr_t* mshr_claim(cache_t *c, uint64_t addr)
+{
+    if (c->mshrs_busy == c->num_mshrs)
+        return NULL;
+
+    uint64_t block_addr = cache_block_addr(c, addr);
+    int slot = mshr_home(c, block_addr);
+    // There are always at least mshr_slots/2 non-busy slots, so this ends
+    while (c->mshrs[slot].status == MSHR_BUSY)
+        slot = (slot + 1) & (c->mshr_slots - 1);
+
+    mshr_t *m = &c->mshrs[slot];
+    if (m->status == MSHR_DELETED)
+        c->mshrs_deleted--;
+    m->status = MSHR_BUSY;
+    m->block_addr = block_addr;
+    c->mshrs_busy++;
+    return m;
+}
+
+static void mshr_release(cache_t *c, mshr_t *m)
+{
+    assert(m->status == MSHR_BUSY);
+    m->status = MSHR_DELETED;
+    c->mshrs_busy--;
+    c->mshrs_deleted++;
+
+    // Once the table drains every tombstone can go, which keeps
+    // probe sequences short without ever rehashing.
+    if (c->mshrs_busy == 0 && c->mshrs_deleted > 0) {
+        for (int i = 0; i < c->mshr_slots; i++)
+            c->mshrs[i].status = MSHR_FREE;
+        c->mshrs_deleted = 0;
+    }
+}
+
+
+/*
+* this function searches for the requested data in the cache. on a hit, the index
+* of the line is immediately returned to the calling pipeline stage. on a miss, this
+* function returns -1 and the pipeline should begin a 10-cycle stall
+*/
+int search_cache(cache_t *c, uint64_t addr) {
+    int set_idx = cache_set_index(c, addr);
+    uint64_t tag = cache_tag(c, addr) | TAG_VALID;
+    int base = set_idx * c->num_lines;
+
+    int way = tag_match(&c->tags[base], c->num_lines, tag);
+    return way < 0 ? -1 : base + way;
+}
+
 
 /*
- * called in two cases:
- * 1) on cache hit
- * 2) on cache miss inside the cache_allocate function
- *    since a newly-introduced line becomes the MRU line
+ * called whenever a hit is served to the pipeline
  */
-void cache_update_timestamp(cache_line_t* line)
+void cache_touch(cache_t *c, int line)
 {
-    line->used_timestamp = ++timestamp_counter;
+    repl_touch(&c->repl, line / c->num_lines, line % c->num_lines);
 }
 
 /*
- * called on cache miss after 10th stalled cycle to update cache with a new line
+ * Moving whole lines between the levels. The level below c is c->next,
+ * or memory if there is none.
  */
-cache_line_t* cache_allocate(cache_t* c, uint64_t addr) {
-    int set_idx = truncator64(addr, 5, 11);
-    uint64_t tag = truncator64(addr, 11, 64);
-    cache_line_t *lru_line = &c->lines[set_idx][0];
+static void lower_read_block(cache_t *c, uint64_t addr, uint8_t *data);
+static void lower_write_block(cache_t *c, uint64_t addr, const uint8_t *data);
+static int cache_claim_line(cache_t *c, uint64_t addr);
+
+static void invalidate_line(cache_t *c, int line)
+{
+    c->tags[line] = 0; // see cache_claim_line
+    c->dirty[line] = 0;
+}
+
+// Called when an inclusive c evicts line: the levels above must drop their
+// copies too. A dirty copy above is newer than ours, so it is merged into
+// our line, which is then written back as part of the eviction.
+static void back_invalidate(cache_t *c, int line)
+{
+    uint64_t addr = cache_line_addr(c, line);
+
+    for (int i = 0; i < c->num_upper; i++) {
+        cache_t *u = c->upper[i];
+        int u_line = search_cache(u, addr);
+        if (u_line < 0)
+            continue;
+        if (u->inclusion == INCL_INCLUSIVE)
+            back_invalidate(u, u_line);
+        if (u->dirty[u_line]) {
+            memcpy(cache_line_data(c, line), cache_line_data(u, u_line), c->block_size);
+            c->dirty[line] = 1;
+        }
+        invalidate_line(u, u_line);
+    }
+}
+
+// Puts a line evicted from the level above into an exclusive c
+static void victim_fill(cache_t *c, uint64_t addr, const uint8_t *data, bool dirty)
+{
+    int line = search_cache(c, addr);
+    if (line < 0)
+        line = cache_claim_line(c, addr);
+
+    memcpy(cache_line_data(c, line), data, c->block_size);
+    if (dirty && c->write_back)
+        c->dirty[line] = 1;
+    else if (dirty)
+        lower_write_block(c, addr, data);
+}
+
+static void lower_read_block(cache_t *c, uint64_t addr, uint8_t *data)
+{
+    cache_t *n = c->next;
+
+    if (n == NULL) {
+        mem_read_block(addr, data, c->block_size);
+        return;
+    }
+
+    if (!cache_warming)
+        n->stat_accesses++;
+    int line = search_cache(n, addr);
+    if (line < 0) {
+        if (!cache_warming)
+            n->stat_misses++;
+        if (n->inclusion == INCL_EXCLUSIVE) {
+            lower_read_block(n, addr, data); // Goes to c only
+            return;
+        }
+        line = cache_allocate(n, addr);
+    } else {
+        if (!cache_warming)
+            n->stat_hits++;
+        cache_touch(n, line);
+    }
+    memcpy(data, cache_line_data(n, line), c->block_size);
+
+    if (n->inclusion == INCL_EXCLUSIVE) {
+        // The line moves up. It will come back clean, so write it down now.
+        if (n->dirty[line])
+            cache_sync_to_mem(n, line, addr);
+        invalidate_line(n, line);
+    }
+}
 
-    uint64_t mask = (uint64_t)-1 << LOG_BLOCK_SIZE;
-    addr &= mask; // The starting addr should be the requested addr "rounded down"
+static void lower_write_block(cache_t *c, uint64_t addr, const uint8_t *data)
+{
+    cache_t *n = c->next;
 
-    for (int i = 1; i < c->num_lines; i++) {
-        if (lru_line->used_timestamp > c->lines[set_idx][i].used_timestamp)
-            lru_line = &c->lines[set_idx][i];
+    if (n == NULL) {
+        mem_write_block(addr, data, c->block_size);
+        return;
     }
 
-    lru_line->valid_bit = 1;
-    lru_line->tag = tag;
-    cache_update_timestamp(lru_line);
-    for (int i = 0; i < BLOCK_SIZE; i += 4) {
-        write_to_byte_array(lru_line->data, 4, i, mem_read_32(addr + i));
+    // Lower levels don't allocate on a write from above
+    int line = search_cache(n, addr);
+    if (line < 0) {
+        lower_write_block(n, addr, data);
+        return;
+    }
+    memcpy(cache_line_data(n, line), data, c->block_size);
+    if (n->write_back)
+        n->dirty[line] = 1;
+    else
+        lower_write_block(n, addr, data);
+}
+
+// Picks the line addr's block goes into, evicting whatever was there, and
+// tags it. The data is left for the caller to fill in.
+static int cache_claim_line(cache_t *c, uint64_t addr)
+{
+    int set_idx = cache_set_index(c, addr);
+    uint64_t tag = cache_tag(c, addr);
+    int base = set_idx * c->num_lines;
+
+    // An invalid line has the all-zero tag it started with (or was given
+    // by invalidate_line); fill those before asking the policy for a victim.
+    int way = tag_match(&c->tags[base], c->num_lines, 0);
+    if (way < 0)
+        way = repl_victim(&c->repl, set_idx);
+    int line = base + way;
+
+    if (c->tags[line] & TAG_VALID) {
+        uint64_t victim_addr = cache_line_addr(c, line);
+        if (!cache_warming)
+            c->stat_evictions++;
+        if (c->inclusion == INCL_INCLUSIVE)
+            back_invalidate(c, line);
+
+        if (c->next != NULL && c->next->inclusion == INCL_EXCLUSIVE) {
+            victim_fill(c->next, victim_addr, cache_line_data(c, line), c->dirty[line]);
+            if (c->dirty[line] && !cache_warming)
+                c->stat_writebacks++;
+        } else if (c->dirty[line]) {
+            // Only a write-back cache has dirty lines
+            cache_sync_to_mem(c, line, victim_addr);
+        }
     }
 
-    return lru_line;
+    c->tags[line] = tag | TAG_VALID;
+    c->dirty[line] = 0;
+    repl_insert(&c->repl, set_idx, way);
+    return line;
+}
+
+/*
+ * called on cache miss after 10th stalled cycle to update cache with a new line
+ */
+int cache_allocate(cache_t* c, uint64_t addr) {
+    addr &= ~c->offset_mask; // The starting addr should be the requested addr "rounded down"
+
+    // Fetch before making room: the victim may go into an exclusive next
+    // level and push out the very block we are after.
+    uint8_t block[MAX_BLOCK_SIZE];
+    lower_read_block(c, addr, block);
+
+    int line = cache_claim_line(c, addr);
+    memcpy(cache_line_data(c, line), block, c->block_size);
+    return line;
+}
+
+// How long a miss in c takes: the hit latency of each level below down to
+// the first one holding addr, plus the memory latency if none does.
+static int cache_miss_latency(cache_t *c, uint64_t addr)
+{
+    int latency = 0;
+
+    while (c->next != NULL) {
+        c = c->next;
+        latency += c->hit_latency;
+        if (search_cache(c, addr) >= 0)
+            return latency;
+    }
+    return latency + c->miss_latency;
 }
 
 
 void cache_refresh_query_states() {
-    query_state_list_heads_list_t *l_of_l_ptr = global_query_state_list_heads_list_head;
-    while(l_of_l_ptr != NULL) {
-        query_state_list_t *l_ptr = l_of_l_ptr->head;
+    for (int k = 0; k < global_cache_count; k++) {
+        cache_t *c = global_cache_list[k];
 
         // To make the timings correct, we set wait_d_cache
         // in this func, rather than pipe_stage_mem
         // Warning: this manner of checking assumes that
         // the main pipe stall any time there's at least one
-        // query entry. For a different arch this may be false.
-        if(l_of_l_ptr->cache == d_cache) {
-            if(l_ptr == NULL) {
-                printf("wait_d_cache being turned off\n");
+        // busy MSHR. For a different arch this may be false.
+        c->stat_mshr_occupancy += c->mshrs_busy;
+
+        if(c == d_cache) {
+            if(c->mshrs_busy == 0) {
+                TRACE(TRACE_CACHE, TRACE_LVL_VERBOSE, "wait_d_cache being turned off\n");
                 wait_d_cache = false;
             } else {
                 wait_d_cache = true;
             }
         }
 
-        while(l_ptr != NULL) {
-            l_ptr->state->remaining_cycles--;
+        for (int i = 0; i < c->mshr_slots && c->mshrs_busy > 0; i++) {
+            mshr_t *m = &c->mshrs[i];
+            if (m->status != MSHR_BUSY)
+                continue;
+
+            m->state.remaining_cycles--;
 
             // Changed from previous implementation. The current implementation is such that
             // cache_refresh_query_states is responsible for both decrementing the timers
             // and allocating (and populating) cache lines when timer is 0. This is only cancelled
             // if cache_cancel is explicitly called by the core pipeline.
-            assert(l_ptr->state->remaining_cycles >= 0);
-            if(l_ptr->state->remaining_cycles == 0) {
-
-                uint64_t addr = l_ptr->state->addr;
-                cache_t *c = l_of_l_ptr->cache;
-                cache_line_t *c_line = cache_allocate(c, addr); // c_line won't be actually used as of now
-
-                // Purge the query entry
-                query_state_list_t *l_next = l_ptr->next;
-                if(l_ptr->prev == NULL) {
-                    l_of_l_ptr->head = l_next;
-                }
-                else {
-                    l_ptr->prev->next = l_next;
-                }
-                if (l_next != NULL) {
-                    l_next->prev = l_ptr->prev;
+            if(m->fill) {
+                assert(m->state.remaining_cycles >= 0);
+                if(m->state.remaining_cycles == 0) {
+                    cache_allocate(c, m->state.addr); // the line won't be actually used as of now
+                    // The access that missed now waits out hit_latency like
+                    // a slow hit, but is served without touching the line:
+                    // the fill already told the replacement policy about it.
+                    m->fill = false;
+                    m->filled = true;
+                    m->state.remaining_cycles = c->hit_latency;
                 }
-                free(l_ptr->state);
-                l_ptr->state = NULL;
-                free(l_ptr);
-                l_ptr = l_next;
             }
-            else {
-                l_ptr = l_ptr->next;
+            else if(m->state.remaining_cycles < 0) {
+                // A slow hit is purged by cache_read_handler the cycle its
+                // data is ready; if nobody came for it, it's orphaned.
+                mshr_release(c, m);
             }
         }
-
-        l_of_l_ptr = l_of_l_ptr->next;
     }
 }
 
-void cache_cancel(cache_t *c, uint64_t addr)
+int cache_quiet_cycles()
 {
-    query_state_list_heads_list_t *l_of_l_ptr = global_query_state_list_heads_list_head;
-    while(l_of_l_ptr != NULL && l_of_l_ptr->cache != c) {
-        l_of_l_ptr = l_of_l_ptr->next;
+    int quiet = INT_MAX;
+
+    for (int k = 0; k < global_cache_count; k++) {
+        cache_t *c = global_cache_list[k];
+        for (int i = 0; i < c->mshr_slots && c->mshrs_busy > 0; i++) {
+            mshr_t *m = &c->mshrs[i];
+            // Something happens in the cycle that starts with 1 left: a
+            // fill, or the data is handed out or the entry dropped
+            if (m->status == MSHR_BUSY && m->state.remaining_cycles - 1 < quiet)
+                quiet = m->state.remaining_cycles - 1;
+        }
     }
+    return quiet < 0 ? 0 : quiet;
+}
 
-    assert(l_of_l_ptr != NULL);
-    // Throw if c is not a recognized cache.
-
-    query_state_list_t *l_ptr = l_of_l_ptr->head;
-    uint64_t mask = (uint64_t)-1 << LOG_BLOCK_SIZE;
-    while(l_ptr != NULL && ((l_ptr->state->addr & mask) != (addr & mask))) {
-        l_ptr = l_ptr->next;
+void cache_skip_cycles(int n)
+{
+    for (int k = 0; k < global_cache_count; k++) {
+        cache_t *c = global_cache_list[k];
+        c->stat_mshr_occupancy += (uint64_t)c->mshrs_busy * n;
+        for (int i = 0; i < c->mshr_slots && c->mshrs_busy > 0; i++) {
+            if (c->mshrs[i].status == MSHR_BUSY) {
+                assert(c->mshrs[i].state.remaining_cycles > n);
+                c->mshrs[i].state.remaining_cycles -= n;
+            }
+        }
     }
+}
+
+void cache_cancel(cache_t *c, uint64_t addr)
+{
+    mshr_t *m = mshr_find(c, addr);
 
-    if(l_ptr == NULL) {
+    if(m == NULL) {
         // The request to cancel does not exist--nothing to do
-        printf("Did not find entry to purge.\n");
+        TRACE(TRACE_CACHE, TRACE_LVL_EVENT, "Did not find entry to purge.\n");
         return;
     }
-        printf("Found entry to purge.\n");
+    TRACE(TRACE_CACHE, TRACE_LVL_EVENT, "Found entry to purge.\n");
 
     // Simply purge the query entry
-    if(l_ptr->prev == NULL) {
-        l_of_l_ptr->head = l_ptr->next;
-    }
-    else {
-        l_ptr->prev->next = l_ptr->next;
-    }
-    free(l_ptr->state);
-    l_ptr->state = NULL;
-    free(l_ptr);
-    l_ptr = NULL;
+    mshr_release(c, m);
 }
 
 
 query_state_t cache_read_handler(cache_t *c, uint64_t addr, size_t size)
 {
-    query_state_list_heads_list_t *l_of_l_ptr = global_query_state_list_heads_list_head;
-    while(l_of_l_ptr != NULL && l_of_l_ptr->cache != c) {
-        l_of_l_ptr = l_of_l_ptr->next;
-    }
-
-    assert(l_of_l_ptr != NULL);
+    assert(c == i_cache || c == d_cache);
     // Throw if c is not a recognized cache.
 
-    query_state_list_t *l_ptr = l_of_l_ptr->head;
-    uint64_t mask = (uint64_t)-1 << LOG_BLOCK_SIZE;
-    while(l_ptr != NULL && (l_ptr->state->addr & mask) != (addr & mask)) {
-        l_ptr = l_ptr->next;
-    }
+    mshr_t *m = mshr_find(c, addr);
 
     query_state_t result;
-    if(l_ptr != NULL) { // This is a miss that is already in the "load queue".
-        result = *l_ptr->state;
-        if(l_of_l_ptr->cache == i_cache)
-            printf("icache bubble (%d) at cycle %d\n", result.remaining_cycles, stat_cycles+1);
-        else if(l_of_l_ptr->cache == d_cache)
-            printf("dcache stall (%d) at cycle %d\n", result.remaining_cycles, stat_cycles+1);
-        else
-            assert(0);
+    if(m != NULL) { // This is a miss (or slow hit) that is already in the "load queue".
+        result = m->state;
+        TRACE(TRACE_CACHE, TRACE_LVL_VERBOSE, "%s (%d) at cycle %d\n",
+              c == i_cache ? "icache bubble" : "dcache stall",
+              result.remaining_cycles, stat_cycles+1);
         if(result.remaining_cycles == 0) {
             // Read bytes out of the array of bytes in the cache line
             // based on the offset derived from the addr.
@@ -257,74 +741,72 @@ query_state_t cache_read_handler(cache_t *c, uint64_t addr, size_t size)
             //cache_line_t *c_line = cache_allocate(c, addr);
             // Change: moved the cache_allocate invocation to cache_refresh_query_states
             //         Now we can assume it's already allocated.
-            cache_line_t *c_line = search_cache(c, addr);
-            assert(c_line != NULL);
-            uint64_t offset = truncator64(addr, 0, 5);
+            int line = search_cache(c, addr);
+            if(line < 0) {
+                // An inclusive level below evicted the block while the
+                // entry waited out hit_latency, and took our copy with it.
+                // The data was on its way, so fill again at no extra cost.
+                line = cache_allocate(c, addr);
+            } else if(!m->filled) {
+                cache_touch(c, line);
+            }
+            uint64_t offset = cache_block_offset(c, addr);
             result.data = read_from_byte_array(
-                c_line->data,
+                cache_line_data(c, line),
                 size,
                 offset
             );
-            result.c_line =c_line;
+            result.line = line;
 
             // Purge the query entry
-            if(l_ptr->prev == NULL) {
-                l_of_l_ptr->head = l_ptr->next;
-            }
-            else {
-                l_ptr->prev->next = l_ptr->next;
-            }
-            free(l_ptr->state);
-            l_ptr->state = NULL;
+            mshr_release(c, m);
         }
     } else {
         // This is new read request. We first try to find the data in the cache.
-        // In the case of a miss, we need to create a new query entry, and let
+        // In the case of a miss, we need to claim an MSHR, and let
         // the calling pipeline stage know it needs to stall.
-        cache_line_t *c_line = search_cache(c, addr);
-        if(c_line != NULL) { // Cache hit
-            if(l_of_l_ptr->cache == i_cache)
-                printf("icache hit (0x%lx) at cycle %d\n", addr, stat_cycles+1);
-            else if(l_of_l_ptr->cache == d_cache)
-                printf("dcache hit (0x%lx) at cycle %d\n", addr, stat_cycles+1);
-            else
-                assert(0);
+        int line = search_cache(c, addr);
+        if(line >= 0 && c->hit_latency == 0) { // Cache hit
+            c->stat_accesses++;
+            c->stat_hits++;
+            TRACE(TRACE_CACHE, TRACE_LVL_VERBOSE, "%s hit (0x%lx) at cycle %d\n",
+                  c == i_cache ? "icache" : "dcache", addr, stat_cycles+1);
+            cache_touch(c, line);
             result.addr = addr;
             result.remaining_cycles = 0;
-            size_t shift = 0;
-            uint64_t offset = truncator64(addr, 0, 5);
-            result.data = read_from_byte_array(c_line->data, size, offset);
-            result.c_line = c_line;
+            uint64_t offset = cache_block_offset(c, addr);
+            result.data = read_from_byte_array(cache_line_data(c, line), size, offset);
+            result.line = line;
         }
-        else { // Cache miss
-            if(l_of_l_ptr->cache == i_cache)
-                printf("icache miss (0x%lx) at cycle %d\n", addr, stat_cycles+1);
-            else if(l_of_l_ptr->cache == d_cache)
-                printf("dcache miss (0x%lx) at cycle %d\n", addr, stat_cycles+1);
+        else if((m = mshr_claim(c, addr)) == NULL) { // Need to wait, but no MSHR free
+            TRACE(TRACE_CACHE, TRACE_LVL_EVENT, "%s MSHRs full (0x%lx) at cycle %d\n",
+                  c == i_cache ? "icache" : "dcache", addr, stat_cycles+1);
+            c->stat_mshr_full++;
+            result.addr = addr;
+            result.remaining_cycles = MSHR_FULL_RETRY;
+            result.line = -1;
+        }
+        else { // Cache miss, or a hit that takes hit_latency cycles
+            TRACE(TRACE_CACHE, TRACE_LVL_EVENT, "%s %s (0x%lx) at cycle %d\n",
+                  c == i_cache ? "icache" : "dcache", line < 0 ? "miss" : "slow hit",
+                  addr, stat_cycles+1);
+            // After a fill the entry waits another hit_latency cycles,
+            // so a miss costs miss_latency + hit_latency in total.
+            m->fill = line < 0;
+            m->filled = false;
+            m->state.addr = addr;
+            m->state.remaining_cycles = m->fill ? cache_miss_latency(c, addr) : c->hit_latency;
+            c->stat_accesses++;
+            if(m->fill)
+                c->stat_misses++;
             else
-                assert(0);
-            l_ptr = (query_state_list_t*)malloc(sizeof(query_state_list_t));
-            l_ptr->state = (query_state_t*)malloc(sizeof(query_state_t));
-            l_ptr->state->addr = addr;
-            if(c == i_cache) {
-                l_ptr->state->remaining_cycles = INST_MISS_DELAY;
-            }
-            else if(c == d_cache) {
-                l_ptr->state->remaining_cycles = DATA_MISS_DELAY;
-            }
-            else {
-                assert(0);
-            }
-            // l_ptr->state->data just remains garbage
-            l_ptr->state->c_line = NULL; // This could also remain garbage,
-                                         // but we explicitlyset it to NULL
-                                         // so bugs result in crashes and are
-                                         // easier to catch.
-            l_ptr->prev = NULL;
-            l_ptr->next = l_of_l_ptr->head;
-            l_of_l_ptr->head = l_ptr;
-
-            result = *l_ptr->state;
+                c->stat_hits++;
+            // m->state.data just remains garbage
+            m->state.line = -1; // This could also remain garbage,
+                                // but we explicitly set it to -1
+                                // so bugs result in crashes and are
+                                // easier to catch.
+            result = m->state;
         }
     }
 
@@ -336,39 +818,202 @@ query_state_t cache_read_handler(cache_t *c, uint64_t addr, size_t size)
 // the return value's remaining_cycles
 query_state_t cache_write_handler(cache_t *c, uint64_t addr, size_t size, uint64_t data) {
     query_state_t q = cache_read_handler(c, addr, size);
-    size_t offset = truncator64(addr, 0, 5);
+    size_t offset = cache_block_offset(c, addr);
 
     if(q.remaining_cycles == 0) {
-        assert(q.c_line!= NULL);
-        write_to_byte_array(q.c_line->data, size, offset, data);
-        cache_sync_to_mem(c, q.c_line, addr);
+        assert(q.line >= 0);
+        write_to_byte_array(cache_line_data(c, q.line), size, offset, data);
+        if(c->write_back)
+            c->dirty[q.line] = 1;
+        else // Write-through traffic, not a writeback
+            lower_write_block(c, addr & ~c->offset_mask, cache_line_data(c, q.line));
     }
 
     return q;
 }
 
-void cache_sync_to_mem(cache_t *c, cache_line_t *c_line, uint64_t addr) {
-    assert(c == d_cache);
-    // If not, we'll need to take different tag bits etc.
+void cache_sync_to_mem(cache_t *c, int line, uint64_t addr) {
+    assert(c->tags[line] == (cache_tag(c, addr) | TAG_VALID));
+    assert(line / c->num_lines == cache_set_index(c, addr));
+
+    if (!cache_warming)
+        c->stat_writebacks++;
+    lower_write_block(c, addr & ~c->offset_mask, cache_line_data(c, line));
+}
+
+void cache_flush(cache_t *c)
+{
+    if (!c->write_back)
+        return;
+
+    for (int line = 0; line < c->num_sets * c->num_lines; line++) {
+        if (!c->dirty[line])
+            continue;
+        cache_sync_to_mem(c, line, cache_line_addr(c, line));
+        c->dirty[line] = 0;
+    }
+}
+
+void cache_flush_all()
+{
+    for (int k = 0; k < global_cache_count; k++)
+        cache_flush(global_cache_list[k]);
+}
+
+uint32_t cache_peek_32(uint64_t addr)
+{
+    // Stores only go into d_cache, so the newest copy of a block is the
+    // first dirty one on the way down from there
+    for (cache_t *c = d_cache; c != NULL; c = c->next) {
+        int line = search_cache(c, addr);
+        if (line >= 0 && c->write_back && c->dirty[line])
+            return (uint32_t)read_from_byte_array(cache_line_data(c, line), 4,
+                                                  cache_block_offset(c, addr));
+    }
+    return mem_read_32(addr);
+}
+
+int cache_warm(cache_t *c, uint64_t addr, bool is_write)
+{
+    cache_warming = true;
+    int line = search_cache(c, addr);
+    if (line >= 0)
+        cache_touch(c, line);
+    else
+        line = cache_allocate(c, addr);
+    // The data is already right: stores patch every copy themselves
+    if (is_write && c->write_back)
+        c->dirty[line] = 1;
+    cache_warming = false;
+    return line;
+}
+
+void cache_patch_all(uint64_t addr, size_t size, uint64_t data)
+{
+    for (int k = 0; k < global_cache_count; k++) {
+        cache_t *c = global_cache_list[k];
+        int line = search_cache(c, addr);
+        if (line >= 0)
+            write_to_byte_array(cache_line_data(c, line), size, addr & c->offset_mask, data);
+    }
+}
+
+// What has to match for a cache's state to be restored into another
+typedef struct {
+    char name[8];
+    char repl[16];
+    int sets, ways, block_size, mshr_slots;
+    bool write_back;
+    inclusion_t inclusion;
+    size_t storage_size;
+} cache_ckpt_config_t;
+
+static void cache_ckpt_config(cache_t *c, cache_ckpt_config_t *config)
+{
+    memset(config, 0, sizeof(*config)); // No stray bytes in the file
+    snprintf(config->name, sizeof(config->name), "%s", c->name);
+    snprintf(config->repl, sizeof(config->repl), "%s", c->repl.ops->name);
+    config->sets = c->num_sets;
+    config->ways = c->num_lines;
+    config->block_size = c->block_size;
+    config->mshr_slots = c->mshr_slots;
+    config->write_back = c->write_back;
+    config->inclusion = c->inclusion;
+    config->storage_size = c->storage_size;
+}
 
-    assert(c_line->tag == truncator64(addr, 11, 64));
-    // Ideally we also check the set is correct, but it's
-    // pretty trick to infer the set number from a cache_line_t
-    // pointer. We consider changing our implementation to
-    // use full address in the tag in the future.
+bool cache_save_config(FILE *fp)
+{
+    if (!ckpt_write(fp, &global_cache_count, sizeof(global_cache_count)))
+        return false;
+    for (int k = 0; k < global_cache_count; k++) {
+        cache_ckpt_config_t config;
+        cache_ckpt_config(global_cache_list[k], &config);
+        if (!ckpt_write(fp, &config, sizeof(config)))
+            return false;
+    }
+    return true;
+}
 
-    assert(BLOCK_SIZE % 4 == 0);
-    // If not, some more code will be necessary.
+bool cache_check_config(FILE *fp)
+{
+    int count;
 
-    addr &= 0xFFFFFFFFFFFFF800;
-    size_t shift = 0;
-    for(int i=0; i < BLOCK_SIZE/4; i++) {
-        uint32_t num = 0;
-        for(int j=0; j < 4; j++) {
-            num += c_line->data[i*4 + j] << shift;
-            shift += 8;
+    if (!ckpt_read(fp, &count, sizeof(count)) || count != global_cache_count) {
+        printf("Error: the checkpoint has a different number of caches\n");
+        return false;
+    }
+    for (int k = 0; k < count; k++) {
+        cache_ckpt_config_t saved, ours;
+        cache_ckpt_config(global_cache_list[k], &ours);
+        if (!ckpt_read(fp, &saved, sizeof(saved)) ||
+            memcmp(&saved, &ours, sizeof(saved)) != 0) {
+            printf("Error: %s is not configured as in the checkpoint (%s, %d sets, "
+                   "%d ways, %d-byte blocks, %d MSHR slots, write-%s, incl %d)\n",
+                   ours.name, saved.repl, saved.sets, saved.ways, saved.block_size,
+                   saved.mshr_slots, saved.write_back ? "back" : "through",
+                   (int)saved.inclusion);
+            return false;
         }
-        mem_write_32(addr, num);
-        addr += 4;
     }
-}
\ No newline at end of file
+    return true;
+}
+
+#define CACHE_CKPT_ITEMS 12
+
+// Everything in c that changes as it runs; returns how many items
+static int cache_ckpt_items(cache_t *c, ckpt_item_t *items)
+{
+    int n = 0;
+    items[n++] = (ckpt_item_t) { c->storage, c->storage_size };
+    items[n++] = (ckpt_item_t) CKPT_ITEM(c->repl.rng);
+    items[n++] = (ckpt_item_t) { c->mshrs, c->mshr_slots * sizeof(mshr_t) };
+    items[n++] = (ckpt_item_t) CKPT_ITEM(c->mshrs_busy);
+    items[n++] = (ckpt_item_t) CKPT_ITEM(c->mshrs_deleted);
+    items[n++] = (ckpt_item_t) CKPT_ITEM(c->stat_accesses);
+    items[n++] = (ckpt_item_t) CKPT_ITEM(c->stat_hits);
+    items[n++] = (ckpt_item_t) CKPT_ITEM(c->stat_misses);
+    items[n++] = (ckpt_item_t) CKPT_ITEM(c->stat_evictions);
+    items[n++] = (ckpt_item_t) CKPT_ITEM(c->stat_writebacks);
+    items[n++] = (ckpt_item_t) CKPT_ITEM(c->stat_mshr_occupancy);
+    items[n++] = (ckpt_item_t) CKPT_ITEM(c->stat_mshr_full);
+    assert(n == CACHE_CKPT_ITEMS);
+    return n;
+}
+
+bool cache_save_all(FILE *fp)
+{
+    ckpt_item_t items[CACHE_CKPT_ITEMS];
+
+    if (!repl_save(fp))
+        return false;
+    for (int k = 0; k < global_cache_count; k++) {
+        int n = cache_ckpt_items(global_cache_list[k], items);
+        if (!ckpt_write_items(fp, items, n))
+            return false;
+    }
+    return true;
+}
+
+bool cache_load_all(FILE *fp)
+{
+    ckpt_item_t items[CACHE_CKPT_ITEMS];
+
+    if (!repl_load(fp))
+        return false;
+    for (int k = 0; k < global_cache_count; k++) {
+        int n = cache_ckpt_items(global_cache_list[k], items);
+        if (!ckpt_read_items(fp, items, n))
+            return false;
+    }
+    return true;
+}
+
+void cache_print_stats(FILE *fp)
+{
+    for (int k = 0; k < global_cache_count; k++) {
+        cache_t *c = global_cache_list[k];
+        fprintf(fp, "%-3s accesses: %" PRIu64 " misses: %" PRIu64 " writebacks: %" PRIu64 "\n",
+                c->name, c->stat_accesses, c->stat_misses, c->stat_writebacks);
+    }
+}
@@ -2,47 +2,66 @@
 #define _CACHE_H_
 
 #include "pipe.h"
+#include "repl.h"
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <assert.h>
+#include <stdio.h>
 
+// Defaults for the cache geometry; all of it can be changed at startup
+// (see cache_config_t)
 #define INST_MISS_DELAY 10
 #define DATA_MISS_DELAY 10
 #define BLOCK_SIZE 32
-#define LOG_BLOCK_SIZE 5
+#define L2_HIT_DELAY 10 // Only used if an L2 (or L3) is enabled
+#define L3_HIT_DELAY 30
+#define MEM_DELAY 100   // The miss latency of the last level below L1
+#define MAX_BLOCK_SIZE 4096
 
-extern uint64_t timestamp_counter;
-typedef struct
-{
-    int valid_bit;
-    uint64_t tag;
-    uint64_t used_timestamp;
-    // We use a 64-bit integer for each cache line, together with a global 64-bit
-    // timestamp_counter, to keep track of which line is recently used.
-    // The global counter is initialized to 0, and every time *any* line is used,
-    // the counter is bumped up by 1, representing a uni-direction flow of time.
-    // The used_timestamp is then set to the new value of the global counter.
-    // Now whenever we need to evict a line, we search and find the one with
-    // the oldest used_timestamp. This new line is now the most-recently used,
-    // so its used_timestamp is also updated to the global timestamp++
-    // 64 bits is large enough regarding concerns of overflow--on a machine that
-    // reads into the cache 10^12 times a second, it takes a few hundred years
-    // to hit an overflow, and it's only a problem if some other cache line sits
-    // there neither used nor evicted over the hundreds of years.
-    uint8_t data[BLOCK_SIZE]; // Each block is specified to be 32 bytes
-                              // (able to hold 8 inst or 8 data words)
-} cache_line_t;
+// Set in a tags[] entry when the line holds valid data. Tags are the
+// address bits above the set index, so the top bit is otherwise clear
+// and a single compare checks both the tag and the valid bit.
+#define TAG_VALID ((uint64_t)1 << 63)
+
+#define HOST_LINE_SIZE 64 // Alignment of the arrays inside cache_t storage
 
+#define MSHR_FULL_RETRY 1 // remaining_cycles reported when no MSHR is free
+#define INST_MSHRS 4 // Default number of outstanding misses per cache
+#define DATA_MSHRS 8
+
+// How a lower-level cache (L2/L3) relates to the levels above it
+typedef enum {
+    INCL_NINE,      // Filled on a miss from above, but evicts on its own
+    INCL_INCLUSIVE, // Also invalidates a line above when it evicts it
+    INCL_EXCLUSIVE  // Only holds lines evicted from above; a hit moves
+                    // the line up
+} inclusion_t;
+
+// Everything needed to build a cache. Sets and block size must be powers
+// of 2. Latencies are in cycles: a hit with hit_latency 0 is served in the
+// same cycle, anything else stalls the requesting stage like a miss does.
+// A missing access waits out hit_latency after the fill, so it takes
+// miss_latency + hit_latency cycles.
 typedef struct
 {
-    int num_sets;
-    int num_lines; // lines/blocks per set
-    cache_line_t** lines; // the row index of this array is the set index
-                          // aka this is a num_sets x num_lines 2D array
-} cache_t;
+    int sets;
+    int ways;
+    int block_size;   // bytes
+    int hit_latency;
+    int miss_latency;
+    int mshrs;
+    repl_policy_t repl;
+    bool write_back;  // false: every store is written through to memory
+    inclusion_t inclusion; // L2/L3 only
+    bool enabled;     // L2/L3 are only built if asked for
+} cache_config_t;
 
-extern cache_t *i_cache, *d_cache;
+// The configurations cache_init_all builds i_cache and d_cache from, and
+// the L2 and L3 if those are enabled. They start out as the defaults
+// above and may be changed beforehand with cache_config_parse.
+extern cache_config_t i_cache_config, d_cache_config;
+extern cache_config_t l2_cache_config, l3_cache_config;
 
 // The following structs keep track of data read requests in cases of misses
 typedef struct
@@ -52,83 +71,238 @@ typedef struct
                           // This should be SIGNED, as negative values are
                           // actively used to represent orphaned queries.
     uint64_t data;        // Can be garbage if !ready
-    cache_line_t *c_line; // For the convenience of cache_write_handler which
+    int line;             // For the convenience of cache_write_handler which
                           // calls cache_read_handler; can be garbage if !ready
 } query_state_t;
 
-typedef struct query_state_list_t
+typedef enum {
+    MSHR_FREE,    // Never used since the table was last empty; ends a probe
+    MSHR_BUSY,    // Holds an outstanding miss
+    MSHR_DELETED  // Tombstone; a probe has to continue past it
+} mshr_status_t;
+
+// One miss status holding register.
+typedef struct
 {
-    query_state_t *state;
-    struct query_state_list_t *prev;
-    struct query_state_list_t *next;
-} query_state_list_t;
+    mshr_status_t status;
+    uint64_t block_addr; // addr >> offset_bits, the key of the table
+    bool fill;           // false for a hit that only waits out hit_latency
+    bool filled;         // a fill that is done and now waits out hit_latency
+    query_state_t state;
+} mshr_t;
+
+#define MAX_UPPER_CACHES 2
 
-typedef struct query_state_list_heads_list_t
+typedef struct cache cache_t;
+struct cache
 {
-    cache_t *cache; // For identifying the right entry for the cache
-    query_state_list_t *head;
-    //query_state_list_heads_list_t *prev; // We don't really need this
-    struct query_state_list_heads_list_t *next;
-} query_state_list_heads_list_t;
-
-extern query_state_list_heads_list_t *global_query_state_list_heads_list_head;
-
-// Visualization of these linked lists:
-/*
-  q  q  q  q
-  ^  ^  ^  ^
-  |  |  |  |
-  q  q  q  q
-  ^  ^  ^  ^
-  |  |  |  |
-->c->c->c->c
-*/
-// where each c is a query_list_heads_list_t,
-// and each q is a query_state_list_t
+    const char *name;
+    int num_sets;
+    int num_lines; // lines/blocks per set
+    int block_size;
+    int hit_latency;
+    int miss_latency;
+
+    // An address splits into | tag | set index | block offset |.
+    // The masks and shifts are worked out once in cache_new.
+    int offset_bits;
+    int index_bits;
+    uint64_t offset_mask;
+    uint64_t index_mask;  // applied after shifting out the offset
+
+    // Lines are stored as a structure of arrays carved out of one
+    // allocation. Line (set, way) is index set * num_lines + way in each
+    // array, so the tags of a set sit next to each other and a lookup
+    // never touches the replacement state or the data. Each array starts
+    // on a host cache line boundary.
+    uint64_t *tags;            // TAG_VALID | tag
+    uint8_t *dirty;            // Only used when write_back; 1 per line
+    uint8_t *data;             // block_size bytes per line
+    repl_t repl;               // Replacement policy; its state is in storage too
+    void *storage;             // The allocation backing the arrays above
+    size_t storage_size;
+
+    // Outstanding misses live in a fixed-size open-addressed hash table
+    // keyed by block address, so no allocation happens after cache_new.
+    // The table has twice as many slots as we allow MSHRs to keep probes
+    // short; tombstones are dropped whenever the table drains.
+    mshr_t *mshrs;
+    int mshr_slots;  // size of the table; a power of 2
+    int num_mshrs;   // how many misses may be outstanding at once
+    int mshrs_busy;
+    int mshrs_deleted;
+
+    // A write-back cache only writes a line to memory when it is evicted
+    // or flushed; a write-through one on every store.
+    bool write_back;
+
+    // The hierarchy. A miss is filled from next, or from memory if there
+    // is no next level; in that case miss_latency is the memory latency.
+    // upper lists the caches whose misses come to us.
+    cache_t *next;
+    cache_t *upper[MAX_UPPER_CACHES];
+    int num_upper;
+    inclusion_t inclusion;
 
+    uint64_t stat_accesses; // Lookups from the pipeline or the level above
+    uint64_t stat_hits;
+    uint64_t stat_misses;
+    uint64_t stat_evictions; // Valid lines replaced by a fill
+    uint64_t stat_writebacks; // Dirty lines written to the level below
+    uint64_t stat_mshr_occupancy; // Busy MSHRs summed over every cycle
+    uint64_t stat_mshr_full; // Requests turned away with every MSHR busy
+};
+
+extern cache_t *i_cache, *d_cache;
+extern cache_t *l2_cache, *l3_cache; // NULL unless enabled
+
+// Lines are identified by their index into the arrays of cache_t
+static inline uint8_t* cache_line_data(cache_t *c, int line)
+{
+    return c->data + (size_t)line * c->block_size;
+}
+
+static inline uint64_t cache_block_addr(cache_t *c, uint64_t addr)
+{
+    return addr >> c->offset_bits;
+}
+
+static inline int cache_set_index(cache_t *c, uint64_t addr)
+{
+    return (int)((addr >> c->offset_bits) & c->index_mask);
+}
+
+static inline uint64_t cache_tag(cache_t *c, uint64_t addr)
+{
+    return addr >> (c->offset_bits + c->index_bits);
+}
+
+static inline size_t cache_block_offset(cache_t *c, uint64_t addr)
+{
+    return addr & c->offset_mask;
+}
+
+// The address of the first byte of a valid line, from its tag and set
+static inline uint64_t cache_line_addr(cache_t *c, int line)
+{
+    uint64_t set_idx = (uint64_t)(line / c->num_lines);
+    return ((c->tags[line] & ~TAG_VALID) << (c->offset_bits + c->index_bits))
+         | (set_idx << c->offset_bits);
+}
+
+#define MAX_CACHES 8
+
+// Every cache created with cache_new, so that cache_refresh_query_states
+// can tick all of them.
+extern cache_t *global_cache_list[MAX_CACHES];
+extern int global_cache_count;
 
 void cache_init_all();
 
-// Responsible for mallocating the cache struct
-// as well as register it in the global_query_list_heads_list
-cache_t* cache_new(int sets, int ways, int block);
+// Responsible for mallocating the cache struct and its MSHR table
+// as well as register it in the global_cache_list
+cache_t* cache_new(cache_config_t config);
+
+// Applies a list of key=value settings, separated by commas or
+// whitespace, to *config. Keys are sets, ways, block, hit, miss, mshrs and
+// repl, which takes a policy name (lru, plru, bitplru, srrip, brrip or
+// random), write, which is back or through, and incl, which is inclusive,
+// exclusive or nine; e.g. "sets=128,ways=2,miss=50,repl=srrip,write=back".
+// Prints the problem
+// and returns false if the spec is malformed or leaves an invalid geometry.
+bool cache_config_parse(cache_config_t *config, const char *spec);
+
+// Applies one "<cache> <settings>" line, where <cache> is icache, dcache,
+// l2 or l3 (naming l2 or l3 enables it) and <settings> is as for
+// cache_config_parse. Blank lines and lines starting with # do nothing.
+bool cache_config_line(const char *line);
+
+// Reads a config file of such lines, one per cache
+bool cache_config_load(const char *filename);
 
 // Call this before the program terminates
 void cache_destroy_all();
 
 // Deallocates one cache struct
-// and removes it from global_query_list_heads_list
+// and removes it from global_cache_list
 void cache_destroy(cache_t *c);
 
 
-void cache_update_timestamp(cache_line_t* line);
-// Get data from memory, update the corresponding query_state_t entry,
-// and return the data.
-cache_line_t* cache_allocate(cache_t* c, uint64_t addr);
+// Returns the index of the line holding addr, or -1 on a miss
+int search_cache(cache_t *c, uint64_t addr);
+
+// Tells the replacement policy that line was hit
+void cache_touch(cache_t *c, int line);
+// Get data from memory into addr's set, in an invalid line if there is one
+// and otherwise in the one the replacement policy picks, and return the
+// index of that line.
+int cache_allocate(cache_t* c, uint64_t addr);
 
 // Should be called once each cycle to decrement the
-// remaining_cycles in each query_state_list_t entry.
+// remaining_cycles in each busy MSHR.
 void cache_refresh_query_states();
 
+// How many cycles can pass before any busy MSHR has something to do: the
+// smallest remaining_cycles, less one, or INT_MAX if no miss is
+// outstanding. Nothing but the countdown happens in those cycles.
+int cache_quiet_cycles();
+// Counts every busy MSHR down by n cycles at once; n must be at most
+// cache_quiet_cycles()
+void cache_skip_cycles(int n);
+
 void cache_cancel(cache_t *c, uint64_t addr);
 
-// This function wraps mem_read_32. From now on, pipe.c should always call this
-// function in place of the "raw" mem_read_32. `size` is in terms of bytes.
+// This function wraps the mem_read accessors. pipe.c should always call this
+// function in place of the "raw" memory reads. `size` is in terms of bytes.
 //
-// When a miss happens, it allocates and initializes a new linked list
-// entry in the query_state_list, and returns this entry. With each
-// subsequent call, it returns this same entry identified by addr, but the
-// remaining_cycles will have been decremented--all until remaining_cycle hits
-// 0, when the data field will be populated and the entry will be purged.
-// (Needing to purge the entry before returning is the reason we return a
-// struct rather than a ptr to it.)
+// When a miss happens, it claims and initializes an MSHR, and returns its
+// query state. With each subsequent call, it returns this same entry
+// identified by addr, but the remaining_cycles will have been
+// decremented--all until remaining_cycle hits 0, when the data field will be
+// populated and the entry will be purged. (Needing to purge the entry before
+// returning is the reason we return a struct rather than a ptr to it.)
+// If every MSHR is busy the miss is not recorded and remaining_cycles is
+// MSHR_FULL_RETRY, so the caller stalls and asks again next cycle.
 query_state_t cache_read_handler(cache_t *c, uint64_t addr, size_t size);
 query_state_t cache_write_handler(cache_t *c, uint64_t addr, size_t size, uint64_t data);
 
-// Write the cache contents to the memory
-// As we have a write-through cache, this is called
-// in cache_write_handler and nowhere else.
+// Write the cache contents to the next level, or to memory, and count a
+// writeback. A write-back cache calls this when a dirty line is evicted or
+// flushed; write-through stores aren't writebacks and don't come here.
 // Note: as of the writeup, this function assumes addr is correct
-void cache_sync_to_mem(cache_t *c, cache_line_t *c_line, uint64_t addr);
+void cache_sync_to_mem(cache_t *c, int line, uint64_t addr);
+
+// Writes every dirty line of c back to memory and marks it clean.
+// Nothing to do for a write-through cache.
+void cache_flush(cache_t *c);
+// Flushes every level, top down, so memory ends up with the latest data
+void cache_flush_all();
+// The word at addr as the program would load it, from a dirty line if a
+// level has one, else from memory; changes nothing, for debug dumps
+uint32_t cache_peek_32(uint64_t addr);
+
+// Updates c as an access to addr would, without timing it: a hit touches
+// the line, a miss fills it straight away through the levels below, and a
+// write dirties it in a write-back cache. No statistics are counted.
+// Returns the line now holding addr. For functional warming; c must have
+// no miss outstanding for addr's block.
+int cache_warm(cache_t *c, uint64_t addr, bool is_write);
+
+// Writes size bytes of data at addr into every cached copy of that block,
+// leaving tags, dirty bits, replacement state and statistics alone. For
+// functional execution, which stores straight to memory.
+void cache_patch_all(uint64_t addr, size_t size, uint64_t data);
+
+// The caches' part of a checkpoint (see checkpoint.h). The configuration
+// goes first so that a restore can check it before changing anything;
+// cache_check_config prints what doesn't match.
+bool cache_save_config(FILE *fp);
+bool cache_check_config(FILE *fp);
+bool cache_save_all(FILE *fp);
+bool cache_load_all(FILE *fp);
+
+// Prints one line of access/miss/writeback counts per cache
+void cache_print_stats(FILE *fp);
+
 
 #endif
\ No newline at end of file
@@ -0,0 +1,140 @@
+/*
+ * Standalone benchmark for the cache line layout in cache.h. It builds
+ * the same 8-way cache twice: in the old layout, an array of per-set rows
+ * of cache_line_t structs each holding valid bit, tag, LRU timestamp and
+ * data, and in the current one, where cache_new carves flat tag and data
+ * arrays out of one aligned allocation and folds the valid bit into the
+ * tag. Each is probed with the same random addresses (about half of them
+ * hits), reading a word out of the line on a hit, and the lookups per
+ * second are reported per layout for a few cache sizes. Both probe with a
+ * plain loop, so only the layout differs; tag_bench covers the kernel.
+ *
+ * Build and run with `make cache_bench && ./cache_bench`.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_WAYS   8
+#define BENCH_BLOCK  32
+#define BENCH_PROBES (1 << 20)
+#define BENCH_ROUNDS 16
+#define VALID        ((uint64_t)1 << 63)
+
+// A line as cache_t held it before the flat arrays
+typedef struct {
+    int valid_bit;
+    uint64_t tag;
+    uint64_t used_timestamp;
+    uint8_t data[BENCH_BLOCK];
+} old_line_t;
+
+static double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static uint64_t old_lookup(old_line_t **lines, int set, uint64_t tag, int offset)
+{
+    for (int i = 0; i < BENCH_WAYS; i++) {
+        old_line_t *l = &lines[set][i];
+        if (l->tag == tag && l->valid_bit) {
+            uint32_t word;
+            memcpy(&word, &l->data[offset], sizeof(word));
+            return word;
+        }
+    }
+    return 0;
+}
+
+static uint64_t new_lookup(const uint64_t *tags, const uint8_t *data, int set, uint64_t tag,
+                           int offset)
+{
+    int base = set * BENCH_WAYS;
+
+    for (int i = 0; i < BENCH_WAYS; i++) {
+        if (tags[base + i] == (tag | VALID)) {
+            uint32_t word;
+            memcpy(&word, &data[(size_t)(base + i) * BENCH_BLOCK + offset], sizeof(word));
+            return word;
+        }
+    }
+    return 0;
+}
+
+int main()
+{
+    static const int set_counts[] = { 256, 4096, 32768 };
+    int *sets = malloc(sizeof(int) * BENCH_PROBES);
+    uint64_t *probes = malloc(sizeof(uint64_t) * BENCH_PROBES);
+    int *offsets = malloc(sizeof(int) * BENCH_PROBES);
+
+    printf("%d ways, %d-byte blocks, %d probes x %d rounds\n\n",
+           BENCH_WAYS, BENCH_BLOCK, BENCH_PROBES, BENCH_ROUNDS);
+    printf("%6s %10s %16s %16s %8s\n", "sets", "size (KB)", "old (M/s)", "new (M/s)", "speedup");
+
+    for (size_t k = 0; k < sizeof(set_counts) / sizeof(set_counts[0]); k++) {
+        int num_sets = set_counts[k];
+        size_t lines = (size_t)num_sets * BENCH_WAYS;
+
+        old_line_t **old_lines = malloc(sizeof(old_line_t*) * num_sets);
+        for (int s = 0; s < num_sets; s++)
+            old_lines[s] = calloc(BENCH_WAYS, sizeof(old_line_t));
+        uint64_t *tags = aligned_alloc(64, sizeof(uint64_t) * lines);
+        uint8_t *data = aligned_alloc(64, BENCH_BLOCK * lines);
+
+        for (int s = 0; s < num_sets; s++) {
+            for (int w = 0; w < BENCH_WAYS; w++) {
+                uint64_t tag = (uint64_t)(s * 64 + w);
+                size_t line = (size_t)s * BENCH_WAYS + w;
+                old_lines[s][w].valid_bit = 1;
+                old_lines[s][w].tag = tag;
+                tags[line] = VALID | tag;
+                for (int b = 0; b < BENCH_BLOCK; b++)
+                    old_lines[s][w].data[b] = data[line * BENCH_BLOCK + b] = (uint8_t)(line + b);
+            }
+        }
+
+        srand(num_sets);
+        for (int i = 0; i < BENCH_PROBES; i++) {
+            sets[i] = rand() % num_sets;
+            probes[i] = (uint64_t)(sets[i] * 64 + rand() % (2 * BENCH_WAYS));
+            offsets[i] = (rand() % (BENCH_BLOCK / 4)) * 4;
+        }
+
+        uint64_t check_old = 0, check_new = 0;
+        double t0 = now();
+        for (int r = 0; r < BENCH_ROUNDS; r++)
+            for (int i = 0; i < BENCH_PROBES; i++)
+                check_old += old_lookup(old_lines, sets[i], probes[i], offsets[i]);
+        double t1 = now();
+        for (int r = 0; r < BENCH_ROUNDS; r++)
+            for (int i = 0; i < BENCH_PROBES; i++)
+                check_new += new_lookup(tags, data, sets[i], probes[i], offsets[i]);
+        double t2 = now();
+
+        if (check_old != check_new) {
+            printf("Error: the layouts disagree at %d sets\n", num_sets);
+            return 1;
+        }
+
+        double n = (double)BENCH_PROBES * BENCH_ROUNDS / 1e6;
+        printf("%6d %10zu %16.1f %16.1f %7.2fx\n", num_sets, lines * BENCH_BLOCK / 1024,
+               n / (t1 - t0), n / (t2 - t1), (t1 - t0) / (t2 - t1));
+
+        for (int s = 0; s < num_sets; s++)
+            free(old_lines[s]);
+        free(old_lines);
+        free(tags);
+        free(data);
+    }
+
+    free(sets);
+    free(probes);
+    free(offsets);
+    return 0;
+}
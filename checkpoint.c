@@ -0,0 +1,96 @@
+#include "checkpoint.h"
+#include "shell.h"
+#include "pipe.h"
+#include "bp.h"
+#include "cache.h"
+#include <stdint.h>
+#include <string.h>
+
+#define CKPT_MAGIC   "ARMCKPT"
+#define CKPT_VERSION 5
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+} ckpt_header_t;
+
+bool ckpt_write_items(FILE *fp, const ckpt_item_t *items, int n)
+{
+    for (int i = 0; i < n; i++)
+        if (!ckpt_write(fp, items[i].data, items[i].size))
+            return false;
+    return true;
+}
+
+bool ckpt_read_items(FILE *fp, const ckpt_item_t *items, int n)
+{
+    for (int i = 0; i < n; i++)
+        if (!ckpt_read(fp, items[i].data, items[i].size))
+            return false;
+    return true;
+}
+
+static const ckpt_item_t stat_items[] = {
+    CKPT_ITEM(stat_cycles),
+    CKPT_ITEM(stat_inst_retire),
+    CKPT_ITEM(stat_inst_fetch),
+    CKPT_ITEM(stat_squash),
+    CKPT_ITEM(stat_mispredict),
+    CKPT_ITEM(stat_inst_fastforward),
+};
+
+#define NUM_STAT_ITEMS (int)(sizeof(stat_items) / sizeof(stat_items[0]))
+
+bool checkpoint_save(const char *filename)
+{
+    FILE *fp = fopen(filename, "wb");
+    ckpt_header_t header = { CKPT_MAGIC, CKPT_VERSION };
+
+    if (fp == NULL) {
+        printf("Error: Can't open checkpoint file %s\n", filename);
+        return false;
+    }
+
+    bool ok = ckpt_write(fp, &header, sizeof(header)) && cache_save_config(fp) &&
+              bp_save_config(fp) &&
+              ckpt_write_items(fp, stat_items, NUM_STAT_ITEMS) &&
+              pipe_save(fp) && bp_save(fp) && cache_save_all(fp) && mem_save(fp);
+    if (fclose(fp) != 0)
+        ok = false;
+    if (!ok)
+        printf("Error: Can't write checkpoint file %s\n", filename);
+    return ok;
+}
+
+bool checkpoint_restore(const char *filename)
+{
+    FILE *fp = fopen(filename, "rb");
+    ckpt_header_t header;
+
+    if (fp == NULL) {
+        printf("Error: Can't open checkpoint file %s\n", filename);
+        return false;
+    }
+
+    // Nothing is changed until we know the rest will fit
+    if (!ckpt_read(fp, &header, sizeof(header)) ||
+        memcmp(header.magic, CKPT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != CKPT_VERSION) {
+        printf("Error: %s is not a checkpoint of this simulator\n", filename);
+        fclose(fp);
+        return false;
+    }
+    if (!cache_check_config(fp) || !bp_check_config(fp)) {
+        fclose(fp);
+        return false;
+    }
+
+    bool ok = ckpt_read_items(fp, stat_items, NUM_STAT_ITEMS) &&
+              pipe_load(fp) && bp_load(fp) && cache_load_all(fp) && mem_load(fp);
+    fclose(fp);
+    if (!ok) {
+        printf("Error: Can't restore from %s; the simulator is halted\n", filename);
+        RUN_BIT = 0;
+    }
+    return ok;
+}
@@ -0,0 +1,49 @@
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// A checkpoint is the whole simulator state in one binary file: the
+// statistics, the pipeline with its stall and halt flags, the branch
+// predictor, every cache with its outstanding misses, and memory (only the
+// pages that hold anything). Restoring one and simulating on gives the
+// same results as simulating on from where it was taken.
+//
+// Structs are written as they are in memory, so a checkpoint can only be
+// restored by the same build of the simulator. The caches must have the
+// same geometry, replacement and write policy and inclusion as when it
+// was taken, and the branch predictor the same settings; latencies may
+// differ, which is what makes it useful to run several experiments from
+// one checkpoint.
+
+// Both print the problem and return false on failure. A failed restore
+// leaves the simulator halted, as its state is then a mix of old and new.
+bool checkpoint_save(const char *filename);
+bool checkpoint_restore(const char *filename);
+
+// For the save/load hooks of the modules, which write their own part of
+// the file and check it when reading it back
+static inline bool ckpt_write(FILE *fp, const void *data, size_t size)
+{
+    return fwrite(data, 1, size, fp) == size;
+}
+
+static inline bool ckpt_read(FILE *fp, void *data, size_t size)
+{
+    return fread(data, 1, size, fp) == size;
+}
+
+// A variable's worth of state
+typedef struct {
+    void *data;
+    size_t size;
+} ckpt_item_t;
+
+#define CKPT_ITEM(var) { &(var), sizeof(var) }
+
+bool ckpt_write_items(FILE *fp, const ckpt_item_t *items, int n);
+bool ckpt_read_items(FILE *fp, const ckpt_item_t *items, int n);
+
+#endif
@@ -0,0 +1,128 @@
+#include "decode.h"
+#include <assert.h>
+
+#define FRAG(begin, end) .frag_begin = begin, .frag_end = end
+
+// Shorthands for the table below. Signals an entry doesn't name are 0
+// (false, OP_ADD, CBZ), which is also what "irrelevant" ones are left as.
+#define ALU_R(op, set_flags) { .tmpl = DEC_R, .type = INST_OPERATE, .layout = INST_R, \
+    .WB = { .RegWrite = true, .SetFlags = set_flags }, .EX = { .ALUOp = op } }
+#define ALU_R_NOSHIFT(op) { .tmpl = DEC_R_NOSHIFT, .type = INST_OPERATE, .layout = INST_R, \
+    .WB = { .RegWrite = true }, .EX = { .ALUOp = op } }
+#define ALU_I(op, set_flags) { .tmpl = DEC_I, .type = INST_OPERATE, .layout = INST_I, \
+    .WB = { .RegWrite = true, .SetFlags = set_flags }, .EX = { .ALUSrc = true, .ALUOp = op }, \
+    FRAG(10, 22) }
+#define LOAD { .tmpl = DEC_D, .type = INST_DATAMOV, .layout = INST_D, \
+    .WB = { .RegWrite = true, .MemtoReg = true }, .M = { .MemRead = true }, \
+    .EX = { .ALUSrc = true, .ALUOp = OP_ADD }, FRAG(12, 21) }
+#define STORE { .tmpl = DEC_D, .type = INST_DATAMOV, .layout = INST_D, \
+    .M = { .MemWrite = true }, .EX = { .ALUSrc = true, .ALUOp = OP_ADD }, FRAG(12, 21) }
+#define COND_BRANCH(tmpl_, layout_, op, b) { .tmpl = tmpl_, .type = INST_CONTROL, \
+    .layout = layout_, .EX = { .ALUOp = op, .b_type = b }, FRAG(5, 24) }
+
+// Ranges ([a ... b]) are a GNU extension, which we rely on elsewhere too.
+// Note: the asm2hex script defaults to shifted register encodings of
+// instructions when the extended register versions are used, so those
+// opcodes map to the same entries.
+const decode_entry_t decode_table[DECODE_TABLE_SIZE] = {
+    // ---------- INST_OPERATE ----------
+    [0b10001011000 ... 0b10001011001] = ALU_R(OP_ADD, false),  // ADD (extended register)
+    [0b10101011000 ... 0b10101011001] = ALU_R(OP_ADDS, true),  // ADDS (extended register)
+    [0b10010001000 ... 0b10010001111] = ALU_I(OP_ADD, false),  // ADD (immediate)
+    [0b10110001000 ... 0b10110001111] = ALU_I(OP_ADDS, true),  // ADDS (immediate)
+    [0b10001010000]                   = ALU_R(OP_AND, false),  // AND (shifted register)
+    [0b11101010000]                   = ALU_R(OP_ANDS, true),  // ANDS (shifted register)
+    [0b11001010000]                   = ALU_R_NOSHIFT(OP_EOR), // EOR (shifted register)
+    [0b10101010000]                   = ALU_R_NOSHIFT(OP_ORR), // ORR (shifted register)
+    [0b11010011010 ... 0b11010011011] = { .tmpl = DEC_SHIFT, .type = INST_OPERATE, .layout = INST_I,
+                                          .WB = { .RegWrite = true }, .EX = { .ALUSrc = true }, FRAG(10, 22) }, // LSL/LSR (immediate)
+    [0b11001011000 ... 0b11001011001] = ALU_R(OP_SUB, false),  // SUB (extended register)
+    [0b11101011000 ... 0b11101011001] = ALU_R(OP_SUBS, true),  // SUBS/CMP (extended register)
+    [0b11010001000 ... 0b11010001001] = ALU_I(OP_SUB, false),  // SUB (immediate)
+    [0b11110001000 ... 0b11110001001] = ALU_I(OP_SUBS, true),  // SUBS/CMP (immediate)
+    [0b10011011000]                   = ALU_I(OP_MUL, false),  // MUL
+
+    // ---------- INST_DATAMOV ----------
+    [0b11111000010] = LOAD,  // LDUR (64-bit)
+    [0b10111000010] = LOAD,  // LDUR (32-bit)
+    [0b01111000010] = LOAD,  // LDURH (16-bit)
+    [0b00111000010] = LOAD,  // LDURB (8-bit)
+    [0b11111000000] = STORE, // STUR (64-bit)
+    [0b10111000000] = STORE, // STUR (32-bit)
+    [0b01111000000] = STORE, // STURH (16-bit)
+    [0b00111000000] = STORE, // STURB (8-bit)
+    [0b11010010100 ... 0b11010010111] = { .tmpl = DEC_IM, .type = INST_DATAMOV, .layout = INST_IM,
+                                          .WB = { .RegWrite = true }, .M = { .DataSize = 16 },
+                                          .EX = { .ALUSrc = true, .ALUOp = OP_PASSTHRU_2_S }, FRAG(5, 21) }, // MOVZ
+
+    // ---------- INST_CONTROL ----------
+    [0b11010110000] = { .tmpl = DEC_BR, .type = INST_CONTROL, .layout = INST_BR,
+                        .M = { .ConfirmedBranch = true },
+                        .EX = { .ALUSrc = true, .ALUOp = OP_PASSTHRU_2_S, .b_type = BR } }, // BR
+    [0b00010100000 ... 0b00010111111] = { .tmpl = DEC_B, .type = INST_CONTROL, .layout = INST_B,
+                                          .M = { .ConfirmedBranch = true }, .EX = { .b_type = B }, FRAG(0, 26) }, // B
+    [0b10010100000 ... 0b10010111111] = { .tmpl = DEC_B, .type = INST_CONTROL, .layout = INST_B,
+                                          .WB = { .RegWrite = true }, .M = { .ConfirmedBranch = true },
+                                          .EX = { .b_type = BL }, FRAG(0, 26) }, // BL: as B, and X30 = PC + 4
+    [0b10110101000 ... 0b10110101111] = COND_BRANCH(DEC_CB, INST_CB, OP_NOT_2_S, CBNZ),         // CBNZ
+    [0b10110100000 ... 0b10110100111] = COND_BRANCH(DEC_CB, INST_CB, OP_PASSTHRU_2_S, CBZ),     // CBZ
+    [0b01010100000 ... 0b01010100111] = COND_BRANCH(DEC_BCOND, INST_BC, OP_PASSTHRU_2_S, BEQ),  // B.cond
+
+    // ---------- INST_OTHEROP ----------
+    [0b11010100010] = { .tmpl = DEC_HLT, .type = INST_OTHEROP, .layout = INST_NOP }, // HLT
+};
+
+// Branch type by B.cond condition; C and V flags are assumed to be 0, so
+// only these are supported (-1 for the rest)
+static const int bcond_types[16] = {
+    BEQ, BNE, -1,  -1,  // 0b0000..0b0011
+    -1,  -1,  -1,  -1,  // 0b0100..0b0111
+    -1,  -1,  BGE, BLT, // 0b1000..0b1011
+    BGT, BLE, -1,  -1,  // 0b1100..0b1111
+};
+
+// Bits begin..end-1 of inst, unsigned and sign-extended
+static inline uint32_t field(instruction_t inst, int begin, int end)
+{
+    return (uint32_t)((uint64_t)inst << (64 - end) >> (64 - end + begin));
+}
+
+static inline int64_t signed_field(instruction_t inst, int begin, int end)
+{
+    return (int64_t)((uint64_t)inst << (64 - end)) >> (64 - end + begin);
+}
+
+void decode_inst(instruction_t inst, decode_entry_t *d, int64_t *frag)
+{
+    const decode_entry_t *e = decode_lookup(inst);
+
+    *d = *e;
+    *frag = e->frag_end ? signed_field(inst, e->frag_begin, e->frag_end) : 0;
+
+    // Most templates need nothing more
+    switch (e->tmpl) {
+    case DEC_R_NOSHIFT:
+        assert(field(inst, 10, 16) == 0);
+        break;
+    case DEC_SHIFT:
+        d->EX.ALUOp = field(inst, 10, 16) == 0b111111 ? OP_LSR : OP_LSL;
+        break;
+    case DEC_D:
+        assert(field(inst, 5, 10) != 31); // SP
+        // The four sizes only differ in the first two bits:
+        // 00 -> 8-bits, 01 -> 16-bits, 10 -> 32-bits, 11 -> 64-bits
+        d->M.DataSize = 8 << field(inst, 30, 32);
+        break;
+    case DEC_IM:
+        assert(field(inst, 21, 23) == 0); // Only hw = 0 is supported
+        break;
+    case DEC_BCOND:
+        assert(bcond_types[field(inst, 0, 4)] >= 0);
+        d->EX.b_type = (branch_type)bcond_types[field(inst, 0, 4)];
+        break;
+    case DEC_INVALID: // Unsupported instruction
+        assert(0);
+    default:
+        break;
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef _DECODE_H_
+#define _DECODE_H_
+
+#include "pipe.h"
+
+// Decoding is driven by a constant table indexed by the opcode, i.e.
+// instruction bits 31..21. An entry holds every control signal that is
+// fixed for its opcode, where its immediate is, and a template saying
+// what else (the data size, the branch condition, ...) to pull out of the
+// other bits.
+#define DECODE_OPCODE_BITS 11
+#define DECODE_TABLE_SIZE  (1 << DECODE_OPCODE_BITS)
+
+typedef enum {
+    DEC_INVALID,   // Unsupported instruction
+    DEC_R,         // Registers only
+    DEC_R_NOSHIFT, // As DEC_R; the shift amount (15..10) must be 0
+    DEC_I,         // Immediate at 21..10
+    DEC_SHIFT,     // LSL/LSR: as DEC_I, a shift amount of 63 makes it LSR
+    DEC_D,         // LDUR*/STUR*: offset at 20..12, size from 31..30
+    DEC_IM,        // MOVZ: immediate at 20..5
+    DEC_B,         // Offset at 25..0
+    DEC_CB,        // Offset at 23..5
+    DEC_BCOND,     // As DEC_CB; the condition at 3..0 picks the branch type
+    DEC_BR,        // Target in a register, which EX takes from Read_data_1
+    DEC_HLT        // unit_control stops the fetch stage
+} decode_template_t;
+
+typedef struct {
+    decode_template_t tmpl;
+    instruction_type_t type;
+    instruction_layout_t layout;
+    interface_WB WB;
+    interface_M M;
+    interface_EX EX;
+    uint8_t frag_begin, frag_end; // Sign-extended immediate; none if end is 0
+} decode_entry_t;
+
+extern const decode_entry_t decode_table[DECODE_TABLE_SIZE];
+
+static inline const decode_entry_t *decode_lookup(instruction_t inst)
+{
+    return &decode_table[inst >> (32 - DECODE_OPCODE_BITS)];
+}
+
+// Fills *d with inst's table entry, with the fields that vary within the
+// opcode filled in, and *frag with its immediate or branch offset (0 where
+// there is none, and for DEC_BR). Asserts on an unsupported instruction.
+void decode_inst(instruction_t inst, decode_entry_t *d, int64_t *frag);
+
+#endif
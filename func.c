@@ -0,0 +1,161 @@
+#include "func.h"
+#include "pipe.h"
+#include "decode.h"
+#include "cache.h"
+#include "bp.h"
+#include "shell.h"
+#include "utils.h"
+#include <string.h>
+
+// Decoded instructions by PC, so a loop is decoded once. Only functional
+// stores can change memory while we run, and they drop the entry for the
+// word they write; the whole table is dropped when func_run starts since
+// the pipeline may have stored in between.
+#define FUNC_DECODED_ENTRIES 4096 // Must be a power of 2
+
+typedef struct {
+    bool valid;
+    uint64_t pc;
+    decode_entry_t d;
+    int64_t frag;
+    uint8_t rn, rm, rd; // rm is Rt for loads, stores and CB
+} func_decoded_t;
+
+static func_decoded_t func_decoded[FUNC_DECODED_ENTRIES];
+
+static inline func_decoded_t *func_decoded_slot(uint64_t pc)
+{
+    return &func_decoded[(pc >> 2) & (FUNC_DECODED_ENTRIES - 1)];
+}
+
+static const func_decoded_t *func_decode(uint64_t pc)
+{
+    func_decoded_t *f = func_decoded_slot(pc);
+
+    if (f->valid && f->pc == pc)
+        return f;
+
+    instruction_t inst = mem_read_32(pc);
+    decode_inst(inst, &f->d, &f->frag);
+    // The same operands decode reads: Rn, and Rt or Rm depending on Reg2Loc
+    f->rn = truncator32(inst, 5, 10);
+    f->rm = truncator32(inst, 28, 29) ? truncator32(inst, 0, 5) : truncator32(inst, 16, 21);
+    f->rd = f->d.type == INST_CONTROL && f->d.EX.b_type == BL ? 30 : truncator32(inst, 0, 5);
+    f->pc = pc;
+    f->valid = true;
+    return f;
+}
+
+// The i-cache line warmed last. Touching a line again straight away
+// changes nothing in any replacement policy, so straight-line code only
+// warms each block once, as long as the line still holds it.
+static int func_warm_i_line = -1;
+static uint64_t func_warm_i_block;
+
+static void func_warm_fetch(uint64_t pc)
+{
+    int line = func_warm_i_line;
+    uint64_t block = cache_block_addr(i_cache, pc);
+
+    if (line >= 0 && block == func_warm_i_block &&
+        i_cache->tags[line] == (cache_tag(i_cache, pc) | TAG_VALID))
+        return;
+    func_warm_i_line = cache_warm(i_cache, pc, false);
+    func_warm_i_block = block;
+}
+
+static uint64_t func_load(uint64_t addr, size_t DataSize)
+{
+    switch (DataSize) {
+    case 8:  return mem_read_8(addr);
+    case 16: return mem_read_16(addr);
+    case 32: return mem_read_32(addr);
+    default: return mem_read_64(addr);
+    }
+}
+
+static void func_store(uint64_t addr, size_t DataSize, uint64_t data)
+{
+    switch (DataSize) {
+    case 8:  mem_write_8(addr, (uint8_t)data);   break;
+    case 16: mem_write_16(addr, (uint16_t)data); break;
+    case 32: mem_write_32(addr, (uint32_t)data); break;
+    default: mem_write_64(addr, data);           break;
+    }
+    cache_patch_all(addr, DataSize / 8, data);
+
+    // Self-modifying code: forget the words we wrote over
+    for (uint64_t word = addr & ~3ull; word < addr + DataSize / 8; word += 4)
+        func_decoded_slot(word)->valid = false;
+}
+
+void func_step(bool warm)
+{
+    uint64_t pc = CURRENT_STATE.PC;
+    const func_decoded_t *f = func_decode(pc);
+    if (warm)
+        func_warm_fetch(pc);
+    const decode_entry_t *d = &f->d;
+    int64_t frag = f->frag;
+
+    if (d->tmpl == DEC_HLT) {
+        // Where the pipeline leaves the PC: fetch has moved past HLT by the
+        // time decode bumps it again
+        CURRENT_STATE.PC = pc + 8;
+        RUN_BIT = 0;
+        return;
+    }
+
+    // X31 is never written, so it reads as zero
+    uint64_t reg_1 = CURRENT_STATE.REGS[f->rn];
+    uint64_t reg_2 = CURRENT_STATE.REGS[f->rm];
+    uint64_t operand2, result;
+    bool is_zero;
+    unit_mux_64(frag, reg_2, d->EX.ALUSrc, &operand2);
+    unit_ALU(d->EX.ALUOp, reg_1, operand2, &result, &is_zero);
+
+    uint64_t next_pc = pc + 4;
+    if (d->type == INST_CONTROL) {
+        bool taken = unit_branch_taken(d->M, d->EX, &CURRENT_STATE);
+        uint64_t target = d->tmpl == DEC_BR ? reg_1 : pc + (frag << 2);
+        if (taken)
+            next_pc = target;
+        if (d->EX.b_type == BL)
+            result = pc + 4;
+        // As pipe_stage_execute trains it
+        if (warm) {
+            bp_kind_t kind = d->EX.b_type == B  ? BP_DIRECT :
+                             d->EX.b_type == BL ? BP_CALL :
+                             d->EX.b_type == BR ? (f->rn == 30 ? BP_RETURN : BP_INDIRECT) :
+                             BP_CONDITIONAL;
+            bp_ras_follow(kind, pc);
+            bp_update(kind, taken, pc, target);
+        }
+    }
+
+    uint64_t write_data = result;
+    if (warm && (d->M.MemRead || d->M.MemWrite))
+        cache_warm(d_cache, result, d->M.MemWrite);
+    if (d->M.MemRead)
+        write_data = func_load(result, d->M.DataSize);
+    else if (d->M.MemWrite)
+        func_store(result, d->M.DataSize, reg_2);
+
+    if (d->WB.RegWrite && f->rd != 31)
+        CURRENT_STATE.REGS[f->rd] = write_data;
+    if (d->WB.SetFlags)
+        set_flags(write_data, &CURRENT_STATE);
+
+    CURRENT_STATE.PC = next_pc;
+}
+
+uint64_t func_run(uint64_t n, bool warm)
+{
+    uint64_t i;
+
+    memset(func_decoded, 0, sizeof(func_decoded));
+    func_warm_i_line = -1; // The pipeline may have touched other lines since
+    for (i = 0; i < n && RUN_BIT; i++)
+        func_step(warm);
+    return i;
+}
@@ -0,0 +1,28 @@
+#ifndef _FUNC_H_
+#define _FUNC_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Functional execution: runs instructions straight on CURRENT_STATE and
+// main memory, one per step, with no pipeline, caches or predictor in the
+// way and no cycles counted. It is meant for skipping the parts of a
+// program we don't want to time (see the `fastforward` shell command).
+//
+// The pipeline must be empty (pipe_empty) and the caches clean when it
+// starts; stores update memory and any cached copy, so the detailed model
+// can pick up where it left off.
+//
+// With warm set, every fetch and every load or store also goes through
+// cache_warm, and every branch outcome through bp_update, so the detailed
+// model starts with caches and predictor in the state the skipped code
+// left them in. It still counts no cycles or cache statistics.
+
+// Executes the instruction at CURRENT_STATE.PC. On HLT it clears RUN_BIT.
+void func_step(bool warm);
+
+// Executes up to n instructions, stopping early at HLT. Returns how many
+// were executed.
+uint64_t func_run(uint64_t n, bool warm);
+
+#endif
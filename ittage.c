@@ -0,0 +1,446 @@
+#include "bp.h"
+#include "checkpoint.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+// ITTAGE, TAGE (see tage.c) with targets in place of taken/not taken. The
+// BTB's last target for a BR is the base prediction, and `tables` tagged
+// tables, indexed with history lengths in a geometric series from minhist
+// to maxhist, override it where their tag matches and they are confident
+// enough. A wrong target allocates an entry with longer history than the
+// provider's.
+//
+// The history is the global one with 2 target bits for each branch that
+// isn't conditional, so a BR whose target depends on the way the code got
+// there can tell the ways apart. It is only updated as branches resolve;
+// nothing is speculative, so nothing needs repairing after a squash.
+//
+// The storage budget is in KB of the modeled bits, 64 + tagbits + 2 + 1
+// per entry (a whole target, a tag, a confidence counter and a useful
+// bit), split evenly between the tables, each a power of 2 in size.
+
+#define ITTAGE_MAX_TABLES 15
+#define ITTAGE_MAX_HIST   1024
+#define ITTAGE_HIST_BUF   2048 // Must be a power of 2 above ITTAGE_MAX_HIST
+#define ITTAGE_CTR_MAX    3
+#define ITTAGE_U_PERIOD   (1 << 16) // Updates between clearing every u
+#define ITTAGE_PENDING    4
+
+typedef struct {
+    int enabled, tables, min_hist, max_hist, tag_bits, budget_kb;
+} ittage_config_t;
+
+static ittage_config_t ittage_config = {
+    .enabled = 1,
+    .tables = 4,
+    .min_hist = 4,
+    .max_hist = 64,
+    .tag_bits = 9,
+    .budget_kb = 4,
+};
+
+// Worked out from ittage_config by ittage_check
+static int ittage_log_entries;
+static int ittage_hist_len[ITTAGE_MAX_TABLES + 1]; // Of tables 1..tables
+
+typedef struct {
+    uint64_t target;
+    uint16_t tag;
+    uint8_t ctr; // Confidence in target
+    uint8_t u;
+} ittage_entry_t;
+
+typedef struct {
+    uint32_t value;
+    int length, width;
+} ittage_folded_t;
+
+static ittage_entry_t *ittage_table[ITTAGE_MAX_TABLES + 1];
+
+// History bit i (0 the latest) is ittage_hist[(ittage_hist_ptr + i) % ITTAGE_HIST_BUF]
+static uint8_t ittage_hist[ITTAGE_HIST_BUF];
+static int ittage_hist_ptr;
+static ittage_folded_t ittage_index_fold[ITTAGE_MAX_TABLES + 1];
+static ittage_folded_t ittage_tag_fold[2][ITTAGE_MAX_TABLES + 1];
+
+static uint32_t ittage_updates;
+static uint32_t ittage_rng;
+
+// As in tage.c: the update trains the entries its prediction looked at
+typedef struct {
+    bool valid;
+    uint64_t pc;
+    uint32_t index[ITTAGE_MAX_TABLES + 1];
+    uint16_t tag[ITTAGE_MAX_TABLES + 1];
+    int provider, alt; // Tagged tables; 0 for the BTB
+    uint64_t provider_target, alt_target, pred;
+} ittage_lookup_t;
+
+static ittage_lookup_t ittage_pending[ITTAGE_PENDING];
+static int ittage_pending_next;
+
+static bool ittage_set(const char *key, int value)
+{
+    if (strcmp(key, "tables") == 0)
+        ittage_config.tables = value;
+    else if (strcmp(key, "minhist") == 0)
+        ittage_config.min_hist = value;
+    else if (strcmp(key, "maxhist") == 0)
+        ittage_config.max_hist = value;
+    else if (strcmp(key, "tagbits") == 0)
+        ittage_config.tag_bits = value;
+    else if (strcmp(key, "budget") == 0)
+        ittage_config.budget_kb = value;
+    else {
+        printf("Error: ittage has no setting \"%s\"\n", key);
+        return false;
+    }
+    return true;
+}
+
+static int floor_log2(uint64_t n)
+{
+    int log = -1;
+    while (n > 0) {
+        n >>= 1;
+        log++;
+    }
+    return log;
+}
+
+static bool ittage_check()
+{
+    const ittage_config_t *c = &ittage_config;
+    int n = c->tables;
+
+    if (n < 1 || n > ITTAGE_MAX_TABLES) {
+        printf("Error: ittage needs 1 to %d tables\n", ITTAGE_MAX_TABLES);
+        return false;
+    }
+    if (c->min_hist < 1 || c->min_hist > c->max_hist || c->max_hist > ITTAGE_MAX_HIST) {
+        printf("Error: ittage needs 1 <= minhist <= maxhist <= %d\n", ITTAGE_MAX_HIST);
+        return false;
+    }
+    if (c->tag_bits < 4 || c->tag_bits > 16) {
+        printf("Error: ittage tagbits must be 4 to 16\n");
+        return false;
+    }
+    if (c->budget_kb < 1 || c->budget_kb > 65536) {
+        printf("Error: ittage budget must be 1 to 65536 KB\n");
+        return false;
+    }
+
+    uint64_t bits = (uint64_t)c->budget_kb * 8192;
+    ittage_log_entries = floor_log2(bits / n / (64 + c->tag_bits + 2 + 1));
+    if (ittage_log_entries < 2 || ittage_log_entries > 24) {
+        printf("Error: a %d KB budget gives ittage tables of 2^%d entries; need 2^2 to 2^24\n",
+               c->budget_kb, ittage_log_entries);
+        return false;
+    }
+
+    for (int t = 1; t <= n; t++) {
+        double ratio = n == 1 ? 1.0 : (double)(t - 1) / (n - 1);
+        int len = n == 1 ? c->max_hist :
+                  (int)(c->min_hist * pow((double)c->max_hist / c->min_hist, ratio) + 0.5);
+        if (t > 1 && len <= ittage_hist_len[t - 1])
+            len = ittage_hist_len[t - 1] + 1;
+        if (len > ITTAGE_MAX_HIST) {
+            printf("Error: too many ittage tables for maxhist %d\n", c->max_hist);
+            return false;
+        }
+        ittage_hist_len[t] = len;
+    }
+    return true;
+}
+
+bool ittage_config_parse(const char *spec)
+{
+    char name[16], key[16];
+    int value, len;
+
+    if (sscanf(spec, " %15[a-z0-9_]%n", name, &len) != 1) {
+        printf("Error: malformed indirect predictor setting \"%s\"\n", spec);
+        return false;
+    }
+    if (strcmp(name, "btb") == 0) {
+        if (spec[len] != '\0') {
+            printf("Error: btb has no settings\n");
+            return false;
+        }
+        ittage_config.enabled = 0;
+        return true;
+    }
+    if (strcmp(name, "ittage") != 0) {
+        printf("Error: unknown indirect predictor \"%s\"\n", name);
+        return false;
+    }
+    spec += len;
+
+    while (*spec != '\0') {
+        if (*spec == ',' || *spec == ' ' || *spec == '\t' || *spec == '\n') {
+            spec++;
+            continue;
+        }
+        if (sscanf(spec, "%15[a-z_]=%i%n", key, &value, &len) != 2) {
+            printf("Error: malformed indirect predictor setting \"%s\"\n", spec);
+            return false;
+        }
+        spec += len;
+        if (!ittage_set(key, value))
+            return false;
+    }
+    if (!ittage_check())
+        return false;
+    ittage_config.enabled = 1;
+    return true;
+}
+
+bool ittage_enabled()
+{
+    return ittage_config.enabled;
+}
+
+static void fold_init(ittage_folded_t *f, int length, int width)
+{
+    f->value = 0;
+    f->length = length;
+    f->width = width;
+}
+
+// After a bit has been shifted into ittage_hist
+static void fold_update(ittage_folded_t *f)
+{
+    f->value = (f->value << 1) | ittage_hist[ittage_hist_ptr];
+    f->value ^= (uint32_t)ittage_hist[(ittage_hist_ptr + f->length) & (ITTAGE_HIST_BUF - 1)]
+                << (f->length % f->width);
+    f->value ^= f->value >> f->width;
+    f->value &= (1u << f->width) - 1;
+}
+
+void ittage_init()
+{
+    int n = ittage_config.tables;
+
+    for (int t = 1; t <= ITTAGE_MAX_TABLES; t++) {
+        free(ittage_table[t]);
+        ittage_table[t] = NULL;
+    }
+    if (!ittage_config.enabled)
+        return;
+    // Sizes the tables; the defaults don't go through ittage_config_parse
+    if (!ittage_check())
+        exit(1);
+
+    for (int t = 1; t <= n; t++) {
+        ittage_table[t] = calloc((size_t)1 << ittage_log_entries, sizeof(ittage_entry_t));
+        if (ittage_table[t] == NULL) {
+            printf("malloc failed to init ittage\n");
+            exit(1);
+        }
+    }
+
+    memset(ittage_hist, 0, sizeof(ittage_hist));
+    ittage_hist_ptr = 0;
+    for (int t = 1; t <= n; t++) {
+        fold_init(&ittage_index_fold[t], ittage_hist_len[t], ittage_log_entries);
+        fold_init(&ittage_tag_fold[0][t], ittage_hist_len[t], ittage_config.tag_bits);
+        fold_init(&ittage_tag_fold[1][t], ittage_hist_len[t], ittage_config.tag_bits - 1);
+    }
+    ittage_updates = 0;
+    ittage_rng = 0x9e3779b9;
+    memset(ittage_pending, 0, sizeof(ittage_pending));
+    ittage_pending_next = 0;
+}
+
+static uint32_t ittage_random()
+{
+    // xorshift32
+    ittage_rng ^= ittage_rng << 13;
+    ittage_rng ^= ittage_rng >> 17;
+    ittage_rng ^= ittage_rng << 5;
+    return ittage_rng;
+}
+
+static void ittage_lookup(uint64_t PC, uint64_t btb_target, ittage_lookup_t *l)
+{
+    uint64_t p = PC >> 2;
+    uint32_t index_mask = (1u << ittage_log_entries) - 1;
+    uint32_t tag_mask = (1u << ittage_config.tag_bits) - 1;
+    int n = ittage_config.tables;
+
+    l->valid = true;
+    l->pc = PC;
+    l->provider = l->alt = 0;
+    for (int t = n; t >= 1; t--) {
+        l->index[t] = (uint32_t)(p ^ (p >> ittage_log_entries) ^ ittage_index_fold[t].value) &
+                      index_mask;
+        l->tag[t] = (uint16_t)((p ^ ittage_tag_fold[0][t].value ^
+                                (ittage_tag_fold[1][t].value << 1)) & tag_mask);
+        if (ittage_table[t][l->index[t]].tag != l->tag[t])
+            continue;
+        if (l->provider == 0)
+            l->provider = t;
+        else if (l->alt == 0)
+            l->alt = t;
+    }
+
+    l->alt_target = l->alt ? ittage_table[l->alt][l->index[l->alt]].target : btb_target;
+    if (l->provider == 0) {
+        l->provider_target = l->pred = btb_target;
+        return;
+    }
+    const ittage_entry_t *e = &ittage_table[l->provider][l->index[l->provider]];
+    l->provider_target = e->target;
+    // An entry that has just been (re)allocated only gets a say once it
+    // has been right again
+    l->pred = e->ctr > 0 ? e->target : l->alt_target;
+}
+
+uint64_t ittage_predict(uint64_t PC, uint64_t btb_target)
+{
+    ittage_lookup_t *l = &ittage_pending[ittage_pending_next];
+
+    ittage_pending_next = (ittage_pending_next + 1) % ITTAGE_PENDING;
+    ittage_lookup(PC, btb_target, l);
+    return l->pred;
+}
+
+static void ittage_allocate(const ittage_lookup_t *l, uint64_t target)
+{
+    int n = ittage_config.tables;
+    int first = l->provider + 1;
+
+    if (first < n && (ittage_random() & 1))
+        first++;
+    for (int t = first; t <= n; t++) {
+        ittage_entry_t *e = &ittage_table[t][l->index[t]];
+        if (e->u == 0) {
+            e->tag = l->tag[t];
+            e->target = target;
+            e->ctr = 0;
+            return;
+        }
+    }
+    for (int t = l->provider + 1; t <= n; t++)
+        ittage_table[t][l->index[t]].u = 0;
+}
+
+void ittage_update(uint64_t PC, uint64_t target, uint64_t btb_target)
+{
+    ittage_lookup_t l;
+    int n = ittage_config.tables;
+
+    l.valid = false;
+    for (int i = 1; i <= ITTAGE_PENDING && !l.valid; i++) {
+        ittage_lookup_t *p = &ittage_pending[(ittage_pending_next + ITTAGE_PENDING - i) % ITTAGE_PENDING];
+        if (p->valid && p->pc == PC) {
+            l = *p;
+            p->valid = false;
+        }
+    }
+    if (!l.valid)
+        ittage_lookup(PC, btb_target, &l);
+
+    if (l.pred != target && l.provider < n)
+        ittage_allocate(&l, target);
+
+    if (l.provider > 0) {
+        ittage_entry_t *e = &ittage_table[l.provider][l.index[l.provider]];
+        if (e->target == target) {
+            if (e->ctr < ITTAGE_CTR_MAX)
+                e->ctr++;
+        } else if (e->ctr > 0) {
+            e->ctr--;
+        } else {
+            e->target = target;
+        }
+        if (l.provider_target != l.alt_target)
+            e->u = l.provider_target == target;
+    }
+
+    if (++ittage_updates % ITTAGE_U_PERIOD == 0) {
+        for (int t = 1; t <= n; t++)
+            for (uint32_t i = 0; i < (1u << ittage_log_entries); i++)
+                ittage_table[t][i].u = 0;
+    }
+}
+
+static void ittage_push(bool bit)
+{
+    ittage_hist_ptr = (ittage_hist_ptr - 1) & (ITTAGE_HIST_BUF - 1);
+    ittage_hist[ittage_hist_ptr] = bit;
+    for (int t = 1; t <= ittage_config.tables; t++) {
+        fold_update(&ittage_index_fold[t]);
+        fold_update(&ittage_tag_fold[0][t]);
+        fold_update(&ittage_tag_fold[1][t]);
+    }
+}
+
+void ittage_history(bp_kind_t kind, bool taken, uint64_t target)
+{
+    if (kind == BP_CONDITIONAL) {
+        ittage_push(taken);
+    } else {
+        ittage_push((target >> 2) & 1);
+        ittage_push((target >> 3) & 1);
+    }
+}
+
+bool ittage_save_config(FILE *fp)
+{
+    return ckpt_write(fp, &ittage_config, sizeof(ittage_config));
+}
+
+bool ittage_check_config(FILE *fp)
+{
+    ittage_config_t saved;
+
+    if (!ckpt_read(fp, &saved, sizeof(saved)))
+        return false;
+    if (memcmp(&saved, &ittage_config, sizeof(saved)) != 0) {
+        printf("Error: the checkpoint was taken with other indirect predictor settings\n");
+        return false;
+    }
+    return true;
+}
+
+// Everything but the tables, which are sized at run time
+static const ckpt_item_t ittage_state[] = {
+    CKPT_ITEM(ittage_hist),
+    CKPT_ITEM(ittage_hist_ptr),
+    CKPT_ITEM(ittage_index_fold),
+    CKPT_ITEM(ittage_tag_fold),
+    CKPT_ITEM(ittage_updates),
+    CKPT_ITEM(ittage_rng),
+    CKPT_ITEM(ittage_pending),
+    CKPT_ITEM(ittage_pending_next),
+};
+
+#define NUM_ITTAGE_STATE (int)(sizeof(ittage_state) / sizeof(ittage_state[0]))
+
+bool ittage_save(FILE *fp)
+{
+    size_t entries = (size_t)1 << ittage_log_entries;
+
+    if (!ittage_config.enabled)
+        return true;
+    for (int t = 1; t <= ittage_config.tables; t++)
+        if (!ckpt_write(fp, ittage_table[t], entries * sizeof(ittage_entry_t)))
+            return false;
+    return ckpt_write_items(fp, ittage_state, NUM_ITTAGE_STATE);
+}
+
+bool ittage_load(FILE *fp)
+{
+    size_t entries = (size_t)1 << ittage_log_entries;
+
+    if (!ittage_config.enabled)
+        return true;
+    for (int t = 1; t <= ittage_config.tables; t++)
+        if (!ckpt_read(fp, ittage_table[t], entries * sizeof(ittage_entry_t)))
+            return false;
+    return ckpt_read_items(fp, ittage_state, NUM_ITTAGE_STATE);
+}
@@ -0,0 +1,403 @@
+#include "bp.h"
+#include "checkpoint.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+// Hashed perceptron (Tarjan and Skadron, "Merging path and gshare indexing
+// in perceptron branch prediction", TACO 2005). Each feature hashes the PC
+// with some history into its own table of signed weights; the prediction
+// is taken if the weights it picks add up to >= 0, and they are all
+// trained towards the outcome after a mispredict or a sum too close to 0.
+// Weights saturate at weightbits.
+//
+// Features, in order: a bias (PC only); `global` segments of the global
+// history, [0, L1), [L1, L2), ... with lengths in a geometric series from
+// minhist to maxhist; `local` prefixes of the branch's own history of up to
+// localhist outcomes, from a table of PERC_LOCAL_ENTRIES such histories;
+// and `path` features on 2 address bits of each of the last 16, 32, ...
+// branches. Histories of any length are kept folded, so a lookup costs the
+// same however long they are.
+//
+// The budget is in KB of modeled bits: weightbits per weight plus the
+// local histories, with the weight tables (one per feature) a power of 2.
+
+#define PERC_MAX_FEATURES 16  // One SIMD register of 8-bit weights
+#define PERC_MAX_HIST     2048
+#define PERC_HIST_BUF     4096 // Must be a power of 2 above PERC_MAX_HIST
+#define PERC_LOCAL_ENTRIES 1024
+#define PERC_PATH_BITS    2    // Address bits of path history per branch
+#define PERC_PATH_STEP    16   // Branches more history each path feature has
+// Bits of path history path feature i folds
+#define PERC_PATH_LEN(i)  (PERC_PATH_BITS * PERC_PATH_STEP * (i))
+#define PERC_TC_LIMIT     32   // Threshold training (as in O-GEHL)
+#define PERC_PENDING      4
+
+typedef struct {
+    int global, local, path;
+    int min_hist, max_hist, local_hist;
+    int weight_bits, budget_kb;
+} perc_config_t;
+
+static perc_config_t perc_config = {
+    .global = 8,
+    .local = 1,
+    .path = 1,
+    .min_hist = 3,
+    .max_hist = 128,
+    .local_hist = 11,
+    .weight_bits = 8,
+    .budget_kb = 8,
+};
+
+// Worked out from perc_config by perc_check
+static int perc_features, perc_log_entries;
+static int perc_hist_len[PERC_MAX_FEATURES + 1]; // Global segment ends
+
+// A history of `length` bits XOR-folded down to `width`, as in tage.c;
+// folding is linear, so a segment's fold is the XOR of two prefixes'
+typedef struct {
+    uint32_t value;
+    int length, width;
+} perc_folded_t;
+
+typedef struct {
+    uint8_t bits[PERC_HIST_BUF]; // Bit i (0 the latest) at (ptr + i) % PERC_HIST_BUF
+    int ptr;
+} perc_hist_t;
+
+static int8_t *perc_weights = NULL; // perc_features tables, one after the other
+static perc_hist_t perc_global, perc_path;
+static perc_folded_t perc_global_fold[PERC_MAX_FEATURES + 1]; // From 1, as perc_hist_len
+static perc_folded_t perc_path_fold[PERC_MAX_FEATURES + 1];
+static uint32_t perc_local[PERC_LOCAL_ENTRIES];
+static int perc_theta, perc_tc;
+
+typedef struct {
+    bool valid;
+    uint64_t pc;
+    uint32_t index[PERC_MAX_FEATURES]; // Into perc_weights
+    int sum;
+} perc_lookup_t;
+
+// As in tage.c: the update trains the weights its prediction used
+static perc_lookup_t perc_pending[PERC_PENDING];
+static int perc_pending_next;
+
+/*
+ * The two vector kernels, over the weights a lookup picked gathered into
+ * one 16-byte register; lanes past perc_features are 0 and stay out of it.
+ * SSE2 has no signed byte sum or byte min/max, so both go through unsigned
+ * bytes by flipping the sign bit.
+ */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+static inline int perc_sum(const int8_t *w)
+{
+    __m128i bias = _mm_set1_epi8((char)0x80);
+    __m128i u = _mm_xor_si128(_mm_loadu_si128((const __m128i*)w), bias);
+    __m128i sad = _mm_sad_epu8(u, _mm_setzero_si128());
+    return _mm_cvtsi128_si32(sad) + _mm_extract_epi16(sad, 4) - 128 * PERC_MAX_FEATURES;
+}
+
+static inline void perc_train(int8_t *w, bool taken, int8_t w_min, int8_t w_max)
+{
+    __m128i bias = _mm_set1_epi8((char)0x80);
+    __m128i v = _mm_adds_epi8(_mm_loadu_si128((const __m128i*)w), _mm_set1_epi8(taken ? 1 : -1));
+    v = _mm_xor_si128(v, bias);
+    v = _mm_min_epu8(v, _mm_set1_epi8((char)(w_max ^ 0x80)));
+    v = _mm_max_epu8(v, _mm_set1_epi8((char)(w_min ^ 0x80)));
+    _mm_storeu_si128((__m128i*)w, _mm_xor_si128(v, bias));
+}
+#else
+
+static inline int perc_sum(const int8_t *w)
+{
+    int sum = 0;
+    for (int f = 0; f < PERC_MAX_FEATURES; f++)
+        sum += w[f];
+    return sum;
+}
+
+static inline void perc_train(int8_t *w, bool taken, int8_t w_min, int8_t w_max)
+{
+    for (int f = 0; f < PERC_MAX_FEATURES; f++) {
+        if (taken && w[f] < w_max)
+            w[f]++;
+        else if (!taken && w[f] > w_min)
+            w[f]--;
+    }
+}
+#endif
+
+static bool perc_set(const char *key, int value)
+{
+    if (strcmp(key, "global") == 0)
+        perc_config.global = value;
+    else if (strcmp(key, "local") == 0)
+        perc_config.local = value;
+    else if (strcmp(key, "path") == 0)
+        perc_config.path = value;
+    else if (strcmp(key, "minhist") == 0)
+        perc_config.min_hist = value;
+    else if (strcmp(key, "maxhist") == 0)
+        perc_config.max_hist = value;
+    else if (strcmp(key, "localhist") == 0)
+        perc_config.local_hist = value;
+    else if (strcmp(key, "weightbits") == 0)
+        perc_config.weight_bits = value;
+    else if (strcmp(key, "budget") == 0)
+        perc_config.budget_kb = value;
+    else {
+        printf("Error: perceptron has no setting \"%s\"\n", key);
+        return false;
+    }
+    return true;
+}
+
+static bool perc_check()
+{
+    const perc_config_t *c = &perc_config;
+    int g = c->global;
+
+    perc_features = 1 + c->global + c->local + c->path;
+    if (c->global < 0 || c->local < 0 || c->path < 0 || perc_features > PERC_MAX_FEATURES) {
+        printf("Error: perceptron takes up to %d features, the bias included\n",
+               PERC_MAX_FEATURES);
+        return false;
+    }
+    if (g > 0 && (c->min_hist < 1 || c->min_hist > c->max_hist || c->max_hist > PERC_MAX_HIST)) {
+        printf("Error: perceptron needs 1 <= minhist <= maxhist <= %d\n", PERC_MAX_HIST);
+        return false;
+    }
+    if (PERC_PATH_LEN(c->path) > PERC_MAX_HIST) {
+        printf("Error: perceptron takes up to %d path features\n", PERC_MAX_HIST / PERC_PATH_LEN(1));
+        return false;
+    }
+    if (c->local > 0 && (c->local_hist < c->local || c->local_hist > 32)) {
+        printf("Error: perceptron localhist must be 1 to 32, and at least local\n");
+        return false;
+    }
+    if (c->weight_bits < 2 || c->weight_bits > 8) {
+        printf("Error: perceptron weightbits must be 2 to 8\n");
+        return false;
+    }
+    if (c->budget_kb < 1 || c->budget_kb > 65536) {
+        printf("Error: perceptron budget must be 1 to 65536 KB\n");
+        return false;
+    }
+
+    int64_t bits = (int64_t)c->budget_kb * 8192;
+    if (c->local > 0)
+        bits -= (int64_t)PERC_LOCAL_ENTRIES * c->local_hist;
+    perc_log_entries = -1;
+    for (int64_t n = bits > 0 ? bits / perc_features / c->weight_bits : 0; n > 0; n >>= 1)
+        perc_log_entries++;
+    if (perc_log_entries < 2 || perc_log_entries > 24) {
+        printf("Error: a %d KB budget gives perceptron tables of 2^%d weights; need 2^2 to 2^24\n",
+               c->budget_kb, perc_log_entries);
+        return false;
+    }
+
+    // Geometric series, nudged apart where rounding makes two the same
+    perc_hist_len[0] = 0;
+    for (int i = 1; i <= g; i++) {
+        double ratio = g == 1 ? 1.0 : (double)(i - 1) / (g - 1);
+        int len = (int)(c->min_hist * pow((double)c->max_hist / c->min_hist, ratio) + 0.5);
+        if (len <= perc_hist_len[i - 1])
+            len = perc_hist_len[i - 1] + 1;
+        if (len > PERC_MAX_HIST) {
+            printf("Error: too many perceptron global features for maxhist %d\n", c->max_hist);
+            return false;
+        }
+        perc_hist_len[i] = len;
+    }
+    return true;
+}
+
+static void fold_init(perc_folded_t *f, int length, int width)
+{
+    f->value = 0;
+    f->length = length;
+    f->width = width;
+}
+
+static void hist_push(perc_hist_t *h, bool bit)
+{
+    h->ptr = (h->ptr - 1) & (PERC_HIST_BUF - 1);
+    h->bits[h->ptr] = bit;
+}
+
+// After a bit has been pushed onto h
+static void fold_update(perc_folded_t *f, const perc_hist_t *h)
+{
+    f->value = (f->value << 1) | h->bits[h->ptr];
+    f->value ^= (uint32_t)h->bits[(h->ptr + f->length) & (PERC_HIST_BUF - 1)]
+                << (f->length % f->width);
+    f->value ^= f->value >> f->width;
+    f->value &= (1u << f->width) - 1;
+}
+
+static void perc_init()
+{
+    int width = perc_log_entries;
+
+    free(perc_weights);
+    perc_weights = calloc((size_t)perc_features << perc_log_entries, 1);
+    if (perc_weights == NULL) {
+        printf("malloc failed to init perceptron\n");
+        exit(1);
+    }
+    memset(&perc_global, 0, sizeof(perc_global));
+    memset(&perc_path, 0, sizeof(perc_path));
+    for (int i = 1; i <= perc_config.global; i++)
+        fold_init(&perc_global_fold[i], perc_hist_len[i], width);
+    for (int i = 1; i <= perc_config.path; i++)
+        fold_init(&perc_path_fold[i], PERC_PATH_LEN(i), width);
+    memset(perc_local, 0, sizeof(perc_local));
+    perc_theta = (int)(1.93 * perc_features + 14);
+    perc_tc = 0;
+    memset(perc_pending, 0, sizeof(perc_pending));
+    perc_pending_next = 0;
+}
+
+static uint32_t *perc_local_entry(uint64_t PC)
+{
+    return &perc_local[(PC >> 2) & (PERC_LOCAL_ENTRIES - 1)];
+}
+
+static void perc_lookup(uint64_t PC, perc_lookup_t *l)
+{
+    const perc_config_t *c = &perc_config;
+    uint32_t mask = (1u << perc_log_entries) - 1;
+    uint32_t p = (uint32_t)(PC >> 2);
+    uint32_t local = *perc_local_entry(PC);
+    uint32_t folds[PERC_MAX_FEATURES];
+    int8_t w[PERC_MAX_FEATURES] = { 0 };
+    int f = 0;
+
+    folds[f++] = 0;
+    for (int i = 1; i <= c->global; i++)
+        folds[f++] = perc_global_fold[i].value ^ (i > 1 ? perc_global_fold[i - 1].value : 0);
+    for (int i = 1; i <= c->local; i++) {
+        int len = c->local_hist * i / c->local;
+        uint32_t h = len < 32 ? local & ((1u << len) - 1) : local;
+        folds[f++] = h ^ (h >> perc_log_entries) ^ (h >> (2 * perc_log_entries));
+    }
+    for (int i = 1; i <= c->path; i++)
+        folds[f++] = perc_path_fold[i].value;
+    assert(f == perc_features);
+
+    l->valid = true;
+    l->pc = PC;
+    for (f = 0; f < perc_features; f++) {
+        // Salted per feature, so features with the same history (all of
+        // them, at first) don't land on the same weights
+        uint32_t h = (p ^ (p >> perc_log_entries)) * 0x9e3779b1u + (uint32_t)f * 0x85ebca77u;
+        h ^= h >> 15;
+        l->index[f] = ((uint32_t)f << perc_log_entries) | ((h ^ folds[f]) & mask);
+        w[f] = perc_weights[l->index[f]];
+    }
+    l->sum = perc_sum(w);
+}
+
+static bool perc_predict(uint64_t PC)
+{
+    perc_lookup_t *l = &perc_pending[perc_pending_next];
+
+    perc_pending_next = (perc_pending_next + 1) % PERC_PENDING;
+    perc_lookup(PC, l);
+    return l->sum >= 0;
+}
+
+static void perc_update(uint64_t PC, bool taken)
+{
+    perc_lookup_t l;
+
+    l.valid = false;
+    for (int i = 1; i <= PERC_PENDING && !l.valid; i++) {
+        perc_lookup_t *p = &perc_pending[(perc_pending_next + PERC_PENDING - i) % PERC_PENDING];
+        if (p->valid && p->pc == PC) {
+            l = *p;
+            p->valid = false;
+        }
+    }
+    if (!l.valid)
+        perc_lookup(PC, &l);
+
+    bool mispredicted = (l.sum >= 0) != taken;
+    if (mispredicted || abs(l.sum) <= perc_theta) {
+        int8_t w[PERC_MAX_FEATURES] = { 0 };
+        int8_t w_max = (int8_t)((1 << (perc_config.weight_bits - 1)) - 1);
+        for (int f = 0; f < perc_features; f++)
+            w[f] = perc_weights[l.index[f]];
+        perc_train(w, taken, (int8_t)(-w_max - 1), w_max);
+        for (int f = 0; f < perc_features; f++)
+            perc_weights[l.index[f]] = w[f];
+
+        // Raise the threshold when mispredicts outnumber low-confidence
+        // hits, lower it the other way round
+        perc_tc += mispredicted ? 1 : -1;
+        if (perc_tc >= PERC_TC_LIMIT) {
+            perc_theta++;
+            perc_tc = 0;
+        } else if (perc_tc <= -PERC_TC_LIMIT && perc_theta > 0) {
+            perc_theta--;
+            perc_tc = 0;
+        }
+    }
+
+    uint32_t *local = perc_local_entry(PC);
+    *local = (*local << 1) | taken;
+    hist_push(&perc_global, taken);
+    for (int i = 1; i <= perc_config.global; i++)
+        fold_update(&perc_global_fold[i], &perc_global);
+    for (int b = 2; b < 2 + PERC_PATH_BITS; b++) {
+        hist_push(&perc_path, (PC >> b) & 1);
+        for (int i = 1; i <= perc_config.path; i++)
+            fold_update(&perc_path_fold[i], &perc_path);
+    }
+}
+
+// Everything but the weights, which are sized at run time
+static const ckpt_item_t perc_state[] = {
+    CKPT_ITEM(perc_global),
+    CKPT_ITEM(perc_path),
+    CKPT_ITEM(perc_global_fold),
+    CKPT_ITEM(perc_path_fold),
+    CKPT_ITEM(perc_local),
+    CKPT_ITEM(perc_theta),
+    CKPT_ITEM(perc_tc),
+    CKPT_ITEM(perc_pending),
+    CKPT_ITEM(perc_pending_next),
+};
+
+#define NUM_PERC_STATE (int)(sizeof(perc_state) / sizeof(perc_state[0]))
+
+static bool perc_save(FILE *fp)
+{
+    return ckpt_write(fp, perc_weights, (size_t)perc_features << perc_log_entries) &&
+           ckpt_write_items(fp, perc_state, NUM_PERC_STATE);
+}
+
+static bool perc_load(FILE *fp)
+{
+    return ckpt_read(fp, perc_weights, (size_t)perc_features << perc_log_entries) &&
+           ckpt_read_items(fp, perc_state, NUM_PERC_STATE);
+}
+
+const bp_engine_t perceptron_engine = {
+    .name = "perceptron",
+    .set = perc_set,
+    .check = perc_check,
+    .init = perc_init,
+    .predict = perc_predict,
+    .update = perc_update,
+    .save = perc_save,
+    .load = perc_load,
+    .config = &perc_config,
+    .config_size = sizeof(perc_config),
+};
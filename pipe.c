@@ -2,7 +2,11 @@
 #include "shell.h"
 #include "cache.h"
 #include "bp.h"
+#include "decode.h"
 #include "utils.h"
+#include "trace.h"
+#include "checkpoint.h"
+#include "stats.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -41,6 +45,103 @@ bool data_stalled = false; // Concerns IF, DE and EX, but NOT MEM or WB
 bool control_stalled = false; // Concerns IFonly
 bool wait_i_cache = false;
 bool wait_d_cache = false;
+bool fetch_stopped = false;
+
+// pipe_reg_EX_MEM as it was when a load or store missed, to be put back
+// each cycle until the miss is served
+static pipe_reg_EX_MEM_t before_stall_backup;
+
+// The longest wait a cache query handed fetch or MEM in the last cycle;
+// only a hint for pipe_cycle_quiet, so it isn't part of the pipeline state
+static int pipe_wait_longest = 0;
+
+static inline void pipe_note_wait(int remaining_cycles)
+{
+    if (remaining_cycles > pipe_wait_longest)
+        pipe_wait_longest = remaining_cycles;
+}
+
+// Pipeline statistics, on top of the ones in shell.h. Stall cycles are
+// counted at the end of each cycle by the flags set for the next one, and
+// bubbles as WB throws them away.
+static uint64_t stat_branches[BP_KINDS], stat_branch_mispredicts[BP_KINDS];
+static uint64_t stat_branch_btb_hits[BP_KINDS]; // Found in the BTB at fetch
+static uint64_t stat_data_stall_cycles, stat_control_stall_cycles;
+static uint64_t stat_icache_stall_cycles, stat_dcache_stall_cycles;
+static uint64_t stat_dbubbles, stat_cbubbles, stat_membubbles;
+
+// stat_inst_fetch as of the last instruction decode took, or squashed
+static uint32_t decode_seen_fetch = 0;
+
+static void pipe_register_stats()
+{
+    static const char *kinds[BP_KINDS] = { "conditional", "direct", "call", "return", "indirect" };
+    char name[64];
+
+    for (int k = 0; k < BP_KINDS; k++) {
+        snprintf(name, sizeof(name), "branch.%s", kinds[k]);
+        stats_register_u64(name, &stat_branches[k]);
+        snprintf(name, sizeof(name), "branch.%s_mispredicts", kinds[k]);
+        stats_register_u64(name, &stat_branch_mispredicts[k]);
+        snprintf(name, sizeof(name), "branch.%s_btb_hits", kinds[k]);
+        stats_register_u64(name, &stat_branch_btb_hits[k]);
+    }
+    stats_register_u64("stall.data_cycles", &stat_data_stall_cycles);
+    stats_register_u64("stall.control_cycles", &stat_control_stall_cycles);
+    stats_register_u64("stall.icache_cycles", &stat_icache_stall_cycles);
+    stats_register_u64("stall.dcache_cycles", &stat_dcache_stall_cycles);
+    stats_register_u64("bubbles.data", &stat_dbubbles);
+    stats_register_u64("bubbles.control", &stat_cbubbles);
+    stats_register_u64("bubbles.mem", &stat_membubbles);
+}
+
+// Counts n cycles that ended in the state the pipeline is in now
+static void pipe_count_cycles(uint64_t n)
+{
+    if (data_stalled)
+        stat_data_stall_cycles += n;
+    if (control_stalled)
+        stat_control_stall_cycles += n;
+    if (wait_i_cache)
+        stat_icache_stall_cycles += n;
+    if (wait_d_cache)
+        stat_dcache_stall_cycles += n;
+}
+
+static void pipe_count_bubbles(instruction_type_t type, uint64_t n)
+{
+    if (type == INST_DBUBBLE)
+        stat_dbubbles += n;
+    else if (type == INST_CBUBBLE)
+        stat_cbubbles += n;
+    else if (type == INST_MEMBUBBLE)
+        stat_membubbles += n;
+}
+
+// Simulator-side cache of decoded instructions, indexed by PC. It only
+// speeds up pipe_stage_decode; it models no hardware and costs no cycles.
+// An entry remembers the instruction word it was decoded from, so a PC
+// whose instruction has been overwritten simply misses and is decoded again.
+#define PREDECODE_ENTRIES 4096 // Must be a power of 2
+
+typedef struct {
+    bool valid;
+    uint64_t pc;
+    instruction_t inst;
+    bool starts_control_stall; // unit_control sets init_control_stall
+    interface_WB WB;
+    interface_M M;
+    interface_EX EX;
+    int64_t frag;
+    instruction_layout_t layout;
+    instruction_type_t type;
+    uint32_t read_reg_1;
+    uint32_t read_reg_2;
+    uint32_t inst_31_21;
+    uint32_t inst_4_0;
+} predecoded_t;
+
+static predecoded_t predecode_cache[PREDECODE_ENTRIES];
 
 char* to_bin_str_32(uint32_t num) {
     static char binaryStr[65]; // 64 bits + 1 for null terminator
@@ -54,17 +155,17 @@ char* to_bin_str_32(uint32_t num) {
 }
 
 void print_cache_contents(cache_t* c) {
-    cache_line_t curr;
-    printf("-----START PRINT CACHE-----\n");
+    printf("-----START PRINT CACHE (%s)-----\n", c->repl.ops->name);
     for (int i = 0; i < c->num_sets; i++) {
         for (int j = 0; j < c->num_lines; j++) {
-            curr = c->lines[i][j];
-            if (!curr.valid_bit)
+            int line = i * c->num_lines + j;
+            if (!(c->tags[line] & TAG_VALID))
                 continue;
-            printf("set: %d | line: %d | tag: %ld | timestamp: %ld\n", i, j, curr.tag, curr.used_timestamp);
+            printf("set: %d | line: %d | tag: %ld\n", i, j, c->tags[line] & ~TAG_VALID);
             printf("data: ");
-            for (int k = 0; k < BLOCK_SIZE; k++) {
-                printf("%d ", curr.data[k]);
+            uint8_t *data = cache_line_data(c, line);
+            for (int k = 0; k < c->block_size; k++) {
+                printf("%d ", data[k]);
             }
             printf("\n");
         }
@@ -286,90 +387,16 @@ void print_bp_data() {
         return;
     }
 
-    fprintf(fp, "GHR: %d\n", BP_data.GHR);
-
-    fprintf(fp, "PHT:\n");
-    for (int i = 0; i < PHTSIZE; ++i) {
-        fprintf(fp, "%d ", BP_data.PHT[i]);
-        if ((i + 1) % 16 == 0) fprintf(fp, "\n");
-    }
+    gshare_print(fp);
 
     fprintf(fp, "BTB:\n");
-    for (int i = 0; i < BTBSIZE; ++i) {
-        fprintf(fp, "Entry %d:\n", i);
-        fprintf(fp, "  Tag: 0x%lx\n", BP_data.BTB[i].tag);
-        fprintf(fp, "  Valid: %s\n", BP_data.BTB[i].valid ? "true" : "false");
-        fprintf(fp, "  Conditional: %s\n", BP_data.BTB[i].is_conditional ? "true" : "false");
-        fprintf(fp, "  Target: 0x%lx\n", BP_data.BTB[i].target);
-    }
+    btb_print(fp);
 
     fprintf(fp, "\n----- Finished printing BTB at the beginning of cycle %d -----\n\n", stat_cycles+1);
 
     fclose(fp);
 }
 
-void unit_control_r_format(
-    interface_WB *WB,
-    interface_M *M,
-    interface_EX *EX,
-    instruction_layout_t *layout
-) {
-    WB->RegWrite = true;
-    WB->MemtoReg = false;
-    M->ConfirmedBranch = false;
-    M->BranchIfZero = false;
-    M->MemRead = false;
-    M->MemWrite = false;
-    // M->DataSize is irrelevant
-    // EX->ALUOp shall be assigned in the calling subroutine
-    EX->ALUSrc = false; // Second operand is not immediate (but register)
-    // *frag is irrelevant
-    *layout = INST_R;
-}
-
-void unit_control_i_format(
-    instruction_t inst,
-    interface_WB *WB,
-    interface_M *M,
-    interface_EX *EX,
-    int64_t *frag,
-    instruction_layout_t *layout
-) {
-    WB->RegWrite = true;
-    WB->MemtoReg = false;
-    M->ConfirmedBranch = false;
-    M->BranchIfZero = false;
-    M->MemRead = false;
-    M->MemWrite = false;
-    //M->DataSize is irrelevant
-    // EX->ALUOp shall be assigned in the calling subroutine
-    EX->ALUSrc = true; // Second operand is immediate
-    *frag = sign_extend_64(inst, 10, 22);
-    *layout = INST_I;
-}
-
-void unit_control_d_format(
-    instruction_t inst,
-    interface_WB *WB,
-    interface_M *M,
-    interface_EX *EX,
-    int64_t *frag,
-    instruction_layout_t *layout
-) {
-    // WB->RegWrite and
-    // WB->MemtoReg shall be assigned in the calling subroutine
-    WB->SetFlags = false;
-    M->ConfirmedBranch = false;
-    M->BranchIfZero = false;
-    // M->MemRead,
-    // M->MemWrite and
-    // M->DataSize shall be assigned in the calling subroutine
-    EX->ALUOp = OP_ADD;
-    EX->ALUSrc = true; // Second operand is immediate
-    *frag = sign_extend_64(inst, 12, 21);
-    *layout = INST_D;
-}
-
 void create_d_bubble() {
     pipe_reg_DE_EX.WB.RegWrite = false;
     // WB.toReg is irrelevant
@@ -430,6 +457,7 @@ instruction_t fetch(uint64_t addr)
     // on a miss, start a 10 cycle stall, and the inst should be returned on the 11th cycle
     query_state_t inst_query = cache_read_handler(i_cache, addr, 4);
     wait_i_cache = inst_query.remaining_cycles > 0;
+    pipe_note_wait(inst_query.remaining_cycles);
     return inst_query.data; // Could be garbage if wait_i_cache==true,
                             // but nothing else we can do.
 }
@@ -452,7 +480,6 @@ void unit_ALU(mop_operate_type_t op_type, uint64_t operand1, uint64_t operand2,
 
     case OP_ADDS:
         *ALU_result = operand1 + operand2;
-        pipe_reg_EX_MEM.WB.SetFlags = true;
         break;
 
     case OP_AND:
@@ -461,7 +488,6 @@ void unit_ALU(mop_operate_type_t op_type, uint64_t operand1, uint64_t operand2,
 
     case OP_ANDS:
         *ALU_result = operand1 & operand2;
-        pipe_reg_EX_MEM.WB.SetFlags = true;
         // previously, this case computed result and stored it in the dest:
         // result =   unified_load_64(m.inst.operate.src1)
         //          & unified_load_64(m.inst.operate.src2);
@@ -491,7 +517,6 @@ void unit_ALU(mop_operate_type_t op_type, uint64_t operand1, uint64_t operand2,
     case OP_SUBS:
     //case OP_CMP: // Note: OP_SUBS encompasses OP_CMP
         *ALU_result = operand1 - operand2;
-        pipe_reg_EX_MEM.WB.SetFlags = true;
         break;
 
     case OP_MUL:
@@ -512,7 +537,6 @@ void unit_ALU(mop_operate_type_t op_type, uint64_t operand1, uint64_t operand2,
 
 void unit_control(
     uint32_t inst,
-    CPU_State state,
     interface_WB *WB,
     interface_M *M,
     interface_EX *EX,
@@ -520,412 +544,26 @@ void unit_control(
     instruction_layout_t *layout,
     instruction_type_t *type
 ) {
-    uint32_t opcode = truncator32(inst, 21, 32);
-    uint32_t shamt;
-    shamt = truncator32(inst, 10, 16); // assertions maybe not necessary
-    uint32_t test = 0xffffffff;
-
-    bool is_ADDS_extended_register = false;
-    bool is_ADDS_immediate = false;
-    bool is_ANDS_shifted = false;
-    bool is_SUBS_extended_register = false;
-    bool is_SUBS_immediate = false;
-    bool is_load = false;
-    bool is_lsr = false;
-
-    uint32_t cond = truncator32(inst, 0, 4);
-
-    // Keeps the highest 11 bits.
-    // Suffices for R- and D-format instructions.
-    // Overshoots for I-format instructions; will just use more cases.
-    switch(opcode) {
-    // ---------- INST_OPERATE ----------
-
-    // Note: the asm2hex script defaults to shifted register encodings of
-    // instructions when the extended register versions are used, so
-    // these opcodes must be encompassed as well.
-
-    // ADDS (extended register)
-    case 0b10101011000:
-    case 0b10101011001:
-        is_ADDS_extended_register = true;
-        // [[fallthrough]]
-    // ADD (extended register)
-    case 0b10001011000:
-    case 0b10001011001:
-        *type = INST_OPERATE;
-        EX->ALUOp = (is_ADDS_extended_register) ? OP_ADDS : OP_ADD;
-        WB->SetFlags = is_ADDS_extended_register;
-        unit_control_r_format(WB, M, EX, layout);
-        break;
-
-    // ADDS (immediate)
-    case 0b10110001000:
-    case 0b10110001001:
-    case 0b10110001010:
-    case 0b10110001011:
-    case 0b10110001100:
-    case 0b10110001101:
-    case 0b10110001110:
-    case 0b10110001111:
-        is_ADDS_immediate = true;
-        // [[fallthrough]]
-    // ADD (immediate)
-    case 0b10010001000:
-    case 0b10010001001:
-    case 0b10010001010:
-    case 0b10010001011:
-    case 0b10010001100:
-    case 0b10010001101:
-    case 0b10010001110:
-    case 0b10010001111:
-        *type = INST_OPERATE;
-        EX->ALUOp = (is_ADDS_immediate) ? OP_ADDS : OP_ADD;
-        WB->SetFlags = is_ADDS_immediate;
-        unit_control_i_format(inst, WB, M, EX, frag, layout);
-        break;
-
-    // ANDS (shifted register)
-    case 0b11101010000:
-        is_ANDS_shifted = true;
-        // [[fallthrough]]
-    // AND (shifted register)
-    case 0b10001010000:
-	*type = INST_OPERATE;
-        EX->ALUOp = (is_ANDS_shifted) ? OP_ANDS : OP_AND;
-        WB->SetFlags = is_ANDS_shifted;
-        unit_control_r_format(WB, M, EX, layout);
-        break;
-
-    // EOR (shifted register)
-    case 0b11001010000:
-        assert(shamt == 0);
-        *type = INST_OPERATE;
-        EX->ALUOp = OP_EOR;
-        WB->SetFlags = false;
-        unit_control_r_format(WB, M, EX, layout);
-        break;
-
-    // ORR (shifted register)
-    case 0b10101010000:
-        assert(shamt == 0);
-        *type = INST_OPERATE;
-        EX->ALUOp = OP_ORR;
-        WB->SetFlags = false;
-        unit_control_r_format(WB, M, EX, layout);
-        break;
-
-    // LSL & LSR (immediate)
-    // These instructions share the same opcode(s),
-    // but LSR occurs when shamt = 0b111111
-    case 0b11010011010:
-    case 0b11010011011:
-        is_lsr = (shamt == 0b111111);
-        *type = INST_OPERATE;
-        EX->ALUOp = is_lsr ? OP_LSR : OP_LSL;
-        unit_control_i_format(inst, WB, M, EX, frag, layout);
-        break;
-
-    // SUBS (extended register) / CMP (extended register)
-    case 0b11101011000: // shifted register
-    case 0b11101011001:
-        is_SUBS_extended_register = true;
-    // SUB (extended register)
-    case 0b11001011000: // shifted register
-    case 0b11001011001:
-        *type = INST_OPERATE;
-        EX->ALUOp = (is_SUBS_extended_register) ? OP_SUBS : OP_SUB;
-        WB->SetFlags = is_SUBS_extended_register;
-        unit_control_r_format(WB, M, EX, layout);
-        break;
-
-    // SUBS (immediate) / CMP (immediate)
-    // # Note: shift bits always 00, so only these cases needed
-    case 0b11110001000:
-    case 0b11110001001:
-        is_SUBS_immediate = true;
-    // SUB (immediate)
-    case 0b11010001000:
-    case 0b11010001001:
-        *type = INST_OPERATE;
-        EX->ALUOp = (is_SUBS_immediate) ? OP_SUBS : OP_SUB;
-        WB->SetFlags = is_SUBS_immediate;
-        unit_control_i_format(inst, WB, M, EX, frag, layout);
-        break;
-
-    // MUL
-    case 0b10011011000:
-        *type = INST_OPERATE;
-        EX->ALUOp = OP_MUL;
-        WB->SetFlags = false;
-        unit_control_i_format(inst, WB, M, EX, frag, layout);
-        break;
-
-
-    // ---------- INST_DATAMOV ----------
-
-    // LDUR (64-bit)
-    case 0b11111000010:
-    // LDUR (32-bit)
-    case 0b10111000010:
-    // LDURH (16-bit)
-    case 0b01111000010:
-    // LDURB (8-bit)
-    case 0b00111000010:
-        is_load = true;
-    // STUR (64-bit)
-    case 0b11111000000:
-    // STUR (32-bit)
-    case 0b10111000000:
-    // STURH (16-bit)
-    case 0b01111000000:
-    // STURB (8-bit)
-    case 0b00111000000:
-        assert(truncator32(inst, 5, 10) != 31); // SP
-        *type = INST_DATAMOV;
-        unit_control_d_format(inst, WB, M, EX, frag, layout);
-
-        M->DataSize = 8 << truncator32(inst, 30, 32);
-        // These four instructions only differ in the first two bits:
-        // 00 -> 8-bits, 01 -> 16-bits, 10 -> 32-bits, 11 -> 64-bits,
-        // allowing for such unified treatment.
-        if (is_load) { // LDUR
-            WB->RegWrite = true;
-            WB->MemtoReg = true;
-            M->MemRead = true;
-            M->MemWrite = false;
-        }
-        else { // STUR
-            WB->RegWrite = false;
-            WB->MemtoReg = false; // Doesn't really matter
-            M->MemRead = false;
-            M->MemWrite = true;
-        }
-        break;
-
-    // MOVZ
-    case 0b11010010100:
-    case 0b11010010101:
-    case 0b11010010110:
-    case 0b11010010111:
-        assert(truncator32(inst, 21, 23) == 0);
-        *type = INST_DATAMOV;
-        // MOVZ operates diff than LDUR and STUR so we cannot use this function
-        // unit_control_d_format(inst, WB, M, EX, frag);
-        EX->ALUOp = OP_PASSTHRU_2_S;
-        EX->ALUSrc = true;
-        *frag = sign_extend_64(inst, 5, 21);
-        WB->RegWrite = true;
-        WB->MemtoReg = false;
-        M->DataSize = 16;
-        M->MemRead = false;
-        M->MemWrite = false;
-        M->ConfirmedBranch = false;
-        M->BranchIfZero = false;
-        *layout = INST_IM;
-        break;
-
-
-    // ---------- INST_CONTROL ----------
-
-    // BR
-    case 0b11010110000:
-        *type = INST_CONTROL;
-        WB->RegWrite = false;
-        // WB->MemtoReg is irrelevant
-        WB->SetFlags = false;
-        M->ConfirmedBranch = true;
-        M->BranchIfZero = false;
-        M->MemRead = false;
-        M->MemWrite = false;
-        // M->DataSize is irrelevant
-        EX->ALUSrc = true;
-        EX->ALUOp = OP_PASSTHRU_2_S;
-        EX->b_type = BR;
-        init_control_stall = true;
-        *frag = CURRENT_STATE.REGS[truncator32(inst, 5, 10)] - state.PC;
-        *layout = INST_BR;
-        break;
-
-    // B
-    case 0b00010100000:
-    case 0b00010100001:
-    case 0b00010100010:
-    case 0b00010100011:
-    case 0b00010100100:
-    case 0b00010100101:
-    case 0b00010100110:
-    case 0b00010100111:
-    case 0b00010101000:
-    case 0b00010101001:
-    case 0b00010101010:
-    case 0b00010101011:
-    case 0b00010101100:
-    case 0b00010101101:
-    case 0b00010101110:
-    case 0b00010101111:
-    case 0b00010110000:
-    case 0b00010110001:
-    case 0b00010110010:
-    case 0b00010110011:
-    case 0b00010110100:
-    case 0b00010110101:
-    case 0b00010110110:
-    case 0b00010110111:
-    case 0b00010111000:
-    case 0b00010111001:
-    case 0b00010111010:
-    case 0b00010111011:
-    case 0b00010111100:
-    case 0b00010111101:
-    case 0b00010111110:
-    case 0b00010111111:
-        *type = INST_CONTROL;
-        WB->RegWrite = false;
-        // WB->MemtoReg is irrelevant
-        WB->SetFlags = false;
-        M->ConfirmedBranch = true;
-        M->BranchIfZero = false;
-        M->MemRead = false;
-        M->MemWrite = false;
-        // M->DataSize,
-        // EX->ALUSrc and
-        // EX->ALUOp are irrelevant
-        EX->b_type = B;
-        init_control_stall = true;
-        *frag = sign_extend_64(inst, 0, 26);
-        *layout = INST_B;
-        break;
-
-    // CBNZ
-    case 0b10110101000:
-    case 0b10110101001:
-    case 0b10110101010:
-    case 0b10110101100:
-    case 0b10110101011:
-    case 0b10110101110:
-    case 0b10110101101:
-    case 0b10110101111:
-        *type = INST_CONTROL;
-        WB->RegWrite = false;
-        // WB->MemtoReg is irrelevant
-        WB->SetFlags = false;
-        M->ConfirmedBranch = false;
-        M->BranchIfZero = false;
-        M->MemRead = false;
-        M->MemWrite = false;
-        // M->DataSize is irrelevant
-        EX->ALUSrc = 0;
-        EX->ALUOp = OP_NOT_2_S;
-        EX->b_type = CBNZ;
-        init_control_stall = true;
-        *frag = sign_extend_64(inst, 5, 24);
-        *layout = INST_CB;
-        break;
-
-    // CBZ
-    case 0b10110100000:
-    case 0b10110100001:
-    case 0b10110100010:
-    case 0b10110100100:
-    case 0b10110100011:
-    case 0b10110100110:
-    case 0b10110100101:
-    case 0b10110100111:
-        *type = INST_CONTROL;
-        WB->RegWrite = false;
-        // WB->MemtoReg is irrelevant
-        WB->SetFlags = false;
-        M->ConfirmedBranch = false;
-        M->BranchIfZero = false;
-        M->MemRead = false;
-        M->MemWrite = false;
-        // M->DataSize is irrelevant
-        EX->ALUSrc = 0;
-        EX->ALUOp = OP_PASSTHRU_2_S;
-        EX->b_type = CBZ;
-        init_control_stall = true;
-        *frag = sign_extend_64(inst, 5, 24);
-        *layout = INST_CB;
-        break;
-
-    // B.cond all have same opcodes, but with diff cond values in last 4 bits
-    case 0b01010100000:
-    case 0b01010100001:
-    case 0b01010100010:
-    case 0b01010100100:
-    case 0b01010100011:
-    case 0b01010100101:
-    case 0b01010100110:
-    case 0b01010100111:
-        *type = INST_CONTROL;
-        switch (cond) { // C and V flags assumed to be 0
-            // BEQ
-            case 0b0000:
-                EX->b_type = BEQ;
-                break;
-            // BNE
-            case 0b0001:
-                EX->b_type = BNE;
-                break;
-            // BGT
-            case 0b1100:
-                EX->b_type = BGT;
-                break;
-            // BLT
-            case 0b1011:
-                EX->b_type = BLT;
-                break;
-            // BGE
-            case 0b1010:
-                EX->b_type = BGE;
-                break;
-            // BLE
-            case 0b1101:
-                EX->b_type = BLE;
-                break;
-        }
-        WB->RegWrite = false;
-        // WB->MemtoReg is irrelevant
-        WB->SetFlags = false;
-        M->ConfirmedBranch = false;
-        M->BranchIfZero = false;
-        M->MemRead = false;
-        M->MemWrite = false;
-        // M->DataSize is irrelevant
-        EX->ALUSrc = 0;
-        EX->ALUOp = OP_PASSTHRU_2_S;
-        init_control_stall = true;
-        *frag = sign_extend_64(inst, 5, 24);
-        *layout = INST_BC;
-        break;
-
+    decode_entry_t d;
+    decode_inst(inst, &d, frag);
 
-    // ---------- INST_OTHEROP ----------
+    *WB = d.WB;
+    *M = d.M;
+    *EX = d.EX;
+    *layout = d.layout;
+    *type = d.type;
 
-    // HLT
-    case 0b11010100010:
-
-        WB->RegWrite = false;
-        // WB->MemtoReg is irrelevant
-        WB->SetFlags = false;
-        M->ConfirmedBranch = false;
-        M->BranchIfZero = false;
-        M->MemRead = false;
-        M->MemWrite = false;
-        // M->DataSize is irrelevant
-        EX->ALUSrc = 0;
-        // other flags irrelevant
+    switch (d.tmpl) {
+    case DEC_HLT:
         CURRENT_STATE.PC += 4;
         FE_halted = true;
         break;
-
-    // ---------- INST_INVALID ----------
-    // Unsupported instruction
     default:
-        assert(0); // Return an error
+        break;
     }
 
+    if (d.type == INST_CONTROL)
+        init_control_stall = true;
 }
 
 // we use this for reading only for simplicity in the WB stage
@@ -997,7 +635,9 @@ void unit_Data_memory(
     int *cycles
 ) {
     assert(!(MemWrite && MemRead)); // Shouldn't do both
-    assert(DataSize == 8 || DataSize == 16 || DataSize == 32 || DataSize == 64);
+    // DataSize is only set by loads and stores
+    assert(!(MemWrite || MemRead) ||
+           DataSize == 8 || DataSize == 16 || DataSize == 32 || DataSize == 64);
     // If not, we probably had a corrupted instruction
 
     if(MemRead) {
@@ -1010,13 +650,14 @@ void unit_Data_memory(
         // To make the timings correct, we set wait_d_cache
         // in cache_refresh_query_states, rather than here
         *cycles = query.remaining_cycles;
-        *Read_data = query.data & ((1 << DataSize) - 1);
+        *Read_data = query.data; // Only DataSize bits were read
     } else if(MemWrite) {
         // Note that DataSize measures things in bits,
         // whereas cache_write_handler accepts sizes in bytes
         query_state_t query = cache_write_handler(d_cache, Address, DataSize / 8, Write_data);
         *cycles = query.remaining_cycles;
     } else { // Nothing to do
+        *cycles = 0;
     }
 }
 
@@ -1088,7 +729,8 @@ void unit_forward() {
             need_stall = true;
     }
     else if((pipe_reg_EX_MEM.inst_type == INST_DATAMOV && (!pipe_reg_EX_MEM.WB.MemtoReg) && pipe_reg_EX_MEM.WB.RegWrite) // MOV; result is ready as pipe_reg_EX_MEM.ALUresult
-         || (pipe_reg_EX_MEM.inst_type == INST_OPERATE)) { // Arithmetic instruction; result is ready as pipe_reg_EX_MEM.ALUresult
+         || (pipe_reg_EX_MEM.inst_type == INST_OPERATE) // Arithmetic instruction; result is ready as pipe_reg_EX_MEM.ALUresult
+         || (pipe_reg_EX_MEM.inst_type == INST_CONTROL && pipe_reg_EX_MEM.WB.RegWrite)) { // BL; the return address is the ALUresult
         if(collision_reg_1) {
             pipe_reg_DE_EX.Read_data_1 = pipe_reg_EX_MEM.ALUresult;
             depends_on_reg_1 = false;
@@ -1113,7 +755,8 @@ void unit_forward() {
         }
     }
     else if((pipe_reg_MEM_WB.inst_type == INST_DATAMOV && (!pipe_reg_MEM_WB.WB.MemtoReg) && pipe_reg_MEM_WB.WB.RegWrite) // MOV*; result is ready as pipe_reg_MEM_WB.ALUresult
-    || (pipe_reg_MEM_WB.inst_type == INST_OPERATE)) { // Arithmetic instruction; result is ready as pipe_reg_MEM_WB.ALUresult
+    || (pipe_reg_MEM_WB.inst_type == INST_OPERATE) // Arithmetic instruction; result is ready as pipe_reg_MEM_WB.ALUresult
+    || (pipe_reg_MEM_WB.inst_type == INST_CONTROL && pipe_reg_MEM_WB.WB.RegWrite)) { // BL, likewise
         if(collision_reg_1) {
             pipe_reg_DE_EX.Read_data_1 = pipe_reg_MEM_WB.ALUresult;
             depends_on_reg_1 = false;
@@ -1139,19 +782,164 @@ void unit_forward() {
         set_flags(pipe_reg_EX_MEM.ALUresult, &pipe_reg_DE_EX.State);
         awaiting_flags = false;
     }
-    // We don't need to manually handle the pipe_reg_MEM_WB contents,
-    // because if the upcoming WB stage needs to set flags, it will
-    // do so itself in-place.
+    // The upcoming WB stage only sets the flags in CURRENT_STATE, and the
+    // flags in pipe_reg_DE_EX.State were copied from there at fetch time.
+    // If the inst sat in fetch or decode for a while (e.g. behind a slow
+    // i-cache hit) the flag-setting inst may have moved on since, so we take
+    // the flags from MEM_WB or, failing that, from CURRENT_STATE.
+    if(pipe_reg_MEM_WB.WB.SetFlags && awaiting_flags) {
+        set_flags(pipe_reg_MEM_WB.ALUresult, &pipe_reg_DE_EX.State);
+        awaiting_flags = false;
+    }
+    if(awaiting_flags) {
+        pipe_reg_DE_EX.State.FLAG_N = CURRENT_STATE.FLAG_N;
+        pipe_reg_DE_EX.State.FLAG_Z = CURRENT_STATE.FLAG_Z;
+    }
+}
+
+static bool is_bubble(instruction_type_t type)
+{
+    return type == INST_DBUBBLE || type == INST_CBUBBLE || type == INST_MEMBUBBLE;
+}
+
+bool pipe_empty()
+{
+    return !wait_d_cache && !data_stalled && !control_stalled && !init_control_stall &&
+           (!init_IF_DE || pipe_reg_IF_DE.to_squash || pipe_reg_IF_DE.to_flush ||
+            pipe_reg_IF_DE.to_mem_stall) &&
+           (!init_DE_EX || is_bubble(pipe_reg_DE_EX.inst_type)) &&
+           (!init_EX_MEM || is_bubble(pipe_reg_EX_MEM.inst_type)) &&
+           (!init_MEM_WB || is_bubble(pipe_reg_MEM_WB.inst_type));
 }
 
 void pipe_init()
 {
     memset(&CURRENT_STATE, 0, sizeof(CPU_State));
+    memset(predecode_cache, 0, sizeof(predecode_cache));
     CURRENT_STATE.PC = 0x00400000;
+    pipe_register_stats();
     bp_init();
     cache_init_all();
 }
 
+// Everything above that lasts from one cycle to the next. fetch_stopped
+// is only ever set within a command, so it is always clear here.
+static const ckpt_item_t pipe_state[] = {
+    CKPT_ITEM(RUN_BIT),
+    CKPT_ITEM(CURRENT_STATE),
+    CKPT_ITEM(pipe_reg_IF_DE),
+    CKPT_ITEM(pipe_reg_DE_EX),
+    CKPT_ITEM(pipe_reg_EX_MEM),
+    CKPT_ITEM(pipe_reg_MEM_WB),
+    CKPT_ITEM(init_IF_DE),
+    CKPT_ITEM(init_DE_EX),
+    CKPT_ITEM(init_EX_MEM),
+    CKPT_ITEM(init_MEM_WB),
+    CKPT_ITEM(FE_halted),
+    CKPT_ITEM(DE_halted),
+    CKPT_ITEM(EX_halted),
+    CKPT_ITEM(MEM_halted),
+    CKPT_ITEM(init_control_stall),
+    CKPT_ITEM(data_stalled),
+    CKPT_ITEM(control_stalled),
+    CKPT_ITEM(wait_i_cache),
+    CKPT_ITEM(wait_d_cache),
+    CKPT_ITEM(before_stall_backup),
+};
+
+#define NUM_PIPE_STATE (int)(sizeof(pipe_state) / sizeof(pipe_state[0]))
+
+// Kept apart from pipe_state, which pipe_cycle_quiet compares as a whole
+static const ckpt_item_t pipe_stats[] = {
+    CKPT_ITEM(stat_branches),
+    CKPT_ITEM(stat_branch_mispredicts),
+    CKPT_ITEM(stat_branch_btb_hits),
+    CKPT_ITEM(stat_data_stall_cycles),
+    CKPT_ITEM(stat_control_stall_cycles),
+    CKPT_ITEM(stat_icache_stall_cycles),
+    CKPT_ITEM(stat_dcache_stall_cycles),
+    CKPT_ITEM(stat_dbubbles),
+    CKPT_ITEM(stat_cbubbles),
+    CKPT_ITEM(stat_membubbles),
+    CKPT_ITEM(decode_seen_fetch),
+};
+
+#define NUM_PIPE_STATS (int)(sizeof(pipe_stats) / sizeof(pipe_stats[0]))
+
+bool pipe_save(FILE *fp)
+{
+    return ckpt_write_items(fp, pipe_state, NUM_PIPE_STATE) &&
+           ckpt_write_items(fp, pipe_stats, NUM_PIPE_STATS);
+}
+
+bool pipe_load(FILE *fp)
+{
+    // Memory is about to change under it
+    memset(predecode_cache, 0, sizeof(predecode_cache));
+    return ckpt_read_items(fp, pipe_state, NUM_PIPE_STATE) &&
+           ckpt_read_items(fp, pipe_stats, NUM_PIPE_STATS);
+}
+
+// Event skipping. While a miss is outstanding the pipeline often settles
+// into a state that every further cycle leaves as it is, and cycles then
+// only count the MSHRs down. pipe_cycle_quiet spots that by comparing the
+// pipeline state before and after the cycle, and only where it is certain
+// the stages did nothing else: EX is held by the d-cache stall or has only
+// a bubble to work on, so no branch trains the predictor, and nothing
+// retired or was fetched. Taking the snapshots costs a few cycles' worth
+// of time, so we only try when there are more than PIPE_QUIET_MIN cycles
+// to gain.
+#define PIPE_SNAPSHOT_SIZE 2048
+#define PIPE_QUIET_MIN 8
+
+static size_t pipe_snapshot(uint8_t *buf)
+{
+    size_t size = 0;
+    for (int i = 0; i < NUM_PIPE_STATE; i++) {
+        memcpy(buf + size, pipe_state[i].data, pipe_state[i].size);
+        size += pipe_state[i].size;
+    }
+    assert(size <= PIPE_SNAPSHOT_SIZE);
+    return size;
+}
+
+int pipe_cycle_quiet()
+{
+    static uint8_t before[PIPE_SNAPSHOT_SIZE], after[PIPE_SNAPSHOT_SIZE];
+    uint32_t retired = stat_inst_retire, fetched = stat_inst_fetch;
+    size_t size = 0;
+
+#ifndef SIM_TRACE // The trace should show every cycle
+    // Hits that take a few cycles also set the wait flags, so the stages'
+    // own count rules those out before we look through the MSHRs
+    if ((wait_i_cache || wait_d_cache) && pipe_wait_longest > PIPE_QUIET_MIN) {
+        int quiet = cache_quiet_cycles(); // INT_MAX if there is no miss to wait for
+        if (quiet > PIPE_QUIET_MIN && quiet != INT_MAX)
+            size = pipe_snapshot(before);
+    }
+#endif
+    pipe_wait_longest = 0;
+    pipe_cycle();
+    if (size == 0 || !(wait_i_cache || wait_d_cache) ||
+        retired != stat_inst_retire || fetched != stat_inst_fetch)
+        return 0;
+    if (!wait_d_cache && init_DE_EX && !is_bubble(pipe_reg_DE_EX.inst_type))
+        return 0;
+    pipe_snapshot(after);
+    if (memcmp(before, after, size) != 0)
+        return 0;
+    return cache_quiet_cycles();
+}
+
+void pipe_skip_cycles(int n)
+{
+    cache_skip_cycles(n);
+    pipe_count_cycles(n);
+    // WB would have thrown the same bubble away in each
+    if (init_MEM_WB)
+        pipe_count_bubbles(pipe_reg_MEM_WB.inst_type, n);
+}
+
 void pipe_cycle()
 {
     // print_bp_data();
@@ -1168,6 +956,7 @@ void pipe_cycle()
     // print_pipe_reg_DE_EX();
 	pipe_stage_fetch();
     cache_refresh_query_states();
+    pipe_count_cycles(1);
     // print_pipe_reg_IF_DE();
     // fp = fopen(DEBUGGING_LOG, "a");
     // fprintf(fp, "\n----- Ending cycle %d -----\n\n", stat_cycles+1);
@@ -1181,6 +970,7 @@ void pipe_stage_wb()
 
     if (MEM_halted) {
         // cache_destroy_all();
+        cache_flush_all(); // so memory is up to date once we stop
         RUN_BIT = 0; // fully stops simulator
     }
 
@@ -1198,11 +988,10 @@ void pipe_stage_wb()
     if (pipe_reg_MEM_WB.WB.SetFlags)
         set_flags(WriteData, &CURRENT_STATE);
 
-    if((pipe_reg_MEM_WB.inst_type != INST_DBUBBLE) &&
-       (pipe_reg_MEM_WB.inst_type != INST_CBUBBLE) &&
-       (pipe_reg_MEM_WB.inst_type != INST_MEMBUBBLE)) {
+    if (is_bubble(pipe_reg_MEM_WB.inst_type))
+        pipe_count_bubbles(pipe_reg_MEM_WB.inst_type, 1);
+    else
         stat_inst_retire++;
-    }
 
 }
 
@@ -1216,15 +1005,14 @@ void pipe_stage_mem()
      */
 
     int remaining_cycles;
-    static pipe_reg_EX_MEM_t before_stall_backup;
     pipe_reg_EX_MEM_t temp_backup = pipe_reg_EX_MEM;
 
     if(wait_d_cache) {
         pipe_reg_EX_MEM = before_stall_backup;
-        printf("Cycle %d: Recovering %s with addr=%lx, data=%lu\n", stat_cycles+1, (pipe_reg_EX_MEM.M.MemRead?"read":"write"), pipe_reg_EX_MEM.ALUresult, pipe_reg_EX_MEM.Read_data_2);
+        TRACE(TRACE_MEMSTALL, TRACE_LVL_VERBOSE, "Cycle %d: Recovering %s with addr=%lx, data=%lu\n", stat_cycles+1, (pipe_reg_EX_MEM.M.MemRead?"read":"write"), pipe_reg_EX_MEM.ALUresult, pipe_reg_EX_MEM.Read_data_2);
     }
 
-    if (EX_halted)
+    if (EX_halted && !wait_d_cache) // Let a load/store that missed finish first
         MEM_halted = true;
 
     if (!init_EX_MEM || MEM_halted)
@@ -1237,12 +1025,18 @@ void pipe_stage_mem()
                      pipe_reg_EX_MEM.M.MemRead, &Read_data, pipe_reg_EX_MEM.M.DataSize, &remaining_cycles);
     // start stalls here on d_cache miss, instructs the upstream stages (IF, DE, EX) to freeze and return early,
     // thus preserving the data in those stages and not moving them forward while the query is being resolved
+    pipe_note_wait(remaining_cycles);
     if (remaining_cycles > 0) {
-        if (remaining_cycles == 10) {
-            // init stall
-            printf("Init mem stall at cycle %d\n", stat_cycles+1);
-            printf("Storing %s inst with addr=%lx, data=%lu\n", (pipe_reg_EX_MEM.M.MemRead?"read":"write"), pipe_reg_EX_MEM.ALUresult, Write_data);
+        if (!wait_d_cache) {
+            // init stall; remaining_cycles is the miss (or hit) latency for a fresh request
+            // but only MSHR_FULL_RETRY if the d_cache had no MSHR to spare
+            TRACE(TRACE_MEMSTALL, TRACE_LVL_EVENT, "Init mem stall at cycle %d\n", stat_cycles+1);
+            TRACE(TRACE_MEMSTALL, TRACE_LVL_EVENT, "Storing %s inst with addr=%lx, data=%lu\n", (pipe_reg_EX_MEM.M.MemRead?"read":"write"), pipe_reg_EX_MEM.ALUresult, Write_data);
             before_stall_backup = pipe_reg_EX_MEM;
+        } else {
+            // EX ran once more in the cycle the stall began; keep the inst
+            // it handed us for when the stall is over.
+            pipe_reg_EX_MEM = temp_backup;
         }
         pipe_reg_MEM_WB.inst_type = INST_MEMBUBBLE;
         pipe_reg_MEM_WB.WB.RegWrite = false;
@@ -1270,6 +1064,53 @@ void pipe_stage_mem()
     return;
 }
 
+// What the control inst in DE/EX is to the predictors
+static bp_kind_t branch_kind()
+{
+    switch (pipe_reg_DE_EX.EX.b_type) {
+    case B:
+        return BP_DIRECT;
+    case BL:
+        return BP_CALL;
+    case BR:
+        return pipe_reg_DE_EX.Read_data_1_src == 30 ? BP_RETURN : BP_INDIRECT;
+    default:
+        return BP_CONDITIONAL;
+    }
+}
+
+bool unit_branch_taken(interface_M M, interface_EX EX, const CPU_State *state)
+{
+    if (M.ConfirmedBranch)
+        return true;
+
+    switch (EX.b_type) {
+    case CBZ:
+        return state->FLAG_Z;
+    case CBNZ:
+        return !state->FLAG_Z;
+    // don't need to consider these since they have ConfirmedBranch = true
+    // case BR:
+    // case B:
+    //     return true;
+    case BEQ:
+        return state->FLAG_Z;
+    case BNE:
+        return !state->FLAG_Z;
+    case BGT:
+        return !(state->FLAG_Z || state->FLAG_N);
+    case BLT:
+        return state->FLAG_N;
+    case BGE:
+        return !state->FLAG_N;
+    case BLE:
+        return state->FLAG_Z || state->FLAG_N;
+    default:
+        assert(0);
+    }
+    return false;
+}
+
 void pipe_stage_execute()
 {
     if (DE_halted)
@@ -1349,45 +1190,13 @@ void pipe_stage_execute()
     uint64_t new_pc = pipe_reg_DE_EX.State.PC + offset;
 
     if (pipe_reg_DE_EX.inst_type == INST_CONTROL) {
-        bool to_branch = pipe_reg_DE_EX.M.ConfirmedBranch;
-        bool is_conditional = false;
-
-        if(!to_branch) {
-            is_conditional = true;
-            switch (pipe_reg_DE_EX.EX.b_type) {
-            case CBZ:
-                to_branch = pipe_reg_DE_EX.State.FLAG_Z;
-                break;
-            case CBNZ:
-                to_branch = !pipe_reg_DE_EX.State.FLAG_Z;
-                break;
-            // don't need to consider these since they have ConfirmedBranch = true
-            // case BR:
-            // case B:
-            //     to_branch = true;
-            //     break;
-            case BEQ:
-                to_branch = pipe_reg_DE_EX.State.FLAG_Z;
-                break;
-            case BNE:
-                to_branch = !pipe_reg_DE_EX.State.FLAG_Z;
-                break;
-            case BGT:
-                to_branch = !(pipe_reg_DE_EX.State.FLAG_Z || pipe_reg_DE_EX.State.FLAG_N);
-                break;
-            case BLT:
-                to_branch = pipe_reg_DE_EX.State.FLAG_N;
-                break;
-            case BGE:
-                to_branch = !pipe_reg_DE_EX.State.FLAG_N;
-                break;
-            case BLE:
-                to_branch = pipe_reg_DE_EX.State.FLAG_Z || pipe_reg_DE_EX.State.FLAG_N;
-                break;
-            default:
-                assert(0);
-            }
-        }
+        bool to_branch = unit_branch_taken(pipe_reg_DE_EX.M, pipe_reg_DE_EX.EX, &pipe_reg_DE_EX.State);
+        bp_kind_t kind = branch_kind();
+
+        if (pipe_reg_DE_EX.EX.b_type == BR)
+            new_pc = reg_1_val; // Forwarded like any other operand
+        else if (pipe_reg_DE_EX.EX.b_type == BL)
+            ALU_result = pipe_reg_DE_EX.State.PC + 4; // For X30
 
         pipe_reg_IF_DE.to_squash = true;
 
@@ -1399,11 +1208,16 @@ void pipe_stage_execute()
         // We make a backup of the CURRENT_STATE.PC, which has been frozen since
         // the inst miss happened,
 
-        if (to_branch == pipe_reg_DE_EX.predicted_taken) {
+        // A taken branch was only predicted right if it went where we
+        // predicted: BR's target can differ from one time to the next
+        bool mispredicted = to_branch != pipe_reg_DE_EX.predicted_taken ||
+                            (to_branch && pipe_reg_DE_EX.predicted_pc != new_pc);
+
+        if (!mispredicted) {
             control_stalled = false;
             pipe_reg_IF_DE.to_squash = false;
         }
-        else if (to_branch && (!pipe_reg_DE_EX.predicted_taken)) { // "False negative"
+        else if (to_branch) { // "False negative", or taken to the wrong place
                 CURRENT_STATE.PC = new_pc;
                 flush_pipeline();
         }
@@ -1419,17 +1233,25 @@ void pipe_stage_execute()
             }
         }
 
-        bp_update(is_conditional, to_branch, pipe_reg_DE_EX.State.PC, new_pc);
+        stat_branches[kind]++;
+        if (pipe_reg_DE_EX.bp_ckpt.btb_hit)
+            stat_branch_btb_hits[kind]++;
+        if (mispredicted) {
+            stat_mispredict++;
+            stat_branch_mispredicts[kind]++;
+            // Undo what the inst fetched after this one did to the RAS
+            bp_repair(&pipe_reg_DE_EX.bp_ckpt, kind, pipe_reg_DE_EX.State.PC);
+        }
+        bp_update(kind, to_branch, pipe_reg_DE_EX.State.PC, new_pc);
 
         // this is to handle canceling the pending miss in i_cache if it turns out that the pending inst is
         // not the actual target of a branch inst that was fetched earlier. here, frozen_pc is the PC that was
         // predicted after the branch inst was fetched, and we compare it to the "real" branch target that was
         // resolved in this stage and put into CURRENT_STATE.PC
-        uint64_t mask = (uint64_t)-1 << LOG_BLOCK_SIZE;
-        if (wait_i_cache && ((frozen_pc & mask) != (CURRENT_STATE.PC & mask))) {
+        if (wait_i_cache && (cache_block_addr(i_cache, frozen_pc) != cache_block_addr(i_cache, CURRENT_STATE.PC))) {
             wait_i_cache = false;
             cache_cancel(i_cache, frozen_pc);
-            printf("cancelling\n");
+            TRACE(TRACE_BP, TRACE_LVL_EVENT, "cancelling\n");
         }
     }
 
@@ -1445,6 +1267,44 @@ void pipe_stage_execute()
     pipe_reg_EX_MEM.Instruction_4_0 = pipe_reg_DE_EX.Instruction_4_0;
 }
 
+// Returns the decoded form of inst at pc, decoding it into the cache on a
+// miss, or NULL if inst has to go through unit_control every time.
+static const predecoded_t *predecode(uint64_t pc, instruction_t inst)
+{
+    predecoded_t *d = &predecode_cache[(pc >> 2) & (PREDECODE_ENTRIES - 1)];
+
+    if (d->valid && d->pc == pc && d->inst == inst)
+        return d;
+
+    // HLT acts on the fetch stage, so unit_control has to see it every time
+    if (decode_lookup(inst)->tmpl == DEC_HLT)
+        return NULL;
+
+    uint64_t inst_Reg2Loc;
+    uint64_t inst_31_0;
+    uint64_t inst_31_21;
+    uint64_t inst_4_0;
+    uint64_t inst_20_16;
+    uint64_t inst_9_5;
+    unit_inst_split(inst, &inst_Reg2Loc, &inst_31_0, &inst_31_21, &inst_4_0, &inst_20_16, &inst_9_5);
+
+    memset(d, 0, sizeof(*d));
+    bool control_stall_before = init_control_stall;
+    init_control_stall = false;
+    unit_control(inst, &d->WB, &d->M, &d->EX, &d->frag, &d->layout, &d->type);
+    d->starts_control_stall = init_control_stall;
+    init_control_stall = control_stall_before;
+
+    d->read_reg_1 = inst_9_5;
+    d->read_reg_2 = inst_Reg2Loc ? inst_4_0 : inst_20_16;
+    d->inst_31_21 = inst_31_21;
+    d->inst_4_0 = d->type == INST_CONTROL && d->EX.b_type == BL ? 30 : inst_4_0; // BL's Rd is X30
+    d->pc = pc;
+    d->inst = inst;
+    d->valid = true;
+    return d;
+}
+
 void pipe_stage_decode()
 {
     if (!init_IF_DE || DE_halted || wait_d_cache) {
@@ -1461,18 +1321,23 @@ void pipe_stage_decode()
     // This is because it's still a useful future inst, just stalled.
     if (pipe_reg_IF_DE.to_squash || pipe_reg_IF_DE.to_flush) {
         //assert(!pipe_reg_IF_DE.to_mem_stall); // Can't possibly happen at the same time
+        // A control stall leaves the last inst here, which we already took
+        if (!pipe_reg_IF_DE.to_mem_stall && decode_seen_fetch != stat_inst_fetch)
+            stat_squash++;
+        decode_seen_fetch = stat_inst_fetch;
         create_c_bubble();
         return;
     }
-    else if (pipe_reg_IF_DE.to_mem_stall) {
-        //assert(!pipe_reg_IF_DE.to_squash); // Can't possibly happen at the same time
-        create_mem_bubble();
-        return;
-    }
     else if (data_stalled) {
         // The DE/EX interface has valid content, just stalled.
         // We don't mess with it and just allow it to be picked up
-        // in a later cycle.
+        // in a later cycle. This goes before the i_cache check below,
+        // as a mem bubble would overwrite the stalled inst.
+        return;
+    }
+    else if (pipe_reg_IF_DE.to_mem_stall) {
+        //assert(!pipe_reg_IF_DE.to_squash); // Can't possibly happen at the same time
+        create_mem_bubble();
         return;
     }
 
@@ -1481,56 +1346,84 @@ void pipe_stage_decode()
         return;
     }
 
+    decode_seen_fetch = stat_inst_fetch;
     instruction_t raw_inst = pipe_reg_IF_DE.Instruction_full;
-
-    uint64_t inst_Reg2Loc;
-    uint64_t inst_31_0;
-    uint64_t inst_31_21;
-    uint64_t inst_4_0;
-    uint64_t inst_20_16;
-    uint64_t inst_9_5;
-    unit_inst_split(raw_inst, &inst_Reg2Loc, &inst_31_0, &inst_31_21, &inst_4_0, &inst_20_16, &inst_9_5);
-    pipe_reg_DE_EX.Instruction_31_21 = inst_31_21;
-    uint32_t Instruction_4_0; // Possibly specifies the register to wb to
-
-    uint64_t read_reg_1, read_reg_2;
-    unit_mux_64(inst_4_0, inst_20_16, inst_Reg2Loc, &read_reg_2);
-
-    uint64_t read_data_1, read_data_2;
-
-    unit_control(
-        raw_inst,
-        pipe_reg_IF_DE.State,
-        &pipe_reg_DE_EX.WB,
-        &pipe_reg_DE_EX.M,
-        &pipe_reg_DE_EX.EX,
-        &pipe_reg_DE_EX.Sign_extended_frag,
-        &pipe_reg_DE_EX.inst_layout,
-        &pipe_reg_DE_EX.inst_type
-    );
-
-    read_reg_1 = inst_9_5; // may be a register or just garbage
-    read_reg_2 = read_reg_2; // this too
-
-    unit_Registers(
-        read_reg_1,
-        read_reg_2,
-        &pipe_reg_DE_EX.Read_data_1,
-        &pipe_reg_DE_EX.Read_data_2,
-        &pipe_reg_DE_EX.Read_data_1_src,
-        &pipe_reg_DE_EX.Read_data_2_src
-    );
-
+    const predecoded_t *d = predecode(pipe_reg_IF_DE.State.PC, raw_inst);
+
+    if (d != NULL) {
+        pipe_reg_DE_EX.WB = d->WB;
+        pipe_reg_DE_EX.M = d->M;
+        pipe_reg_DE_EX.EX = d->EX;
+        pipe_reg_DE_EX.Sign_extended_frag = d->frag;
+        pipe_reg_DE_EX.inst_layout = d->layout;
+        pipe_reg_DE_EX.inst_type = d->type;
+        if (d->starts_control_stall)
+            init_control_stall = true;
+
+        unit_Registers(
+            d->read_reg_1,
+            d->read_reg_2,
+            &pipe_reg_DE_EX.Read_data_1,
+            &pipe_reg_DE_EX.Read_data_2,
+            &pipe_reg_DE_EX.Read_data_1_src,
+            &pipe_reg_DE_EX.Read_data_2_src
+        );
+        pipe_reg_DE_EX.Instruction_31_21 = d->inst_31_21;
+        pipe_reg_DE_EX.Instruction_4_0 = d->inst_4_0;
+    } else {
+        uint64_t inst_Reg2Loc;
+        uint64_t inst_31_0;
+        uint64_t inst_31_21;
+        uint64_t inst_4_0;
+        uint64_t inst_20_16;
+        uint64_t inst_9_5;
+        unit_inst_split(raw_inst, &inst_Reg2Loc, &inst_31_0, &inst_31_21, &inst_4_0, &inst_20_16, &inst_9_5);
+
+        uint64_t read_reg_1, read_reg_2;
+        unit_mux_64(inst_4_0, inst_20_16, inst_Reg2Loc, &read_reg_2);
+
+        unit_control(
+            raw_inst,
+            &pipe_reg_DE_EX.WB,
+            &pipe_reg_DE_EX.M,
+            &pipe_reg_DE_EX.EX,
+            &pipe_reg_DE_EX.Sign_extended_frag,
+            &pipe_reg_DE_EX.inst_layout,
+            &pipe_reg_DE_EX.inst_type
+        );
+
+        read_reg_1 = inst_9_5; // may be a register or just garbage
+
+        unit_Registers(
+            read_reg_1,
+            read_reg_2,
+            &pipe_reg_DE_EX.Read_data_1,
+            &pipe_reg_DE_EX.Read_data_2,
+            &pipe_reg_DE_EX.Read_data_1_src,
+            &pipe_reg_DE_EX.Read_data_2_src
+        );
+        pipe_reg_DE_EX.Instruction_31_21 = inst_31_21;
+        pipe_reg_DE_EX.Instruction_4_0 = inst_4_0;
+    }
 
     init_DE_EX = true;
     pipe_reg_DE_EX.State = pipe_reg_IF_DE.State;
     // pipe_reg_DE_EX.Read_data_1 has been updated
     // pipe_reg_DE_EX.Read_data_2 has been updated
-    pipe_reg_DE_EX.Instruction_31_21 = inst_31_21;
-    pipe_reg_DE_EX.Instruction_4_0 = inst_4_0;
 
     pipe_reg_DE_EX.predicted_taken = pipe_reg_IF_DE.predicted_taken;
     pipe_reg_DE_EX.predicted_pc = pipe_reg_IF_DE.predicted_pc;
+    pipe_reg_DE_EX.bp_ckpt = pipe_reg_IF_DE.bp_ckpt;
+
+    // A partial BTB tag can match an inst that isn't a branch at all. Only
+    // branches stall fetch, so it hasn't gone past the predicted target
+    // yet: send it to the next inst instead, and undo any RAS move.
+    if (pipe_reg_DE_EX.inst_type != INST_CONTROL && pipe_reg_DE_EX.predicted_taken) {
+        CURRENT_STATE.PC = pipe_reg_DE_EX.State.PC + 4;
+        pipe_reg_DE_EX.predicted_taken = false;
+        pipe_reg_DE_EX.predicted_pc = CURRENT_STATE.PC;
+        bp_repair(&pipe_reg_DE_EX.bp_ckpt, BP_DIRECT, pipe_reg_DE_EX.State.PC); // Just the undo
+    }
 
     if (FE_halted) // This should come *before* the check for DE_halted
         DE_halted = true;
@@ -1546,19 +1439,26 @@ void pipe_stage_fetch()
     // As in pipe_stage_decode, this order of checking insts matters.
     if (control_stalled) {
         pipe_reg_IF_DE.to_squash = true; // As fetch is not control_stalled,
-        printf("Control stalled at cycle %d, current PC=%lx\n", stat_cycles+1, CURRENT_STATE.PC);
+        TRACE(TRACE_FETCH, TRACE_LVL_EVENT, "Control stalled at cycle %d, current PC=%lx\n", stat_cycles+1, CURRENT_STATE.PC);
         return;//because its fetched inst will be used or squashed the next cycle
     }
     else if (data_stalled) {
         return;
     }
-    printf("Not control stalled at cycle %d, current PC=%lx\n", stat_cycles+1, CURRENT_STATE.PC);
+    TRACE(TRACE_FETCH, TRACE_LVL_VERBOSE, "Not control stalled at cycle %d, current PC=%lx\n", stat_cycles+1, CURRENT_STATE.PC);
 
     if (init_control_stall) {
         init_control_stall = false;
         control_stalled = true;
     }
 
+    if (fetch_stopped) {
+        // Decode has already taken what we fetched last; give it bubbles
+        // from now on so the pipeline drains.
+        pipe_reg_IF_DE.to_mem_stall = true;
+        return;
+    }
+
     pipe_reg_IF_DE.Instruction_full = fetch(CURRENT_STATE.PC);
     if (wait_i_cache) {
         // init stall, need to create bubble
@@ -1567,6 +1467,7 @@ void pipe_stage_fetch()
     }
 
     init_IF_DE = true;
+    stat_inst_fetch++;
 
     pipe_reg_IF_DE.State = CURRENT_STATE;
     pipe_reg_IF_DE.to_squash = false;
@@ -1574,7 +1475,8 @@ void pipe_stage_fetch()
     pipe_reg_IF_DE.to_mem_stall = false;
 
     // update PC to prediction
-    bp_predict(CURRENT_STATE.PC, &pipe_reg_IF_DE.predicted_pc, &pipe_reg_IF_DE.predicted_taken);
+    bp_predict(CURRENT_STATE.PC, &pipe_reg_IF_DE.predicted_pc, &pipe_reg_IF_DE.predicted_taken,
+               &pipe_reg_IF_DE.bp_ckpt);
     CURRENT_STATE.PC = pipe_reg_IF_DE.predicted_pc;
-    printf("updated PC=%lx\n", CURRENT_STATE.PC);
+    TRACE(TRACE_FETCH, TRACE_LVL_VERBOSE, "updated PC=%lx\n", CURRENT_STATE.PC);
 }
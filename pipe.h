@@ -2,9 +2,11 @@
 #define _PIPE_H_
 
 #include "shell.h"
+#include "bp.h"
 #include "stdbool.h"
 #include <stddef.h>
 #include <limits.h>
+#include <stdio.h>
 
 
 typedef struct CPU_State {
@@ -22,6 +24,10 @@ extern int RUN_BIT;
 extern bool wait_i_cache;
 extern bool wait_d_cache;
 
+// While set, fetch brings in nothing and the instructions already in the
+// pipeline run to completion
+extern bool fetch_stopped;
+
 /* global variable -- pipeline state */
 extern CPU_State CURRENT_STATE;
 
@@ -76,6 +82,7 @@ typedef enum {
     CBNZ,
     BR,
     B,
+    BL,
     BEQ,
     BNE,
     BGT,
@@ -114,6 +121,7 @@ typedef struct {
     bool to_mem_stall;
     bool predicted_taken;
     uint64_t predicted_pc;
+    bp_ckpt_t bp_ckpt;
 } pipe_reg_IF_DE_t;
 extern pipe_reg_IF_DE_t pipe_reg_IF_DE;
 
@@ -136,6 +144,7 @@ typedef struct {
     uint32_t Instruction_4_0; // Possibly specifies the register to wb to
     bool predicted_taken;
     uint64_t predicted_pc;
+    bp_ckpt_t bp_ckpt;
 } pipe_reg_DE_EX_t;
 extern pipe_reg_DE_EX_t pipe_reg_DE_EX;
 
@@ -178,42 +187,38 @@ int64_t sign_extend_64(uint32_t data, size_t begin, size_t end);
 
 void unit_control_hazard_stall(instruction_t *inst);
 
-void unit_control_r_format(
-    interface_WB *WB,
-    interface_M *M,
-    interface_EX *EX,
-    instruction_layout_t *layout
-);
-
-void unit_control_i_format(
-    instruction_t inst,
-    interface_WB *WB,
-    interface_M *M,
-    interface_EX *EX,
-    int64_t *frag,
-    instruction_layout_t *layout
-);
-
-void unit_control_d_format(
-    instruction_t inst,
-    interface_WB *WB,
-    interface_M *M,
-    interface_EX *EX,
-    int64_t *frag,
-    instruction_layout_t *layout
-);
-
 void unit_control_nop(); // Will be used for both HLT and for the forwarding unit
 // so we just make it use global vars instead of passing things to it.
 
 void unit_ALU(mop_operate_type_t op_type, uint64_t operand1, uint64_t operand2, uint64_t* ALU_result, bool* is_zero);
 
+// Whether a control inst with these signals branches, given the flags in state
+bool unit_branch_taken(interface_M M, interface_EX EX, const CPU_State *state);
+
 /* called during simulator startup */
 void pipe_init();
 
+// True once no instruction is left in flight and nothing is stalled,
+// i.e. CURRENT_STATE is exactly the state before CURRENT_STATE.PC
+bool pipe_empty();
+
+// Write or read the pipeline's part of a checkpoint (see checkpoint.h)
+bool pipe_save(FILE *fp);
+bool pipe_load(FILE *fp);
+
 /* this function calls the others */
 void pipe_cycle();
 
+// Runs a cycle like pipe_cycle and returns how many of the cycles after it
+// are certain to change nothing but the countdown of outstanding misses
+// (see cache_quiet_cycles); 0 if that can't be told. The caller may skip
+// them with pipe_skip_cycles.
+int pipe_cycle_quiet();
+
+// Skips n such cycles: counts the misses down and adds the cycles to the
+// statistics as if they had run
+void pipe_skip_cycles(int n);
+
 // CONVENTION: we don't make the component blocks return;
 // rather, they should accept pointers and are responsible
 // for writing values themselves.
@@ -229,7 +234,6 @@ void unit_Registers(
 
 void unit_control(
     uint32_t inst,
-    CPU_State state,
     interface_WB *WB,
     interface_M *M,
     interface_EX *EX,
@@ -0,0 +1,265 @@
+#include "repl.h"
+#include "checkpoint.h"
+#include <stdio.h>
+#include <string.h>
+
+// We use a 64-bit timestamp for each cache line, together with a global 64-bit
+// timestamp_counter, to keep track of which line is recently used.
+// The global counter is initialized to 0, and every time *any* line is used,
+// the counter is bumped up by 1, representing a uni-direction flow of time.
+// The line's timestamp is then set to the new value of the global counter.
+// Now whenever we need to evict a line, we search and find the one with
+// the oldest timestamp. This new line is now the most-recently used,
+// so its timestamp is also updated to the global timestamp++
+// 64 bits is large enough regarding concerns of overflow--on a machine that
+// reads into the cache 10^12 times a second, it takes a few hundred years
+// to hit an overflow, and it's only a problem if some other cache line sits
+// there neither used nor evicted over the hundreds of years.
+static uint64_t timestamp_counter = 0;
+
+bool repl_save(FILE *fp)
+{
+    return ckpt_write(fp, &timestamp_counter, sizeof(timestamp_counter));
+}
+
+bool repl_load(FILE *fp)
+{
+    return ckpt_read(fp, &timestamp_counter, sizeof(timestamp_counter));
+}
+
+static inline uint64_t way_mask(int ways)
+{
+    return ways >= 64 ? ~0ull : ((1ull << ways) - 1);
+}
+
+static inline uint64_t xorshift64(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+
+/*
+ * Exact LRU: words_per_set is really one timestamp per way.
+ */
+static int lru_words(int ways)
+{
+    return ways;
+}
+
+static int lru_victim(repl_t *r, int set)
+{
+    uint64_t *stamps = &r->bits[(size_t)set * r->ways];
+    int lru_way = 0;
+
+    for (int i = 1; i < r->ways; i++) {
+        if (stamps[lru_way] > stamps[i])
+            lru_way = i;
+    }
+    return lru_way;
+}
+
+static void lru_touch(repl_t *r, int set, int way)
+{
+    r->bits[(size_t)set * r->ways + way] = ++timestamp_counter;
+}
+
+
+/*
+ * Tree-PLRU: node i of a binary tree over the ways is bit i of the set's
+ * word, with the root at bit 1 and the children of node i at 2i and 2i+1.
+ * A node's bit points to the half to evict from next (0 = left), so the
+ * victim is found by walking down from the root and a touch walks up from
+ * the leaf pointing every node on the way away from it.
+ */
+static int one_word(int ways)
+{
+    (void)ways;
+    return 1;
+}
+
+static int tree_plru_victim(repl_t *r, int set)
+{
+    uint64_t bits = r->bits[set];
+    int node = 1;
+
+    while (node < r->ways)
+        node = 2 * node + (int)((bits >> node) & 1);
+    return node - r->ways;
+}
+
+static void tree_plru_touch(repl_t *r, int set, int way)
+{
+    uint64_t bits = r->bits[set];
+    int node = way + r->ways;
+
+    while (node > 1) {
+        int parent = node >> 1;
+        if (node & 1) // we are the right child, so point left
+            bits &= ~(1ull << parent);
+        else
+            bits |= 1ull << parent;
+        node = parent;
+    }
+    r->bits[set] = bits;
+}
+
+
+/*
+ * Bit-PLRU: a way's bit is set when it is used. Once every bit would be
+ * set, all but the one just used are cleared. The victim is the first way
+ * whose bit is clear.
+ */
+static int bit_plru_victim(repl_t *r, int set)
+{
+    uint64_t clear = ~r->bits[set] & way_mask(r->ways);
+    return clear ? __builtin_ctzll(clear) : 0;
+}
+
+static void bit_plru_touch(repl_t *r, int set, int way)
+{
+    uint64_t bits = r->bits[set] | (1ull << way);
+
+    if (bits == way_mask(r->ways))
+        bits = 1ull << way;
+    r->bits[set] = bits;
+}
+
+
+/*
+ * SRRIP/BRRIP: each way has a 2-bit re-reference prediction value (RRPV),
+ * kept as two bit planes so a whole set is aged with a couple of logic ops:
+ * word 0 of the set holds the low bits and word 1 the high bits. The victim
+ * is the first way predicted "distant" (RRPV 3); if there is none, every
+ * way is aged until there is. A hit predicts "near" (RRPV 0).
+ */
+#define RRPV_LONG 2
+#define RRPV_DISTANT 3
+#define BRRIP_LONG_ONE_IN 32 // How often BRRIP inserts at RRPV_LONG
+
+static int rrip_words(int ways)
+{
+    (void)ways;
+    return 2;
+}
+
+static void rrip_set(repl_t *r, int set, int way, int rrpv)
+{
+    uint64_t *planes = &r->bits[2 * (size_t)set];
+    uint64_t bit = 1ull << way;
+
+    planes[0] = (rrpv & 1) ? planes[0] | bit : planes[0] & ~bit;
+    planes[1] = (rrpv & 2) ? planes[1] | bit : planes[1] & ~bit;
+}
+
+static int rrip_victim(repl_t *r, int set)
+{
+    uint64_t *planes = &r->bits[2 * (size_t)set];
+    uint64_t mask = way_mask(r->ways);
+    uint64_t distant;
+
+    while ((distant = planes[0] & planes[1] & mask) == 0) {
+        // No way is at 3, so adding 1 to each can't overflow:
+        // 0 -> 1, 1 -> 2, 2 -> 3
+        planes[1] |= planes[0];
+        planes[0] = ~planes[0] & mask;
+    }
+    return __builtin_ctzll(distant);
+}
+
+static void rrip_touch(repl_t *r, int set, int way)
+{
+    rrip_set(r, set, way, 0);
+}
+
+static void srrip_insert(repl_t *r, int set, int way)
+{
+    rrip_set(r, set, way, RRPV_LONG);
+}
+
+static void brrip_insert(repl_t *r, int set, int way)
+{
+    bool is_long = xorshift64(&r->rng) % BRRIP_LONG_ONE_IN == 0;
+    rrip_set(r, set, way, is_long ? RRPV_LONG : RRPV_DISTANT);
+}
+
+
+/*
+ * Random: no state besides the generator.
+ */
+static int no_words(int ways)
+{
+    (void)ways;
+    return 0;
+}
+
+static int random_victim(repl_t *r, int set)
+{
+    (void)set;
+    return (int)(xorshift64(&r->rng) % (uint64_t)r->ways);
+}
+
+static void nothing(repl_t *r, int set, int way)
+{
+    (void)r;
+    (void)set;
+    (void)way;
+}
+
+
+static const repl_ops_t repl_ops[REPL_NUM_POLICIES] = {
+    [REPL_LRU]       = { "lru",    lru_words,   lru_victim,       lru_touch,       lru_touch },
+    [REPL_TREE_PLRU] = { "plru",   one_word,    tree_plru_victim, tree_plru_touch, tree_plru_touch },
+    [REPL_BIT_PLRU]  = { "bitplru", one_word,   bit_plru_victim,  bit_plru_touch,  bit_plru_touch },
+    [REPL_SRRIP]     = { "srrip",  rrip_words,  rrip_victim,      rrip_touch,      srrip_insert },
+    [REPL_BRRIP]     = { "brrip",  rrip_words,  rrip_victim,      rrip_touch,      brrip_insert },
+    [REPL_RANDOM]    = { "random", no_words,    random_victim,    nothing,         nothing },
+};
+
+bool repl_parse(const char *name, repl_policy_t *policy)
+{
+    for (int i = 0; i < REPL_NUM_POLICIES; i++) {
+        if (strcmp(name, repl_ops[i].name) == 0) {
+            *policy = (repl_policy_t)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *repl_name(repl_policy_t policy)
+{
+    return repl_ops[policy].name;
+}
+
+bool repl_check_ways(repl_policy_t policy, int ways)
+{
+    if (policy == REPL_LRU || policy == REPL_RANDOM)
+        return true;
+    if (ways > REPL_MAX_PACKED_WAYS) {
+        printf("Error: %s supports at most %d ways\n", repl_name(policy), REPL_MAX_PACKED_WAYS);
+        return false;
+    }
+    if (policy == REPL_TREE_PLRU && (ways & (ways - 1)) != 0) {
+        printf("Error: plru needs a power-of-2 number of ways\n");
+        return false;
+    }
+    return true;
+}
+
+size_t repl_state_size(repl_policy_t policy, int sets, int ways)
+{
+    return (size_t)sets * repl_ops[policy].words_per_set(ways) * sizeof(uint64_t);
+}
+
+void repl_init(repl_t *r, repl_policy_t policy, int ways, void *state)
+{
+    r->ops = &repl_ops[policy];
+    r->ways = ways;
+    r->words_per_set = r->ops->words_per_set(ways);
+    r->bits = (uint64_t*)state;
+    r->rng = 0x2545F4914F6CDD1Dull; // Any nonzero seed; fixed so runs repeat
+}
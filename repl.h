@@ -0,0 +1,80 @@
+#ifndef _REPL_H_
+#define _REPL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Replacement policies a cache can be built with (see cache_config_t).
+typedef enum {
+    REPL_LRU,       // Exact LRU from a 64-bit timestamp per line
+    REPL_TREE_PLRU, // Binary tree of ways-1 bits per set; ways must be a power of 2
+    REPL_BIT_PLRU,  // One MRU bit per way
+    REPL_SRRIP,     // 2-bit re-reference prediction per way, insert at "long"
+    REPL_BRRIP,     // As SRRIP, but mostly inserts at "distant"
+    REPL_RANDOM,
+    REPL_NUM_POLICIES
+} repl_policy_t;
+
+// The state of every policy except LRU is a few bits per set, packed into
+// words_per_set 64-bit words, so it is limited to REPL_MAX_PACKED_WAYS ways.
+#define REPL_MAX_PACKED_WAYS 64
+
+typedef struct repl_ops repl_ops_t;
+
+// Replacement state of one cache. It lives in the cache_t storage block;
+// repl_state_size tells cache_new how much to set aside.
+typedef struct {
+    const repl_ops_t *ops;
+    int ways;
+    int words_per_set;
+    uint64_t *bits;   // Per-set state; LRU keeps one timestamp per line here
+    uint64_t rng;     // For REPL_RANDOM and the BRRIP coin flip
+} repl_t;
+
+// A policy is three hooks. victim picks the way to evict from a set whose
+// ways are all valid; touch is called on a hit and insert when a line is
+// filled, both with the line's way.
+struct repl_ops {
+    const char *name;
+    int (*words_per_set)(int ways);
+    int (*victim)(repl_t *r, int set);
+    void (*touch)(repl_t *r, int set, int way);
+    void (*insert)(repl_t *r, int set, int way);
+};
+
+// Looks a policy up by the name used in cache settings (e.g. "plru");
+// returns false if there is none.
+bool repl_parse(const char *name, repl_policy_t *policy);
+const char *repl_name(repl_policy_t policy);
+
+// Prints the problem and returns false if the policy can't handle ways.
+bool repl_check_ways(repl_policy_t policy, int ways);
+
+size_t repl_state_size(repl_policy_t policy, int sets, int ways);
+
+// state must be repl_state_size bytes, zeroed and 8-byte aligned
+void repl_init(repl_t *r, repl_policy_t policy, int ways, void *state);
+
+// Write or read the state shared by all caches (LRU's clock) as part of a
+// checkpoint; each repl_t is saved with its cache
+bool repl_save(FILE *fp);
+bool repl_load(FILE *fp);
+
+static inline int repl_victim(repl_t *r, int set)
+{
+    return r->ops->victim(r, set);
+}
+
+static inline void repl_touch(repl_t *r, int set, int way)
+{
+    r->ops->touch(r, set, way);
+}
+
+static inline void repl_insert(repl_t *r, int set, int way)
+{
+    r->ops->insert(r, set, way);
+}
+
+#endif
@@ -4,93 +4,278 @@
 #include <string.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 #include "shell.h"
 #include "pipe.h"
+#include "cache.h"
+#include "bp.h"
+#include "trace.h"
+#include "func.h"
+#include "checkpoint.h"
+#include "stats.h"
 
 /***************************************************************/
 /* Statistics.                                                 */
 /***************************************************************/
 
 uint32_t stat_cycles = 0, stat_inst_retire = 0, stat_inst_fetch = 0;
-uint32_t stat_squash = 0;
+uint32_t stat_squash = 0, stat_mispredict = 0;
+uint64_t stat_inst_fastforward = 0;
+
+/***************************************************************/
+/* Run control.                                                */
+/***************************************************************/
+
+/* --batch: no prompt, banners or dumpsim file */
+static bool batch_mode = false;
+
+/* --max-cycles: go and run stop when the clock gets here */
+static uint32_t max_cycles = UINT32_MAX;
+
+/* --stats-interval: a row of statistics every stats_every cycles, the
+   next one at stats_next; 0 for none */
+static uint32_t stats_every = 0, stats_next = 0;
 
 /***************************************************************/
 /* Main memory.                                                */
 /***************************************************************/
 
-#define MEM_DATA_START  0x10000000
-#define MEM_DATA_SIZE   0x00100000
 #define MEM_TEXT_START  0x00400000
-#define MEM_TEXT_SIZE   0x00100000
-#define MEM_STACK_START 0xfffffffc
-#define MEM_STACK_SIZE  0x00100000
+
+/* Memory is sparse and covers the whole 64-bit address space. It is kept
+ * in 4 KB pages found through two levels: the address bits above a page
+ * table's reach pick a table from a small hash directory, and the next
+ * MEM_TABLE_BITS bits pick the page within it. Pages are allocated when
+ * first written; reading one that never was gives zeroes. */
+#define MEM_PAGE_BITS   12
+#define MEM_PAGE_SIZE   (1 << MEM_PAGE_BITS)
+#define MEM_TABLE_BITS  10
+#define MEM_TABLE_SIZE  (1 << MEM_TABLE_BITS)
+#define MEM_DIR_MIN     16
+
+/* Words are copied straight between pages and host integers */
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "main memory assumes a little-endian host"
+#endif
 
 typedef struct {
-    uint64_t start, size;
-    uint8_t *mem;
-} mem_region_t;
+    uint64_t tag; /* address >> (MEM_PAGE_BITS + MEM_TABLE_BITS) */
+    uint8_t *pages[MEM_TABLE_SIZE];
+} mem_table_t;
+
+/* open-addressed, at most half full */
+static mem_table_t **mem_dir = NULL;
+static size_t mem_dir_size = 0, mem_dir_used = 0;
+
+/* last table looked up; most accesses hit the same one */
+static mem_table_t *mem_last_table = NULL;
+
+void init_memory();
+
+static inline size_t mem_dir_slot(uint64_t tag, size_t size)
+{
+    return (size_t)((tag * 0x9E3779B97F4A7C15ull) >> 32) & (size - 1);
+}
+
+static void mem_dir_insert(mem_table_t *table)
+{
+    size_t i = mem_dir_slot(table->tag, mem_dir_size);
+    while (mem_dir[i] != NULL)
+        i = (i + 1) & (mem_dir_size - 1);
+    mem_dir[i] = table;
+}
+
+static void mem_dir_grow()
+{
+    mem_table_t **old = mem_dir;
+    size_t old_size = mem_dir_size;
+    size_t i;
+
+    mem_dir_size = old_size ? 2 * old_size : MEM_DIR_MIN;
+    mem_dir = calloc(mem_dir_size, sizeof(mem_table_t*));
+    assert(mem_dir != NULL);
+    for (i = 0; i < old_size; i++)
+        if (old[i] != NULL)
+            mem_dir_insert(old[i]);
+    free(old);
+}
+
+static mem_table_t *mem_find_table(uint64_t tag, bool create)
+{
+    mem_table_t *table;
+    size_t i;
+
+    if (mem_last_table != NULL && mem_last_table->tag == tag)
+        return mem_last_table;
+
+    if (mem_dir_size > 0) {
+        for (i = mem_dir_slot(tag, mem_dir_size); mem_dir[i] != NULL;
+                i = (i + 1) & (mem_dir_size - 1)) {
+            if (mem_dir[i]->tag == tag)
+                return mem_last_table = mem_dir[i];
+        }
+    }
+    if (!create)
+        return NULL;
 
-/* memory will be dynamically allocated at initialization */
-mem_region_t MEM_REGIONS[] = {
-    { MEM_TEXT_START, MEM_TEXT_SIZE, NULL },
-    { MEM_DATA_START, MEM_DATA_SIZE, NULL },
-    { MEM_STACK_START, MEM_STACK_SIZE, NULL },
-};
-#define MEM_NREGIONS (sizeof(MEM_REGIONS)/sizeof(mem_region_t))
+    if (2 * (mem_dir_used + 1) > mem_dir_size)
+        mem_dir_grow();
+    table = calloc(1, sizeof(mem_table_t));
+    assert(table != NULL);
+    table->tag = tag;
+    mem_dir_insert(table);
+    mem_dir_used++;
+    return mem_last_table = table;
+}
 
+/* Returns the page holding address, or NULL if it was never written and
+ * create is false */
+static uint8_t *mem_page(uint64_t address, bool create)
+{
+    uint64_t page = address >> MEM_PAGE_BITS;
+    mem_table_t *table = mem_find_table(page >> MEM_TABLE_BITS, create);
+    uint8_t **slot;
 
+    if (table == NULL)
+        return NULL;
+    slot = &table->pages[page & (MEM_TABLE_SIZE - 1)];
+    if (*slot == NULL && create) {
+        *slot = calloc(1, MEM_PAGE_SIZE);
+        assert(*slot != NULL);
+    }
+    return *slot;
+}
 
 /***************************************************************/
 /*                                                             */
-/* Procedure: mem_read_32                                      */
+/* Procedures: mem_read_block, mem_write_block                 */
 /*                                                             */
-/* Purpose: Read a 32-bit word from memory                     */
+/* Purpose: Copy size bytes between memory and buf, one memcpy */
+/*          per page touched                                   */
 /*                                                             */
 /***************************************************************/
-uint32_t mem_read_32(uint64_t address)
+void mem_read_block(uint64_t address, void *buf, size_t size)
 {
-    int i;
-    for (i = 0; i < MEM_NREGIONS; i++) {
-        if (address >= MEM_REGIONS[i].start &&
-                address < (MEM_REGIONS[i].start + MEM_REGIONS[i].size)) {
-            uint32_t offset = address - MEM_REGIONS[i].start;
-
-            return
-                (MEM_REGIONS[i].mem[offset+3] << 24) |
-                (MEM_REGIONS[i].mem[offset+2] << 16) |
-                (MEM_REGIONS[i].mem[offset+1] <<  8) |
-                (MEM_REGIONS[i].mem[offset+0] <<  0);
-        }
+    uint8_t *dst = buf;
+
+    while (size > 0) {
+        size_t offset = address & (MEM_PAGE_SIZE - 1);
+        size_t n = MEM_PAGE_SIZE - offset < size ? MEM_PAGE_SIZE - offset : size;
+        uint8_t *page = mem_page(address, false);
+
+        if (page != NULL)
+            memcpy(dst, page + offset, n);
+        else
+            memset(dst, 0, n);
+        address += n;
+        dst += n;
+        size -= n;
     }
+}
 
-    return 0;
+void mem_write_block(uint64_t address, const void *buf, size_t size)
+{
+    const uint8_t *src = buf;
+
+    while (size > 0) {
+        size_t offset = address & (MEM_PAGE_SIZE - 1);
+        size_t n = MEM_PAGE_SIZE - offset < size ? MEM_PAGE_SIZE - offset : size;
+
+        memcpy(mem_page(address, true) + offset, src, n);
+        address += n;
+        src += n;
+        size -= n;
+    }
 }
 
 /***************************************************************/
 /*                                                             */
-/* Procedure: mem_write_32                                     */
+/* Procedures: mem_save, mem_load                              */
 /*                                                             */
-/* Purpose: Write a 32-bit word to memory                      */
+/* Purpose: Write or read memory as part of a checkpoint: one  */
+/*          record of address and contents per page that is    */
+/*          not all zeroes, ended by MEM_CKPT_END. Loading     */
+/*          drops every page first.                            */
 /*                                                             */
 /***************************************************************/
-void mem_write_32(uint64_t address, uint32_t value)
+#define MEM_CKPT_END (~(uint64_t)0) /* no page starts there */
+
+bool mem_save(FILE *fp)
 {
-    int i;
-    for (i = 0; i < MEM_NREGIONS; i++) {
-        if (address >= MEM_REGIONS[i].start &&
-                address < (MEM_REGIONS[i].start + MEM_REGIONS[i].size)) {
-            uint32_t offset = address - MEM_REGIONS[i].start;
-
-            MEM_REGIONS[i].mem[offset+3] = (value >> 24) & 0xFF;
-            MEM_REGIONS[i].mem[offset+2] = (value >> 16) & 0xFF;
-            MEM_REGIONS[i].mem[offset+1] = (value >>  8) & 0xFF;
-            MEM_REGIONS[i].mem[offset+0] = (value >>  0) & 0xFF;
-            return;
+    static const uint8_t zeroes[MEM_PAGE_SIZE];
+    uint64_t end = MEM_CKPT_END, address;
+    size_t i, j;
+
+    for (i = 0; i < mem_dir_size; i++) {
+        if (mem_dir[i] == NULL)
+            continue;
+        for (j = 0; j < MEM_TABLE_SIZE; j++) {
+            uint8_t *page = mem_dir[i]->pages[j];
+            if (page == NULL || memcmp(page, zeroes, MEM_PAGE_SIZE) == 0)
+                continue;
+            address = ((mem_dir[i]->tag << MEM_TABLE_BITS) | j) << MEM_PAGE_BITS;
+            if (!ckpt_write(fp, &address, sizeof(address)) ||
+                !ckpt_write(fp, page, MEM_PAGE_SIZE))
+                return false;
         }
     }
+    return ckpt_write(fp, &end, sizeof(end));
+}
+
+bool mem_load(FILE *fp)
+{
+    uint64_t address;
+
+    init_memory();
+    while (ckpt_read(fp, &address, sizeof(address))) {
+        if (address == MEM_CKPT_END)
+            return true;
+        if (!ckpt_read(fp, mem_page(address, true), MEM_PAGE_SIZE))
+            return false;
+    }
+    return false;
+}
+
+/* The fixed-size accessors. Accesses within one page, i.e. all aligned
+ * ones, go straight to the page. */
+#define MEM_ACCESSORS(bits)                                             \
+uint##bits##_t mem_read_##bits(uint64_t address)                        \
+{                                                                       \
+    uint##bits##_t value = 0;                                           \
+    if ((address & (MEM_PAGE_SIZE - 1)) <= MEM_PAGE_SIZE - sizeof(value)) { \
+        uint8_t *page = mem_page(address, false);                       \
+        if (page != NULL)                                               \
+            memcpy(&value, page + (address & (MEM_PAGE_SIZE - 1)), sizeof(value)); \
+    } else {                                                            \
+        mem_read_block(address, &value, sizeof(value));                   \
+    }                                                                   \
+    return value;                                                       \
+}                                                                       \
+                                                                        \
+void mem_write_##bits(uint64_t address, uint##bits##_t value)           \
+{                                                                       \
+    if ((address & (MEM_PAGE_SIZE - 1)) <= MEM_PAGE_SIZE - sizeof(value)) \
+        memcpy(mem_page(address, true) + (address & (MEM_PAGE_SIZE - 1)), &value, sizeof(value)); \
+    else                                                                \
+        mem_write_block(address, &value, sizeof(value));                    \
 }
 
+/***************************************************************/
+/*                                                             */
+/* Procedures: mem_read_8/16/32/64, mem_write_8/16/32/64       */
+/*                                                             */
+/* Purpose: Read or write a little-endian value in memory      */
+/*                                                             */
+/***************************************************************/
+MEM_ACCESSORS(8)
+MEM_ACCESSORS(16)
+MEM_ACCESSORS(32)
+MEM_ACCESSORS(64)
+
 /***************************************************************/
 /*                                                             */
 /* Procedure : help                                            */
@@ -102,24 +287,67 @@ void help() {
   printf("----------------ARM ISIM Help-----------------------\n");
   printf("go                     -  run program to completion         \n");
   printf("run n                  -  execute program for n instructions\n");
+  printf("fastforward n          -  execute n instructions functionally, untimed\n");
+  printf("warm n                 -  as fastforward, warming caches and predictor\n");
+  printf("sample p w m           -  run to completion, measuring m instructions in\n");
+  printf("                          detail after w of warmup every p, and report\n");
+  printf("                          CPI, branch MPKI and miss rates\n");
+  printf("checkpoint file        -  save the whole simulator state to file\n");
+  printf("restore file           -  continue from a checkpoint instead\n");
   printf("mdump low high         -  dump memory from low to high      \n");
   printf("rdump                  -  dump the register & bus values    \n");
+  printf("stats file             -  write all statistics to file, as CSV if\n");
+  printf("                          it ends in .csv and JSON otherwise\n");
   printf("input reg_no reg_value - set GPR reg_no to reg_value  \n");
+  printf("trace mask level       -  set trace categories and level   \n");
   printf("?                      -  display this help menu            \n");
   printf("quit                   -  exit the program                  \n\n");
 }
 
+/***************************************************************/
+/*                                                             */
+/* Procedure : cycle_upto max                                  */
+/*                                                             */
+/* Purpose   : Execute a cycle, then skip the cycles after it  */
+/*             in which nothing would happen but outstanding   */
+/*             misses counting down (see pipe_cycle_quiet),    */
+/*             up to max cycles in all. Returns how many       */
+/*             cycles passed.                                  */
+/*                                                             */
+/***************************************************************/
+uint32_t cycle_upto(uint32_t max) {
+  uint32_t quiet;
+
+  /* Don't skip past the next row of statistics */
+  if (stats_every > 0 && stats_next > stat_cycles && max > stats_next - stat_cycles)
+    max = stats_next - stat_cycles;
+
+  quiet = (uint32_t)pipe_cycle_quiet();
+  if (quiet > max - 1)
+    quiet = max - 1;
+  if (quiet > 0)
+    pipe_skip_cycles((int)quiet);
+  stat_cycles += 1 + quiet;
+
+  if (stats_every > 0 && stat_cycles >= stats_next) {
+    stats_interval();
+    while (stats_next <= stat_cycles)
+      stats_next += stats_every;
+  }
+  return 1 + quiet;
+}
+
 /***************************************************************/
 /*                                                             */
 /* Procedure : cycle                                           */
 /*                                                             */
-/* Purpose   : Execute a cycle                                 */
+/* Purpose   : Execute a cycle, and skip the quiet ones after  */
+/*             it; for loops that stop on something other      */
+/*             than a cycle count                              */
 /*                                                             */
 /***************************************************************/
 void cycle() {
-  pipe_cycle();
-
-  stat_cycles++;
+  cycle_upto(UINT32_MAX);
 }
 
 /***************************************************************/
@@ -137,14 +365,210 @@ void run(int num_cycles) {
     return;
   }
 
-  printf("Simulating for %d cycles...\n\n", num_cycles);
-  for (i = 0; i < num_cycles; i++) {
+  if (!batch_mode)
+    printf("Simulating for %d cycles...\n\n", num_cycles);
+  if ((uint32_t)num_cycles > max_cycles - stat_cycles)
+    num_cycles = (int)(max_cycles - stat_cycles);
+  for (i = 0; i < num_cycles; i += cycle_upto(num_cycles - i)) {
     if (!RUN_BIT) {
-	    printf("Simulator halted\n\n");
+	    if (!batch_mode)
+	      printf("Simulator halted\n\n");
 	    break;
     }
+  }
+  if (RUN_BIT && stat_cycles == max_cycles && !batch_mode)
+    printf("Cycle limit of %u reached\n\n", max_cycles);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : skip_functional                                 */
+/*                                                             */
+/* Purpose   : Execute up to n instructions without timing     */
+/*             them and return how many were executed. What is */
+/*             in the pipeline finishes first; then the caches */
+/*             are made clean and the functional model takes   */
+/*             over. The next cycle fetches where it stopped.  */
+/*             Caches and predictor are as they were left, or, */
+/*             with warm, as the skipped instructions would    */
+/*             have left them.                                 */
+/*                                                             */
+/***************************************************************/
+uint64_t skip_functional(uint64_t n, bool warm) {
+  uint64_t done;
+
+  fetch_stopped = true;
+  while (RUN_BIT && !pipe_empty())
     cycle();
+  fetch_stopped = false;
+
+  /* A fetch miss may still be outstanding; fetch starts over
+     wherever the functional model stops */
+  if (wait_i_cache) {
+    cache_cancel(i_cache, CURRENT_STATE.PC);
+    wait_i_cache = false;
+  }
+
+  cache_flush_all();
+  done = func_run(n, warm);
+  stat_inst_fastforward += done;
+  return done;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : fastforward n warm                              */
+/*                                                             */
+/* Purpose   : The fastforward and warm commands               */
+/*                                                             */
+/***************************************************************/
+void fastforward(uint64_t n, bool warm) {
+  uint64_t done;
+
+  if (!RUN_BIT) {
+    printf("Can't simulate, Simulator is halted\n\n");
+    return;
   }
+
+  done = skip_functional(n, warm);
+  printf("Fast-forwarded %" PRIu64 " instructions\n\n", done);
+  if (!RUN_BIT)
+    printf("Simulator halted\n\n");
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : run_insts n                                     */
+/*                                                             */
+/* Purpose   : Simulate in detail until n more instructions    */
+/*             have retired or the simulator halts, and return */
+/*             how many did                                    */
+/*                                                             */
+/***************************************************************/
+uint32_t run_insts(uint32_t n) {
+  uint32_t start = stat_inst_retire;
+
+  while (RUN_BIT && stat_inst_retire - start < n)
+    cycle();
+  return stat_inst_retire - start;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Sampling.                                                   */
+/*                                                             */
+/* A sampled run splits the program into periods of the same   */
+/* number of instructions. Each period is fast-forwarded with  */
+/* warming, except for its last warmup + measure instructions, */
+/* which are simulated in detail; only the last measure ones   */
+/* count. Each metric is a ratio (cycles per instruction,      */
+/* misses per access, ...), estimated over the measured units  */
+/* as sum(y) / sum(x) with the usual ratio estimator variance, */
+/* which only needs running sums.                              */
+/*                                                             */
+/***************************************************************/
+
+#define SAMPLE_Z 1.96 /* 95% confidence */
+
+typedef struct {
+  double sx, sy, sxx, syy, sxy;
+} ratio_stat_t;
+
+static void ratio_add(ratio_stat_t *r, double x, double y) {
+  r->sx += x;
+  r->sy += y;
+  r->sxx += x * x;
+  r->syy += y * y;
+  r->sxy += x * y;
+}
+
+/* Prints sum(y) / sum(x), times scale, with its confidence half-width
+   over n units */
+static void ratio_print(const char *name, const ratio_stat_t *r, int n, double scale) {
+  double ratio, var, half;
+
+  if (r->sx == 0) {
+    printf("%-20s: n/a\n", name);
+    return;
+  }
+  ratio = r->sy / r->sx;
+  if (n < 2) {
+    printf("%-20s: %.4f\n", name, ratio * scale);
+    return;
+  }
+  /* sample variance of y - ratio * x, which sums to 0 */
+  var = (r->syy - 2 * ratio * r->sxy + ratio * ratio * r->sxx) / (n - 1);
+  if (var < 0)
+    var = 0;
+  half = SAMPLE_Z * sqrt(var / n) / (r->sx / n);
+  printf("%-20s: %.4f +- %.4f (%.1f%%)\n", name, ratio * scale, half * scale,
+         ratio > 0 ? 100 * half / ratio : 0.0);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : sample period warmup measure                    */
+/*                                                             */
+/* Purpose   : Run the program to completion, sampled as       */
+/*             described above, and report CPI, branch MPKI    */
+/*             and the miss rate of each cache.                */
+/*                                                             */
+/***************************************************************/
+void sample(uint64_t period, uint32_t warmup, uint32_t measure) {
+  ratio_stat_t cpi = {0}, mpki = {0}, miss_rate[MAX_CACHES] = {{0}};
+  uint64_t accesses[MAX_CACHES], misses[MAX_CACHES];
+  uint64_t start = stat_inst_retire + stat_inst_fastforward;
+  uint32_t cycles, retired, mispredicts;
+  int units = 0, k;
+  char name[32];
+
+  if (!RUN_BIT) {
+    printf("Can't simulate, Simulator is halted\n\n");
+    return;
+  }
+  if (measure == 0 || period < (uint64_t)warmup + measure) {
+    printf("Need 0 < measure and warmup + measure <= period\n\n");
+    return;
+  }
+
+  printf("Sampling %u instructions every %" PRIu64 ", after %u of warmup...\n\n",
+         measure, period, warmup);
+  while (RUN_BIT) {
+    skip_functional(period - warmup - measure, true);
+    run_insts(warmup);
+
+    cycles = stat_cycles;
+    mispredicts = stat_mispredict;
+    for (k = 0; k < global_cache_count; k++) {
+      accesses[k] = global_cache_list[k]->stat_accesses;
+      misses[k] = global_cache_list[k]->stat_misses;
+    }
+    retired = run_insts(measure);
+    /* The program may end part way into a unit, and so its drain
+       along with it; leave that one out */
+    if (retired < measure)
+      break;
+
+    ratio_add(&cpi, retired, stat_cycles - cycles);
+    ratio_add(&mpki, retired, stat_mispredict - mispredicts);
+    for (k = 0; k < global_cache_count; k++) {
+      cache_t *c = global_cache_list[k];
+      ratio_add(&miss_rate[k], c->stat_accesses - accesses[k], c->stat_misses - misses[k]);
+    }
+    units++;
+  }
+
+  printf("Simulator halted\n\n");
+  printf("Executed %" PRIu64 " instructions, measured %d units\n",
+         stat_inst_retire + stat_inst_fastforward - start, units);
+  printf("(+- gives the 95%% confidence interval)\n");
+  ratio_print("CPI", &cpi, units, 1);
+  ratio_print("Branch MPKI", &mpki, units, 1000);
+  for (k = 0; k < global_cache_count; k++) {
+    snprintf(name, sizeof(name), "%s miss rate", global_cache_list[k]->name);
+    ratio_print(name, &miss_rate[k], units, 1);
+  }
+  printf("\n");
 }
 
 /***************************************************************/
@@ -160,17 +584,25 @@ void go() {
     return;
   }
 
-  printf("Simulating...\n\n");
-  while (RUN_BIT)
-    cycle();
-  printf("Simulator halted\n\n");
+  if (!batch_mode)
+    printf("Simulating...\n\n");
+  while (RUN_BIT && stat_cycles < max_cycles)
+    cycle_upto(max_cycles - stat_cycles);
+  if (batch_mode)
+    return;
+  if (RUN_BIT)
+    printf("Cycle limit of %u reached\n\n", max_cycles);
+  else
+    printf("Simulator halted\n\n");
 }
 /***************************************************************/
 /*                                                             */
 /* Procedure : mdump                                           */
 /*                                                             */
 /* Purpose   : Dump a word-aligned region of memory to the     */
-/*             output file.                                    */
+/*             output file. Words come from dirty cache lines  */
+/*             where there are any, to show the latest stores, */
+/*             without writing anything back.                  */
 /*                                                             */
 /***************************************************************/
 void mdump(FILE * dumpsim_file, int start, int stop) {
@@ -179,14 +611,16 @@ void mdump(FILE * dumpsim_file, int start, int stop) {
   printf("\nMemory content [0x%08x..0x%08x] :\n", start, stop);
   printf("-------------------------------------\n");
   for (address = start; address <= stop; address += 4)
-    printf("  0x%08x (%d) : 0x%x\n", address, address, mem_read_32(address));
+    printf("  0x%08x (%d) : 0x%x\n", address, address, cache_peek_32(address));
   printf("\n");
 
-  /* dump the memory contents into the dumpsim file */
+  /* dump the memory contents into the dumpsim file, if there is one */
+  if (dumpsim_file == NULL)
+    return;
   fprintf(dumpsim_file, "\nMemory content [0x%08x..0x%08x] :\n", start, stop);
   fprintf(dumpsim_file, "-------------------------------------\n");
   for (address = start; address <= stop; address += 4)
-    fprintf(dumpsim_file, "  0x%08x (%d) : 0x%x\n", address, address, mem_read_32(address));
+    fprintf(dumpsim_file, "  0x%08x (%d) : 0x%x\n", address, address, cache_peek_32(address));
   fprintf(dumpsim_file, "\n");
 }
 
@@ -204,6 +638,8 @@ void rdump(FILE * dumpsim_file) {
   printf("\nCurrent register/bus values :\n");
   printf("-------------------------------------\n");
   printf("Instruction Retired : %u\n", stat_inst_retire);
+  if (stat_inst_fastforward > 0)
+    printf("Fast-forwarded      : %" PRIu64 "\n", stat_inst_fastforward);
   printf("PC                : 0x%" PRIx64 "\n", CURRENT_STATE.PC);
   printf("Registers:\n");
   for (k = 0; k < ARM_REGS; k++)
@@ -211,12 +647,17 @@ void rdump(FILE * dumpsim_file) {
   printf("FLAG_N: %d\n", CURRENT_STATE.FLAG_N);
   printf("FLAG_Z: %d\n", CURRENT_STATE.FLAG_Z);
   printf("No. of Cycles: %d\n", stat_cycles);
+  cache_print_stats(stdout);
   printf("\n");
 
-  /* dump the state information into the dumpsim file */
+  /* dump the state information into the dumpsim file, if there is one */
+  if (dumpsim_file == NULL)
+    return;
   fprintf(dumpsim_file, "\nCurrent register/bus values :\n");
   fprintf(dumpsim_file, "-------------------------------------\n");
   fprintf(dumpsim_file, "Instruction Retired : %u\n", stat_inst_retire);
+  if (stat_inst_fastforward > 0)
+    fprintf(dumpsim_file, "Fast-forwarded      : %" PRIu64 "\n", stat_inst_fastforward);
   fprintf(dumpsim_file, "PC                : 0x%" PRIx64 "\n", CURRENT_STATE.PC);
   fprintf(dumpsim_file, "Registers:\n");
   for (k = 0; k < ARM_REGS; k++)
@@ -224,28 +665,62 @@ void rdump(FILE * dumpsim_file) {
   fprintf(dumpsim_file, "FLAG_N: %d\n", CURRENT_STATE.FLAG_N);
   fprintf(dumpsim_file, "FLAG_Z: %d\n", CURRENT_STATE.FLAG_Z);
   fprintf(dumpsim_file, "No. of Cycles: %d\n", stat_cycles);
+  cache_print_stats(dumpsim_file);
   fprintf(dumpsim_file, "\n");
 }
 
+/***************************************************************/
+/*                                                             */
+/* Procedure : register_stats                                  */
+/*                                                             */
+/* Purpose   : Put the counters above in the statistics        */
+/*             registry (see stats.h)                          */
+/*                                                             */
+/***************************************************************/
+void register_stats() {
+  stats_register_u32("cycles", &stat_cycles);
+  stats_register_u32("instructions", &stat_inst_retire);
+  stats_register_u32("fetched", &stat_inst_fetch);
+  stats_register_u32("squashed", &stat_squash);
+  stats_register_u32("mispredicts", &stat_mispredict);
+  stats_register_u64("fastforwarded", &stat_inst_fastforward);
+}
+
+/* CSV for a file name ending in .csv, JSON otherwise */
+static stats_format_t stats_format_for(const char *filename) {
+  size_t len = strlen(filename);
+
+  if (len >= 4 && strcmp(filename + len - 4, ".csv") == 0)
+    return STATS_CSV;
+  return STATS_JSON;
+}
+
 /***************************************************************/
 /*                                                             */
 /* Procedure : get_command                                     */
 /*                                                             */
-/* Purpose   : Read a command from standard input.             */
+/* Purpose   : Read a command from in and carry it out.        */
+/*             Returns false on quit or at the end of the      */
+/*             input.                                          */
 /*                                                             */
 /***************************************************************/
-void get_command(FILE * dumpsim_file) {
+bool get_command(FILE * in, FILE * dumpsim_file) {
   char buffer[20];
   int start, stop, cycles;
   int register_no;
   int64_t register_value;
+  uint64_t skip;
+  uint32_t warmup, measure;
+  char filename[256];
 
-  printf("ARM-SIM> ");
+  if (!batch_mode)
+    printf("ARM-SIM> ");
 
-  if (scanf("%s", buffer) == EOF)
-      exit(0);
+  if (fscanf(in, "%19s", buffer) == EOF)
+      return false;
 
-  printf("\n");
+  if (!batch_mode)
+    printf("\n");
 
   switch(buffer[0]) {
   case 'G':
@@ -253,9 +728,36 @@ void get_command(FILE * dumpsim_file) {
     go();
     break;
 
+  case 'F':
+  case 'f':
+    if (fscanf(in, "%" SCNu64, &skip) != 1)
+      break;
+    fastforward(skip, false);
+    break;
+
+  case 'W':
+  case 'w':
+    if (fscanf(in, "%" SCNu64, &skip) != 1)
+      break;
+    fastforward(skip, true);
+    break;
+
+  case 'S':
+  case 's':
+    if (buffer[1] == 't' || buffer[1] == 'T') {
+      if (fscanf(in, "%255s", filename) != 1)
+        break;
+      stats_write(filename, stats_format_for(filename));
+      break;
+    }
+    if (fscanf(in, "%" SCNu64 " %" SCNu32 " %" SCNu32, &skip, &warmup, &measure) != 3)
+      break;
+    sample(skip, warmup, measure);
+    break;
+
   case 'M':
   case 'm':
-    if (scanf("%i %i", &start, &stop) != 2)
+    if (fscanf(in, "%i %i", &start, &stop) != 2)
         break;
 
     mdump(dumpsim_file, start, stop);
@@ -267,45 +769,79 @@ void get_command(FILE * dumpsim_file) {
 
   case 'Q':
   case 'q':
-    printf("Bye.\n");
-    exit(0);
+    if (!batch_mode)
+      printf("Bye.\n");
+    return false;
+
+  case 'C':
+  case 'c':
+    if (fscanf(in, "%255s", filename) != 1)
+      break;
+    if (checkpoint_save(filename))
+      printf("Saved checkpoint to %s\n\n", filename);
+    break;
 
   case 'R':
   case 'r':
     if (buffer[1] == 'd' || buffer[1] == 'D')
 	    rdump(dumpsim_file);
+    else if (buffer[1] == 'e' || buffer[1] == 'E') {
+	    if (fscanf(in, "%255s", filename) != 1) break;
+	    if (checkpoint_restore(filename))
+	      printf("Restored checkpoint from %s\n\n", filename);
+    }
     else {
-	    if (scanf("%d", &cycles) != 1) break;
+	    if (fscanf(in, "%d", &cycles) != 1) break;
 	    run(cycles);
     }
     break;
 
   case 'I':
   case 'i':
-   if (scanf("%i %" PRIx64, &register_no, &register_value) != 2)
+   if (fscanf(in, "%i %" PRIx64, &register_no, &register_value) != 2)
       break;
    CURRENT_STATE.REGS[register_no] = register_value;
    break;
 
+  case 'T':
+  case 't':
+    if (fscanf(in, "%i %i", &start, &stop) != 2)
+      break;
+#ifdef SIM_TRACE
+    trace_mask = start;
+    trace_level = stop;
+#else
+    printf("Tracing is not compiled in; build with `make sim_debug`\n");
+#endif
+    break;
+
   default:
     printf("Invalid Command\n");
     break;
   }
+  return true;
 }
 
 /***************************************************************/
 /*                                                             */
 /* Procedure : init_memory                                     */
 /*                                                             */
-/* Purpose   : Allocate and zero memory                        */
+/* Purpose   : Drop every page, leaving memory all zeroes      */
 /*                                                             */
 /***************************************************************/
 void init_memory() {
-    int i;
-    for (i = 0; i < MEM_NREGIONS; i++) {
-        MEM_REGIONS[i].mem = malloc(MEM_REGIONS[i].size);
-        memset(MEM_REGIONS[i].mem, 0, MEM_REGIONS[i].size);
+    size_t i, j;
+    for (i = 0; i < mem_dir_size; i++) {
+        if (mem_dir[i] == NULL)
+            continue;
+        for (j = 0; j < MEM_TABLE_SIZE; j++)
+            free(mem_dir[i]->pages[j]);
+        free(mem_dir[i]);
     }
+    free(mem_dir);
+    mem_dir = NULL;
+    mem_dir_size = mem_dir_used = 0;
+    mem_last_table = NULL;
 }
 
 /**************************************************************/
@@ -323,7 +859,7 @@ void load_program(char *program_filename) {
   prog = fopen(program_filename, "r");
   if (prog == NULL) {
     printf("Error: Can't open program file %s\n", program_filename);
-    exit(-1);
+    exit(1);
   }
 
   /* Read in the program. */
@@ -336,12 +872,13 @@ void load_program(char *program_filename) {
   }
   if (bytes_read == 0) {
     printf("Error: Malformed program file %s\n", program_filename);
-    exit(-1);
+    exit(1);
   }
 
   CURRENT_STATE.PC = MEM_TEXT_START;
 
-  printf("Read %d words from program into memory.\n\n", ii/4);
+  if (!batch_mode)
+    printf("Read %d words from program into memory.\n\n", ii/4);
 }
 /************************************************************/
 /*                                                          */
@@ -351,19 +888,427 @@ void load_program(char *program_filename) {
 /*             and set up initial state of the machine.     */
 /*                                                          */
 /************************************************************/
-void initialize(char *program_filename, int num_prog_files) {
+void initialize(char **program_filenames, int num_prog_files) {
   int i;
 
   init_memory();
+  register_stats();
   pipe_init();
   for ( i = 0; i < num_prog_files; i++ ) {
-    load_program(program_filename);
-    while(*program_filename++ != '\0');
+    load_program(program_filenames[i]);
   }
 
   RUN_BIT = 1;
 }
 
+/***************************************************************/
+/*                                                             */
+/* Sweeps.                                                     */
+/*                                                             */
+/* A sweep runs the loaded program to completion under many    */
+/* cache configurations and prints one row of results for      */
+/* each. Every run is a child process forked once the program  */
+/* is loaded, so it has its own copy of the simulator's        */
+/* globals while memory pages are shared copy-on-write, and    */
+/* up to `jobs` of them run at a time. Results come back       */
+/* through a shared mapping.                                   */
+/*                                                             */
+/* The grid file has one configuration per line: cache lines   */
+/* as for --config, separated by ';', applied on top of the    */
+/* command line settings, or "bp", "btb", "ras" or "indirect"  */
+/* and the value of the option of that name for the branch     */
+/* predictor.                                                  */
+/* {a,b,...} expands into one configuration per alternative,   */
+/* e.g.                                                        */
+/*   dcache sets={64,256},ways={2,4}; l2 sets=1024             */
+/* is four configurations.                                     */
+/*                                                             */
+/* With --max-cycles, a run stops there and its row says       */
+/* "limit" and what it got done by then.                       */
+/*                                                             */
+/***************************************************************/
+
+#define SWEEP_LINE_MAX 512
+#define SWEEP_LEVELS   4 /* L1I, L1D, L2, L3 */
+
+typedef struct {
+  bool done;
+  bool limit; /* stopped by --max-cycles rather than HLT */
+  uint32_t cycles, retired, mispredicts;
+  bool present[SWEEP_LEVELS];
+  uint64_t accesses[SWEEP_LEVELS], misses[SWEEP_LEVELS];
+} sweep_result_t;
+
+static char **sweep_configs = NULL;
+static int sweep_count = 0, sweep_capacity = 0;
+
+/* Adds line to sweep_configs, once for each combination of its
+   {...} alternatives */
+static void sweep_expand(const char *line) {
+  const char *open = strchr(line, '{'), *close, *alt, *end;
+  char expanded[SWEEP_LINE_MAX];
+
+  if (open == NULL) {
+    if (sweep_count == sweep_capacity) {
+      sweep_capacity = sweep_capacity ? 2 * sweep_capacity : 64;
+      sweep_configs = realloc(sweep_configs, sweep_capacity * sizeof(char*));
+      assert(sweep_configs != NULL);
+    }
+    sweep_configs[sweep_count++] = strdup(line);
+    return;
+  }
+  close = strchr(open, '}');
+  if (close == NULL) {
+    printf("Error: unmatched { in sweep configuration \"%s\"\n", line);
+    exit(1);
+  }
+  for (alt = open + 1; alt <= close; alt = end + 1) {
+    end = alt + strcspn(alt, ",}");
+    if (end > close)
+      end = close;
+    snprintf(expanded, sizeof(expanded), "%.*s%.*s%s", (int)(open - line), line,
+             (int)(end - alt), alt, close + 1);
+    sweep_expand(expanded);
+  }
+}
+
+/* Runs one configuration in a child process and exits */
+static void sweep_run(char *config, sweep_result_t *r) {
+  cache_t *levels[SWEEP_LEVELS];
+  char *part;
+  int k;
+
+  for (part = strtok(config, ";"); part != NULL; part = strtok(NULL, ";")) {
+    part += strspn(part, " \t");
+    if (strncmp(part, "bp ", 3) == 0) {
+      if (!bp_config_parse(part + 3))
+        exit(1);
+    } else if (strncmp(part, "btb ", 4) == 0) {
+      if (!btb_config_parse(part + 4))
+        exit(1);
+    } else if (strncmp(part, "ras ", 4) == 0) {
+      if (!bp_ras_config(atoi(part + 4)))
+        exit(1);
+    } else if (strncmp(part, "indirect ", 9) == 0) {
+      if (!ittage_config_parse(part + 9))
+        exit(1);
+    } else if (!cache_config_line(part)) {
+      exit(1);
+    }
+  }
+  cache_destroy_all();
+  cache_init_all();
+  bp_init();
+
+  while (RUN_BIT && stat_cycles < max_cycles)
+    cycle_upto(max_cycles - stat_cycles);
+
+  levels[0] = i_cache;
+  levels[1] = d_cache;
+  levels[2] = l2_cache;
+  levels[3] = l3_cache;
+  for (k = 0; k < SWEEP_LEVELS; k++) {
+    r->present[k] = levels[k] != NULL;
+    if (levels[k] != NULL) {
+      r->accesses[k] = levels[k]->stat_accesses;
+      r->misses[k] = levels[k]->stat_misses;
+    }
+  }
+  r->cycles = stat_cycles;
+  r->retired = stat_inst_retire;
+  r->mispredicts = stat_mispredict;
+  r->limit = RUN_BIT;
+  r->done = true;
+  exit(0);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : sweep                                           */
+/*                                                             */
+/* Purpose   : Run every configuration of the grid file, jobs  */
+/*             at a time, and print the results table          */
+/*                                                             */
+/***************************************************************/
+void sweep(const char *filename, int jobs) {
+  static const char *level_names[SWEEP_LEVELS] = { "L1I", "L1D", "L2", "L3" };
+  FILE *fp = fopen(filename, "r");
+  char line[SWEEP_LINE_MAX];
+  sweep_result_t *results;
+  int i, k, running = 0, failed = 0, limited = 0;
+  pid_t pid;
+
+  if (fp == NULL) {
+    printf("Error: Can't open sweep file %s\n", filename);
+    exit(1);
+  }
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    line[strcspn(line, "#\n")] = '\0';
+    if (line[strspn(line, " \t")] != '\0')
+      sweep_expand(line);
+  }
+  fclose(fp);
+  if (sweep_count == 0) {
+    printf("Error: no configurations in %s\n", filename);
+    exit(1);
+  }
+
+  results = mmap(NULL, sweep_count * sizeof(sweep_result_t), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (results == MAP_FAILED) {
+    printf("Error: Can't map sweep results\n");
+    exit(1);
+  }
+  memset(results, 0, sweep_count * sizeof(sweep_result_t));
+
+  printf("Sweeping %d configurations, %d at a time...\n\n", sweep_count, jobs);
+  fflush(stdout); /* or the children would print it again */
+  for (i = 0; i < sweep_count; i++) {
+    if (running == jobs) {
+      wait(NULL);
+      running--;
+    }
+    pid = fork();
+    if (pid < 0) {
+      printf("Error: Can't start a sweep job\n");
+      exit(1);
+    }
+    if (pid == 0)
+      sweep_run(sweep_configs[i], &results[i]);
+    running++;
+  }
+  while (running > 0) {
+    wait(NULL);
+    running--;
+  }
+
+  printf("%4s %12s %12s %8s %8s", "#", "cycles", "retired", "CPI", "MPKI");
+  for (k = 0; k < SWEEP_LEVELS; k++)
+    printf(" %9s", level_names[k]);
+  printf("  configuration\n");
+  for (i = 0; i < sweep_count; i++) {
+    sweep_result_t *r = &results[i];
+    printf("%4d ", i);
+    if (!r->done) {
+      printf("%12s %12s %8s %8s", "failed", "-", "-", "-");
+      for (k = 0; k < SWEEP_LEVELS; k++)
+        printf(" %9s", "-");
+      failed++;
+    } else {
+      if (r->limit) {
+        printf("%12s ", "limit");
+        limited++;
+      }
+      else
+        printf("%12u ", r->cycles);
+      printf("%12u %8.4f %8.3f", r->retired,
+             r->retired ? (double)r->cycles / r->retired : 0.0,
+             r->retired ? 1000.0 * r->mispredicts / r->retired : 0.0);
+      for (k = 0; k < SWEEP_LEVELS; k++) {
+        if (r->present[k] && r->accesses[k] > 0)
+          printf(" %8.3f%%", 100.0 * r->misses[k] / r->accesses[k]);
+        else
+          printf(" %9s", "-");
+      }
+    }
+    printf("  %s\n", sweep_configs[i]);
+  }
+  printf("\n(cache columns are miss rates)\n");
+  munmap(results, sweep_count * sizeof(sweep_result_t));
+  exit(failed > 0 ? 1 : limited > 0 ? 2 : 0);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : batch                                           */
+/*                                                             */
+/* Purpose   : Run without the shell: the commands in script   */
+/*             if there is one, otherwise the program to HLT   */
+/*             (or --max-cycles). Then write the statistics    */
+/*             and exit with 0 if the program halted, 2 if it  */
+/*             was still running, and 1 on any error.          */
+/*             With stats_interval, the statistics file also   */
+/*             takes a row every that many cycles.             */
+/*                                                             */
+/***************************************************************/
+void batch(const char *script, const char *stats_file, stats_format_t format,
+           uint32_t stats_interval, bool want_dumpsim) {
+  FILE *in, *dumpsim_file = NULL;
+
+  if (want_dumpsim && (dumpsim_file = fopen("dumpsim", "w")) == NULL) {
+    printf("Error: Can't open dumpsim file\n");
+    exit(1);
+  }
+  if (stats_file != NULL) {
+    if (!stats_open(stats_file, format))
+      exit(1);
+    stats_every = stats_interval;
+    stats_next = stat_cycles + stats_interval;
+  }
+
+  if (script != NULL) {
+    if ((in = fopen(script, "r")) == NULL) {
+      printf("Error: Can't open script %s\n", script);
+      exit(1);
+    }
+    while (get_command(in, dumpsim_file))
+      ;
+    fclose(in);
+  } else {
+    go();
+    if (dumpsim_file != NULL)
+      rdump(dumpsim_file);
+  }
+
+  if (dumpsim_file != NULL)
+    fclose(dumpsim_file);
+  if (stats_file != NULL) {
+    stats_every = 0;
+    if (!stats_close())
+      exit(1);
+  } else {
+    printf("%s after %u cycles, %u instructions retired\n",
+           RUN_BIT ? "Stopped" : "Halted", stat_cycles, stat_inst_retire);
+  }
+  exit(RUN_BIT ? 2 : 0);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : usage                                           */
+/*                                                             */
+/***************************************************************/
+void usage(char *prog) {
+  printf("Error: usage: %s [options] <program_file_1> <program_file_2> ...\n", prog);
+  printf("Options:\n");
+  printf("  --config file   read cache settings from file, one line per cache,\n");
+  printf("                  e.g. \"dcache sets=512 ways=4 miss=100\"\n");
+  printf("  --icache spec   i-cache settings, e.g. sets=64,ways=4,block=32,hit=0,miss=10,mshrs=4\n");
+  printf("  --dcache spec   d-cache settings, same keys as --icache\n");
+  printf("  --l2 spec       add a unified L2 behind both L1s, same keys plus\n");
+  printf("                  incl=nine|inclusive|exclusive; miss is then the memory latency\n");
+  printf("  --l3 spec       add an L3 behind the L2, same keys as --l2\n");
+  printf("                  repl=lru|plru|bitplru|srrip|brrip|random picks the replacement policy\n");
+  printf("                  write=back|through picks the write policy (default through)\n");
+  printf("  --bp spec       branch direction predictor: gshare,hist=8,pht=256 (the\n");
+  printf("                  default; hist up to 1024 bits, pht a power of 2), or\n");
+  printf("                  tage,tables=7,minhist=4,maxhist=640,tagbits=10,budget=8 (KB)\n");
+  printf("                  perceptron,global=8,local=1,path=1,minhist=3,maxhist=128,\n");
+  printf("                  localhist=11,weightbits=8,budget=8 (KB)\n");
+  printf("  --btb spec      BTB settings: sets=256,ways=4,tagbits=16,offsetbits=26,\n");
+  printf("                  repl=plru (or another --l2 repl policy)\n");
+  printf("  --ras n         return address stack depth, 0 to 64 (default 16; 0: none)\n");
+  printf("  --indirect spec targets of BRs other than returns: btb (the last one), or\n");
+  printf("                  ittage,tables=4,minhist=4,maxhist=64,tagbits=9,budget=4 (KB),\n");
+  printf("                  the default\n");
+  printf("  --sweep file    run the program once per configuration in file and print\n");
+  printf("                  a table of results (see sweep in shell.c for the format)\n");
+  printf("  --jobs n        how many sweep runs at a time (default: one per core)\n");
+  printf("  --batch         run without the shell: to HLT, or the commands of --script,\n");
+  printf("                  then exit with 0 if the program halted, 2 if not, 1 on errors\n");
+  printf("  --script file   shell commands for --batch, one per line\n");
+  printf("  --max-cycles n  stop go, run and each sweep run when the clock reaches\n");
+  printf("                  n cycles\n");
+  printf("  --stats file    with --batch, write the statistics to file (- for stdout)\n");
+  printf("  --stats-format f  json or csv (default: csv if the file name ends in .csv)\n");
+  printf("  --stats-interval n  also write the statistics every n cycles\n");
+  printf("  --dumpsim       with --batch, write the dumpsim file as the shell does\n");
+  exit(1);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : parse_options                                   */
+/*                                                             */
+/* Purpose   : Apply the command line options, and return the  */
+/*             index of the first program file in argv.        */
+/*                                                             */
+/***************************************************************/
+static char *sweep_file = NULL;
+static int sweep_jobs = 0;
+static char *batch_script = NULL, *batch_stats = NULL;
+static bool batch_dumpsim = false, batch_stats_format_set = false;
+static stats_format_t batch_stats_format = STATS_JSON;
+static uint32_t batch_stats_interval = 0;
+
+int parse_options(int argc, char *argv[]) {
+  int i;
+  char *end;
+
+  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    /* Flags, without a value */
+    if (strcmp(argv[i], "--batch") == 0) {
+      batch_mode = true;
+      continue;
+    } else if (strcmp(argv[i], "--dumpsim") == 0) {
+      batch_dumpsim = true;
+      continue;
+    }
+
+    if (i + 1 >= argc)
+      usage(argv[0]);
+
+    if (strcmp(argv[i], "--config") == 0) {
+      if (!cache_config_load(argv[++i]))
+        exit(1);
+    } else if (strcmp(argv[i], "--icache") == 0) {
+      if (!cache_config_parse(&i_cache_config, argv[++i]))
+        exit(1);
+    } else if (strcmp(argv[i], "--dcache") == 0) {
+      if (!cache_config_parse(&d_cache_config, argv[++i]))
+        exit(1);
+    } else if (strcmp(argv[i], "--l2") == 0) {
+      l2_cache_config.enabled = true;
+      if (!cache_config_parse(&l2_cache_config, argv[++i]))
+        exit(1);
+    } else if (strcmp(argv[i], "--l3") == 0) {
+      l3_cache_config.enabled = true;
+      if (!cache_config_parse(&l3_cache_config, argv[++i]))
+        exit(1);
+    } else if (strcmp(argv[i], "--bp") == 0) {
+      if (!bp_config_parse(argv[++i]))
+        exit(1);
+    } else if (strcmp(argv[i], "--btb") == 0) {
+      if (!btb_config_parse(argv[++i]))
+        exit(1);
+    } else if (strcmp(argv[i], "--ras") == 0) {
+      if (!bp_ras_config(atoi(argv[++i])))
+        exit(1);
+    } else if (strcmp(argv[i], "--indirect") == 0) {
+      if (!ittage_config_parse(argv[++i]))
+        exit(1);
+    } else if (strcmp(argv[i], "--sweep") == 0) {
+      sweep_file = argv[++i];
+    } else if (strcmp(argv[i], "--jobs") == 0) {
+      sweep_jobs = atoi(argv[++i]);
+      if (sweep_jobs <= 0)
+        usage(argv[0]);
+    } else if (strcmp(argv[i], "--script") == 0) {
+      batch_script = argv[++i];
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      batch_stats = argv[++i];
+    } else if (strcmp(argv[i], "--stats-format") == 0) {
+      if (!stats_parse_format(argv[++i], &batch_stats_format))
+        usage(argv[0]);
+      batch_stats_format_set = true;
+    } else if (strcmp(argv[i], "--stats-interval") == 0) {
+      unsigned long n = strtoul(argv[++i], &end, 0);
+      if (*end != '\0' || n == 0 || n > UINT32_MAX)
+        usage(argv[0]);
+      batch_stats_interval = (uint32_t)n;
+    } else if (strcmp(argv[i], "--max-cycles") == 0) {
+      unsigned long n = strtoul(argv[++i], &end, 0);
+      if (*end != '\0' || n == 0 || n > UINT32_MAX)
+        usage(argv[0]);
+      max_cycles = (uint32_t)n;
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  return i;
+}
+
 /***************************************************************/
 /*                                                             */
 /* Procedure : main                                            */
@@ -371,24 +1316,47 @@ void initialize(char *program_filename, int num_prog_files) {
 /***************************************************************/
 int main(int argc, char *argv[]) {
   FILE * dumpsim_file;
+  int first_prog;
+
+  first_prog = parse_options(argc, argv);
 
   /* Error Checking */
-  if (argc < 2) {
-    printf("Error: usage: %s <program_file_1> <program_file_2> ...\n",
-           argv[0]);
+  if (first_prog >= argc)
+    usage(argv[0]);
+
+  if ((batch_script != NULL || batch_stats != NULL || batch_dumpsim ||
+       batch_stats_interval > 0) && !batch_mode) {
+    printf("Error: --script, --stats, --stats-interval and --dumpsim only go with --batch\n");
+    exit(1);
+  }
+  if (batch_stats_interval > 0 && batch_stats == NULL) {
+    printf("Error: --stats-interval needs --stats\n");
     exit(1);
   }
+  if (batch_stats != NULL && !batch_stats_format_set)
+    batch_stats_format = stats_format_for(batch_stats);
 
-  printf("ARM Simulator\n\n");
+  if (!batch_mode)
+    printf("ARM Simulator\n\n");
 
-  initialize(argv[1], argc - 1);
+  initialize(argv + first_prog, argc - first_prog);
+
+  if (sweep_file != NULL) {
+    if (sweep_jobs == 0)
+      sweep_jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    sweep(sweep_file, sweep_jobs > 0 ? sweep_jobs : 1);
+  }
+
+  if (batch_mode)
+    batch(batch_script, batch_stats, batch_stats_format, batch_stats_interval, batch_dumpsim);
 
   if ( (dumpsim_file = fopen( "dumpsim", "w" )) == NULL ) {
     printf("Error: Can't open dumpsim file\n");
-    exit(-1);
+    exit(1);
   }
 
-  while (1)
-    get_command(dumpsim_file);
+  while (get_command(stdin, dumpsim_file))
+    ;
+  return 0;
 
 }
@@ -2,16 +2,33 @@
 #define _SIM_SHELL_H_
 
 #include <inttypes.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
 #define FALSE 0
 #define TRUE  1
 
 #define ARM_REGS 32
 
 /* only the cache touches these functions */
+uint8_t  mem_read_8(uint64_t address);
+uint16_t mem_read_16(uint64_t address);
 uint32_t mem_read_32(uint64_t address);
+uint64_t mem_read_64(uint64_t address);
+void     mem_write_8(uint64_t address, uint8_t value);
+void     mem_write_16(uint64_t address, uint16_t value);
 void     mem_write_32(uint64_t address, uint32_t value);
+void     mem_write_64(uint64_t address, uint64_t value);
+void     mem_read_block(uint64_t address, void *buf, size_t size);
+void     mem_write_block(uint64_t address, const void *buf, size_t size);
+
+/* memory's part of a checkpoint (see checkpoint.h) */
+bool     mem_save(FILE *fp);
+bool     mem_load(FILE *fp);
 
 /* statistics */
 extern uint32_t stat_cycles, stat_inst_retire, stat_inst_fetch, stat_squash;
+extern uint32_t stat_mispredict; /* branches resolved against their prediction */
+extern uint64_t stat_inst_fastforward;
 
 #endif
@@ -0,0 +1,154 @@
+#include "stats.h"
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#define STATS_MAX      128
+#define STATS_NAME_MAX 48
+
+typedef struct {
+    char name[STATS_NAME_MAX];
+    const void *counter;
+    bool wide; // uint64_t rather than uint32_t
+} stat_entry_t;
+
+static stat_entry_t stats[STATS_MAX];
+static int num_stats = 0;
+
+// The file stats_open started
+static FILE *stats_fp = NULL;
+static const char *stats_filename;
+static stats_format_t stats_format;
+static int stats_rows; // stats_interval rows so far
+
+static void stats_register(const char *name, const void *counter, bool wide)
+{
+    stat_entry_t *e = NULL;
+
+    for (int i = 0; i < num_stats; i++)
+        if (strcmp(stats[i].name, name) == 0)
+            e = &stats[i];
+    if (e == NULL) {
+        assert(num_stats < STATS_MAX && strlen(name) < STATS_NAME_MAX);
+        e = &stats[num_stats++];
+        strcpy(e->name, name);
+    }
+    e->counter = counter;
+    e->wide = wide;
+}
+
+void stats_register_u32(const char *name, const uint32_t *counter)
+{
+    stats_register(name, counter, false);
+}
+
+void stats_register_u64(const char *name, const uint64_t *counter)
+{
+    stats_register(name, counter, true);
+}
+
+void stats_unregister(const char *prefix)
+{
+    int n = 0;
+
+    // Keeps the order of the rest
+    for (int i = 0; i < num_stats; i++)
+        if (strncmp(stats[i].name, prefix, strlen(prefix)) != 0)
+            stats[n++] = stats[i];
+    num_stats = n;
+}
+
+bool stats_parse_format(const char *s, stats_format_t *format)
+{
+    if (strcmp(s, "json") == 0)
+        *format = STATS_JSON;
+    else if (strcmp(s, "csv") == 0)
+        *format = STATS_CSV;
+    else
+        return false;
+    return true;
+}
+
+static uint64_t stat_value(const stat_entry_t *e)
+{
+    return e->wide ? *(const uint64_t*)e->counter : *(const uint32_t*)e->counter;
+}
+
+static void write_csv_row(FILE *fp)
+{
+    for (int i = 0; i < num_stats; i++)
+        fprintf(fp, "%s%" PRIu64, i ? "," : "", stat_value(&stats[i]));
+    fprintf(fp, "\n");
+}
+
+bool stats_open(const char *filename, stats_format_t format)
+{
+    assert(stats_fp == NULL);
+    stats_fp = strcmp(filename, "-") == 0 ? stdout : fopen(filename, "w");
+    if (stats_fp == NULL) {
+        printf("Error: Can't open stats file %s\n", filename);
+        return false;
+    }
+    stats_filename = filename;
+    stats_format = format;
+    stats_rows = 0;
+
+    if (format == STATS_CSV) {
+        for (int i = 0; i < num_stats; i++)
+            fprintf(stats_fp, "%s%s", i ? "," : "", stats[i].name);
+        fprintf(stats_fp, "\n");
+    } else {
+        fprintf(stats_fp, "{\n");
+    }
+    return true;
+}
+
+void stats_interval()
+{
+    assert(stats_fp != NULL);
+    if (stats_format == STATS_CSV) {
+        write_csv_row(stats_fp);
+    } else {
+        fprintf(stats_fp, stats_rows == 0 ? "  \"intervals\": [\n" : ",\n");
+        fprintf(stats_fp, "    {");
+        for (int i = 0; i < num_stats; i++)
+            fprintf(stats_fp, "%s\"%s\": %" PRIu64, i ? ", " : " ", stats[i].name,
+                    stat_value(&stats[i]));
+        fprintf(stats_fp, " }");
+    }
+    stats_rows++;
+}
+
+bool stats_close()
+{
+    FILE *fp = stats_fp;
+    bool ok;
+
+    assert(fp != NULL);
+    if (stats_format == STATS_CSV) {
+        write_csv_row(fp);
+    } else {
+        if (stats_rows > 0)
+            fprintf(fp, "\n  ]%s\n", num_stats > 0 ? "," : "");
+        for (int i = 0; i < num_stats; i++)
+            fprintf(fp, "  \"%s\": %" PRIu64 "%s\n", stats[i].name, stat_value(&stats[i]),
+                    i + 1 < num_stats ? "," : "");
+        fprintf(fp, "}\n");
+    }
+
+    ok = !ferror(fp);
+    if (fp == stdout)
+        ok = fflush(fp) == 0 && ok;
+    else
+        ok = fclose(fp) == 0 && ok;
+    if (!ok)
+        printf("Error: Can't write stats file %s\n", stats_filename);
+    stats_fp = NULL;
+    return ok;
+}
+
+bool stats_write(const char *filename, stats_format_t format)
+{
+    return stats_open(filename, format) && stats_close();
+}
@@ -0,0 +1,46 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// The statistics registry. Each module registers its counters under a
+// name once it has set them up, and the registry reads them whenever the
+// statistics are written out, so nothing has to be copied as it runs.
+// Names are dotted, e.g. "L1D.misses"; the order of registration is the
+// order of output.
+//
+// Output is JSON (one object, counter names as keys) or CSV (a header
+// row of names, then a row of values). A file can also take a row every
+// so many cycles while the program runs (see stats_open): in CSV those are
+// just more rows, in JSON an "intervals" array of objects ahead of the
+// final counters. Every value is cumulative from the start of the run.
+
+typedef enum {
+    STATS_JSON,
+    STATS_CSV
+} stats_format_t;
+
+// Registering a name that is already there points it at the new counter,
+// so a module can register again after it is rebuilt.
+void stats_register_u32(const char *name, const uint32_t *counter);
+void stats_register_u64(const char *name, const uint64_t *counter);
+
+// Drops every counter whose name starts with prefix
+void stats_unregister(const char *prefix);
+
+// "json" or "csv"; false if it is neither
+bool stats_parse_format(const char *s, stats_format_t *format);
+
+// Writes the counters as they are now to filename, or to standard output
+// if it is "-". Prints the problem and returns false on failure.
+bool stats_write(const char *filename, stats_format_t format);
+
+// The same in three steps, with stats_interval adding a row of the
+// counters as they are when it is called, between stats_open and
+// stats_close (which adds the final one).
+bool stats_open(const char *filename, stats_format_t format);
+void stats_interval();
+bool stats_close();
+
+#endif
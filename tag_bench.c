@@ -0,0 +1,73 @@
+/*
+ * Standalone benchmark for the tag compare kernel in tag_match.h.
+ * For associativities from 1 to 32 ways it fills a tag array laid out
+ * like cache_t::tags, probes it with random addresses (about half of
+ * them hits), and reports lookups per second for the scalar loop and
+ * for the kernel this binary was built with.
+ *
+ * Build and run with `make tag_bench && ./tag_bench`.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "tag_match.h"
+
+#define BENCH_SETS   1024
+#define BENCH_PROBES (1 << 20)
+#define BENCH_ROUNDS 16
+#define VALID        ((uint64_t)1 << 63)
+
+static double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+int main()
+{
+    uint64_t *probes = malloc(sizeof(uint64_t) * BENCH_PROBES);
+    int *sets = malloc(sizeof(int) * BENCH_PROBES);
+    printf("kernel: %s, %d sets, %d probes x %d rounds\n\n",
+           TAG_MATCH_KERNEL, BENCH_SETS, BENCH_PROBES, BENCH_ROUNDS);
+    printf("%5s %16s %16s %8s\n", "ways", "scalar (M/s)", "kernel (M/s)", "speedup");
+
+    for (int ways = 1; ways <= 32; ways++) {
+        uint64_t *tags = aligned_alloc(64, sizeof(uint64_t) * BENCH_SETS * 32);
+        for (int s = 0; s < BENCH_SETS; s++)
+            for (int w = 0; w < ways; w++)
+                tags[s * ways + w] = VALID | (uint64_t)(s * 64 + w);
+
+        srand(ways);
+        for (int i = 0; i < BENCH_PROBES; i++) {
+            sets[i] = rand() % BENCH_SETS;
+            probes[i] = VALID | (uint64_t)(sets[i] * 64 + rand() % (2 * ways));
+        }
+
+        long check_scalar = 0, check_kernel = 0;
+        double t0 = now();
+        for (int r = 0; r < BENCH_ROUNDS; r++)
+            for (int i = 0; i < BENCH_PROBES; i++)
+                check_scalar += tag_match_scalar(&tags[sets[i] * ways], ways, probes[i]);
+        double t1 = now();
+        for (int r = 0; r < BENCH_ROUNDS; r++)
+            for (int i = 0; i < BENCH_PROBES; i++)
+                check_kernel += tag_match(&tags[sets[i] * ways], ways, probes[i]);
+        double t2 = now();
+
+        if (check_scalar != check_kernel) {
+            printf("Error: kernel disagrees with the scalar loop at %d ways\n", ways);
+            return 1;
+        }
+
+        double n = (double)BENCH_PROBES * BENCH_ROUNDS / 1e6;
+        printf("%5d %16.1f %16.1f %7.2fx\n", ways, n / (t1 - t0), n / (t2 - t1),
+               (t1 - t0) / (t2 - t1));
+        free(tags);
+    }
+
+    free(probes);
+    free(sets);
+    return 0;
+}
@@ -0,0 +1,66 @@
+#ifndef _TAG_MATCH_H_
+#define _TAG_MATCH_H_
+
+#include <stdint.h>
+
+// Tag compare kernel for set-associative lookup. The tags of one set are
+// contiguous (see cache_t), so all ways can be compared with a few vector
+// compares. The variant is picked at build time from the target flags:
+// AVX2 compares 4 ways per instruction, SSE2 2 ways, and anything else
+// falls back to the scalar loop. Each returns the first matching way,
+// or -1 if none matches.
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define TAG_MATCH_KERNEL "avx2"
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define TAG_MATCH_KERNEL "sse2"
+#else
+#define TAG_MATCH_KERNEL "scalar"
+#endif
+
+static inline int tag_match_scalar(const uint64_t *tags, int ways, uint64_t tag)
+{
+    for (int i = 0; i < ways; i++) {
+        if (tags[i] == tag)
+            return i;
+    }
+    return -1;
+}
+
+// Below this many ways the vector setup costs more than the loop it saves
+#define TAG_MATCH_MIN_SIMD_WAYS 8
+
+static inline int tag_match(const uint64_t *tags, int ways, uint64_t tag)
+{
+    if (ways < TAG_MATCH_MIN_SIMD_WAYS)
+        return tag_match_scalar(tags, ways, tag);
+
+    int i = 0;
+#if defined(__AVX2__)
+    __m256i key = _mm256_set1_epi64x((long long)tag);
+    for (; i + 4 <= ways; i += 4) {
+        __m256i t = _mm256_loadu_si256((const __m256i*)&tags[i]);
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(t, key)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#elif defined(__SSE2__)
+    // SSE2 has no 64-bit compare; a 64-bit lane matches if both of its
+    // 32-bit halves do, so AND the 32-bit result with itself swapped.
+    __m128i key = _mm_set1_epi64x((long long)tag);
+    for (; i + 2 <= ways; i += 2) {
+        __m128i t = _mm_loadu_si128((const __m128i*)&tags[i]);
+        __m128i eq = _mm_cmpeq_epi32(t, key);
+        eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+        int mask = _mm_movemask_pd(_mm_castsi128_pd(eq));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+    int j = tag_match_scalar(tags + i, ways - i, tag);
+    return j < 0 ? -1 : i + j;
+}
+
+#endif
@@ -0,0 +1,430 @@
+#include "bp.h"
+#include "checkpoint.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+// TAGE (Seznec and Michaud, "A case for (partially) TAgged GEometric
+// history length branch prediction", JILP 2006). A bimodal table gives a
+// base prediction, and `tables` tagged tables, indexed with global history
+// lengths in a geometric series from minhist to maxhist, override it where
+// their tag matches: the one with the longest history that matches is the
+// provider. A mispredict allocates an entry in a table with longer history
+// than the provider's, so a branch ends up with as much history as it
+// needs to be predicted.
+//
+// The storage budget is in KB of the modeled bits: 2 per bimodal counter
+// and 3 + tagbits + 2 per tagged entry. An eighth of it goes to the
+// bimodal table and the rest is split evenly between the tagged ones, each
+// a power of 2 in size.
+
+#define TAGE_MAX_TABLES   15
+#define TAGE_MAX_HIST     2048
+#define TAGE_HIST_BUF     4096 // Must be a power of 2 above TAGE_MAX_HIST
+#define TAGE_CTR_MAX      3    // Tagged entries have 3-bit signed counters
+#define TAGE_CTR_MIN      (-4)
+#define TAGE_U_MAX        3    // and 2-bit usefulness counters
+#define TAGE_USE_ALT_MAX  7
+#define TAGE_USE_ALT_MIN  (-8)
+#define TAGE_U_PERIOD     (1 << 18) // Updates between halving every u
+#define TAGE_PENDING      4    // Predictions remembered for their update
+
+typedef struct {
+    int tables, min_hist, max_hist, tag_bits, budget_kb;
+} tage_config_t;
+
+static tage_config_t tage_config = {
+    .tables = 7,
+    .min_hist = 4,
+    .max_hist = 640,
+    .tag_bits = 10,
+    .budget_kb = 8,
+};
+
+// Worked out from tage_config by tage_check
+static int tage_log_bimodal, tage_log_entries;
+static int tage_hist_len[TAGE_MAX_TABLES + 1]; // Of tables 1..tables
+
+typedef struct {
+    int8_t ctr; // Taken if >= 0
+    uint8_t u;
+    uint16_t tag;
+} tage_entry_t;
+
+// Global history of `length` bits XOR-folded down to `width`, kept up to
+// date one bit at a time
+typedef struct {
+    uint32_t value;
+    int length, width;
+} tage_folded_t;
+
+static uint8_t *tage_bimodal = NULL; // 2-bit counters, as in the gshare PHT
+static tage_entry_t *tage_table[TAGE_MAX_TABLES + 1];
+
+// History bit i (0 the latest) is tage_hist[(tage_hist_ptr + i) % TAGE_HIST_BUF]
+static uint8_t tage_hist[TAGE_HIST_BUF];
+static int tage_hist_ptr;
+static tage_folded_t tage_index_fold[TAGE_MAX_TABLES + 1];
+static tage_folded_t tage_tag_fold[2][TAGE_MAX_TABLES + 1];
+
+static int8_t tage_use_alt; // >= 0: trust the alternate over a new entry
+static uint32_t tage_updates;
+static uint32_t tage_rng;
+
+// Everything a prediction looked at, so the update trains the same entries
+typedef struct {
+    bool valid;
+    uint64_t pc;
+    uint32_t bimodal_index;
+    uint32_t index[TAGE_MAX_TABLES + 1];
+    uint16_t tag[TAGE_MAX_TABLES + 1];
+    int provider, alt; // Tagged tables; 0 for the bimodal table
+    bool provider_pred, alt_pred, pred;
+    bool weak_new;     // The provider entry looks newly allocated
+} tage_lookup_t;
+
+// Fetch predicts a branch before the one ahead of it has updated the
+// history, so the update can't just look again
+static tage_lookup_t tage_pending[TAGE_PENDING];
+static int tage_pending_next;
+
+static bool tage_set(const char *key, int value)
+{
+    if (strcmp(key, "tables") == 0)
+        tage_config.tables = value;
+    else if (strcmp(key, "minhist") == 0)
+        tage_config.min_hist = value;
+    else if (strcmp(key, "maxhist") == 0)
+        tage_config.max_hist = value;
+    else if (strcmp(key, "tagbits") == 0)
+        tage_config.tag_bits = value;
+    else if (strcmp(key, "budget") == 0)
+        tage_config.budget_kb = value;
+    else {
+        printf("Error: tage has no setting \"%s\"\n", key);
+        return false;
+    }
+    return true;
+}
+
+static int floor_log2(uint64_t n)
+{
+    int log = -1;
+    while (n > 0) {
+        n >>= 1;
+        log++;
+    }
+    return log;
+}
+
+static bool tage_check()
+{
+    const tage_config_t *c = &tage_config;
+    int n = c->tables;
+
+    if (n < 1 || n > TAGE_MAX_TABLES) {
+        printf("Error: tage needs 1 to %d tables\n", TAGE_MAX_TABLES);
+        return false;
+    }
+    if (c->min_hist < 1 || c->min_hist > c->max_hist || c->max_hist > TAGE_MAX_HIST) {
+        printf("Error: tage needs 1 <= minhist <= maxhist <= %d\n", TAGE_MAX_HIST);
+        return false;
+    }
+    if (c->tag_bits < 4 || c->tag_bits > 16) {
+        printf("Error: tage tagbits must be 4 to 16\n");
+        return false;
+    }
+    if (c->budget_kb < 1 || c->budget_kb > 65536) {
+        printf("Error: tage budget must be 1 to 65536 KB\n");
+        return false;
+    }
+
+    uint64_t bits = (uint64_t)c->budget_kb * 8192;
+    tage_log_bimodal = floor_log2(bits / 8 / 2);
+    tage_log_entries = floor_log2((bits - (2ull << tage_log_bimodal)) / n / (3 + c->tag_bits + 2));
+    if (tage_log_entries < 2 || tage_log_entries > 24) {
+        printf("Error: a %d KB budget gives tage tables of 2^%d entries; need 2^2 to 2^24\n",
+               c->budget_kb, tage_log_entries);
+        return false;
+    }
+
+    // Geometric series, nudged apart where rounding makes two the same
+    for (int t = 1; t <= n; t++) {
+        double ratio = n == 1 ? 1.0 : (double)(t - 1) / (n - 1);
+        int len = n == 1 ? c->max_hist :
+                  (int)(c->min_hist * pow((double)c->max_hist / c->min_hist, ratio) + 0.5);
+        if (t > 1 && len <= tage_hist_len[t - 1])
+            len = tage_hist_len[t - 1] + 1;
+        if (len > TAGE_MAX_HIST) {
+            printf("Error: too many tage tables for maxhist %d\n", c->max_hist);
+            return false;
+        }
+        tage_hist_len[t] = len;
+    }
+    return true;
+}
+
+static void fold_init(tage_folded_t *f, int length, int width)
+{
+    f->value = 0;
+    f->length = length;
+    f->width = width;
+}
+
+// After a bit has been shifted into tage_hist
+static void fold_update(tage_folded_t *f)
+{
+    f->value = (f->value << 1) | tage_hist[tage_hist_ptr];
+    f->value ^= (uint32_t)tage_hist[(tage_hist_ptr + f->length) & (TAGE_HIST_BUF - 1)]
+                << (f->length % f->width);
+    f->value ^= f->value >> f->width;
+    f->value &= (1u << f->width) - 1;
+}
+
+static void tage_init()
+{
+    int n = tage_config.tables;
+
+    free(tage_bimodal);
+    tage_bimodal = calloc((size_t)1 << tage_log_bimodal, 1);
+    for (int t = 1; t <= TAGE_MAX_TABLES; t++) {
+        free(tage_table[t]);
+        tage_table[t] = NULL;
+    }
+    for (int t = 1; t <= n; t++) {
+        tage_table[t] = calloc((size_t)1 << tage_log_entries, sizeof(tage_entry_t));
+        if (tage_table[t] == NULL)
+            break;
+    }
+    if (tage_bimodal == NULL || tage_table[n] == NULL) {
+        printf("malloc failed to init tage\n");
+        exit(1);
+    }
+
+    memset(tage_hist, 0, sizeof(tage_hist));
+    tage_hist_ptr = 0;
+    for (int t = 1; t <= n; t++) {
+        fold_init(&tage_index_fold[t], tage_hist_len[t], tage_log_entries);
+        fold_init(&tage_tag_fold[0][t], tage_hist_len[t], tage_config.tag_bits);
+        fold_init(&tage_tag_fold[1][t], tage_hist_len[t], tage_config.tag_bits - 1);
+    }
+    tage_use_alt = 0;
+    tage_updates = 0;
+    tage_rng = 0x2545f491;
+    memset(tage_pending, 0, sizeof(tage_pending));
+    tage_pending_next = 0;
+}
+
+static uint32_t tage_random()
+{
+    // xorshift32
+    tage_rng ^= tage_rng << 13;
+    tage_rng ^= tage_rng >> 17;
+    tage_rng ^= tage_rng << 5;
+    return tage_rng;
+}
+
+static void tage_lookup(uint64_t PC, tage_lookup_t *l)
+{
+    uint64_t p = PC >> 2;
+    uint32_t index_mask = (1u << tage_log_entries) - 1;
+    uint32_t tag_mask = (1u << tage_config.tag_bits) - 1;
+    int n = tage_config.tables;
+
+    l->valid = true;
+    l->pc = PC;
+    l->bimodal_index = (uint32_t)p & ((1u << tage_log_bimodal) - 1);
+    l->provider = l->alt = 0;
+    for (int t = n; t >= 1; t--) {
+        l->index[t] = (uint32_t)(p ^ (p >> tage_log_entries) ^ tage_index_fold[t].value) & index_mask;
+        l->tag[t] = (uint16_t)((p ^ tage_tag_fold[0][t].value ^ (tage_tag_fold[1][t].value << 1)) &
+                               tag_mask);
+        if (tage_table[t][l->index[t]].tag != l->tag[t])
+            continue;
+        if (l->provider == 0)
+            l->provider = t;
+        else if (l->alt == 0)
+            l->alt = t;
+    }
+
+    bool bimodal_pred = tage_bimodal[l->bimodal_index] > 1;
+    l->alt_pred = l->alt ? tage_table[l->alt][l->index[l->alt]].ctr >= 0 : bimodal_pred;
+    if (l->provider == 0) {
+        l->provider_pred = l->pred = bimodal_pred;
+        l->weak_new = false;
+        return;
+    }
+    const tage_entry_t *e = &tage_table[l->provider][l->index[l->provider]];
+    l->provider_pred = e->ctr >= 0;
+    l->weak_new = (e->ctr == 0 || e->ctr == -1) && e->u == 0;
+    l->pred = l->weak_new && tage_use_alt >= 0 ? l->alt_pred : l->provider_pred;
+}
+
+static bool tage_predict(uint64_t PC)
+{
+    tage_lookup_t *l = &tage_pending[tage_pending_next];
+
+    tage_pending_next = (tage_pending_next + 1) % TAGE_PENDING;
+    tage_lookup(PC, l);
+    return l->pred;
+}
+
+static void ctr_update(int8_t *ctr, bool taken)
+{
+    if (taken && *ctr < TAGE_CTR_MAX)
+        (*ctr)++;
+    else if (!taken && *ctr > TAGE_CTR_MIN)
+        (*ctr)--;
+}
+
+static void bimodal_update(uint32_t index, bool taken)
+{
+    if (taken && tage_bimodal[index] < 3)
+        tage_bimodal[index]++;
+    else if (!taken && tage_bimodal[index] > 0)
+        tage_bimodal[index]--;
+}
+
+// Takes an entry nobody finds useful in a table with longer history than
+// the provider's, or if there is none, makes such entries less useful so
+// there will be one next time
+static void tage_allocate(const tage_lookup_t *l, bool taken)
+{
+    int n = tage_config.tables;
+    int first = l->provider + 1;
+
+    // Now and then skip a table, so allocations spread over the longer ones
+    if (first < n && (tage_random() & 1))
+        first++;
+    for (int t = first; t <= n; t++) {
+        tage_entry_t *e = &tage_table[t][l->index[t]];
+        if (e->u == 0) {
+            e->tag = l->tag[t];
+            e->ctr = taken ? 0 : -1;
+            return;
+        }
+    }
+    for (int t = l->provider + 1; t <= n; t++) {
+        tage_entry_t *e = &tage_table[t][l->index[t]];
+        if (e->u > 0)
+            e->u--;
+    }
+}
+
+static void tage_update(uint64_t PC, bool taken)
+{
+    tage_lookup_t l;
+    int n = tage_config.tables;
+
+    // The latest prediction of PC, or a fresh look if it was never
+    // predicted (a BTB miss, or warming)
+    l.valid = false;
+    for (int i = 1; i <= TAGE_PENDING && !l.valid; i++) {
+        tage_lookup_t *p = &tage_pending[(tage_pending_next + TAGE_PENDING - i) % TAGE_PENDING];
+        if (p->valid && p->pc == PC) {
+            l = *p;
+            p->valid = false;
+        }
+    }
+    if (!l.valid)
+        tage_lookup(PC, &l);
+
+    if (l.provider > 0 && l.weak_new && l.provider_pred != l.alt_pred) {
+        if (l.alt_pred == taken && tage_use_alt < TAGE_USE_ALT_MAX)
+            tage_use_alt++;
+        else if (l.alt_pred != taken && tage_use_alt > TAGE_USE_ALT_MIN)
+            tage_use_alt--;
+    }
+
+    if (l.pred != taken && l.provider < n)
+        tage_allocate(&l, taken);
+
+    if (l.provider > 0) {
+        tage_entry_t *e = &tage_table[l.provider][l.index[l.provider]];
+        ctr_update(&e->ctr, taken);
+        // While the provider proves itself, the alternate keeps learning
+        if (e->u == 0) {
+            if (l.alt > 0)
+                ctr_update(&tage_table[l.alt][l.index[l.alt]].ctr, taken);
+            else
+                bimodal_update(l.bimodal_index, taken);
+        }
+        if (l.provider_pred != l.alt_pred) {
+            if (l.provider_pred == taken && e->u < TAGE_U_MAX)
+                e->u++;
+            else if (l.provider_pred != taken && e->u > 0)
+                e->u--;
+        }
+    } else {
+        bimodal_update(l.bimodal_index, taken);
+    }
+
+    // Entries only stay useful by being useful again
+    if (++tage_updates % TAGE_U_PERIOD == 0) {
+        for (int t = 1; t <= n; t++)
+            for (uint32_t i = 0; i < (1u << tage_log_entries); i++)
+                tage_table[t][i].u >>= 1;
+    }
+
+    tage_hist_ptr = (tage_hist_ptr - 1) & (TAGE_HIST_BUF - 1);
+    tage_hist[tage_hist_ptr] = taken;
+    for (int t = 1; t <= n; t++) {
+        fold_update(&tage_index_fold[t]);
+        fold_update(&tage_tag_fold[0][t]);
+        fold_update(&tage_tag_fold[1][t]);
+    }
+}
+
+// Everything but the tables, which are sized at run time
+static const ckpt_item_t tage_state[] = {
+    CKPT_ITEM(tage_hist),
+    CKPT_ITEM(tage_hist_ptr),
+    CKPT_ITEM(tage_index_fold),
+    CKPT_ITEM(tage_tag_fold),
+    CKPT_ITEM(tage_use_alt),
+    CKPT_ITEM(tage_updates),
+    CKPT_ITEM(tage_rng),
+    CKPT_ITEM(tage_pending),
+    CKPT_ITEM(tage_pending_next),
+};
+
+#define NUM_TAGE_STATE (int)(sizeof(tage_state) / sizeof(tage_state[0]))
+
+static bool tage_save(FILE *fp)
+{
+    size_t entries = (size_t)1 << tage_log_entries;
+
+    if (!ckpt_write(fp, tage_bimodal, (size_t)1 << tage_log_bimodal))
+        return false;
+    for (int t = 1; t <= tage_config.tables; t++)
+        if (!ckpt_write(fp, tage_table[t], entries * sizeof(tage_entry_t)))
+            return false;
+    return ckpt_write_items(fp, tage_state, NUM_TAGE_STATE);
+}
+
+static bool tage_load(FILE *fp)
+{
+    size_t entries = (size_t)1 << tage_log_entries;
+
+    if (!ckpt_read(fp, tage_bimodal, (size_t)1 << tage_log_bimodal))
+        return false;
+    for (int t = 1; t <= tage_config.tables; t++)
+        if (!ckpt_read(fp, tage_table[t], entries * sizeof(tage_entry_t)))
+            return false;
+    return ckpt_read_items(fp, tage_state, NUM_TAGE_STATE);
+}
+
+const bp_engine_t tage_engine = {
+    .name = "tage",
+    .set = tage_set,
+    .check = tage_check,
+    .init = tage_init,
+    .predict = tage_predict,
+    .update = tage_update,
+    .save = tage_save,
+    .load = tage_load,
+    .config = &tage_config,
+    .config_size = sizeof(tage_config),
+};
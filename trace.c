@@ -0,0 +1,7 @@
+#include "trace.h"
+
+#ifdef SIM_TRACE
+// Everything is on by default so a debug build prints what it always has
+uint32_t trace_mask = TRACE_ALL;
+int trace_level = TRACE_LVL_VERBOSE;
+#endif
@@ -0,0 +1,42 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Per-cycle tracing. The TRACE macro compiles to nothing unless the
+// simulator is built with -DSIM_TRACE (`make sim_debug`), so the release
+// `sim` binary never formats a string on the hot path. In a debug build
+// the categories and the verbosity can be switched at runtime with the
+// `trace <mask> <level>` shell command.
+
+// Categories; OR them together to build a mask
+#define TRACE_FETCH    0x1 // fetch stage PC updates and control stalls
+#define TRACE_CACHE    0x2 // i_cache/d_cache hits, misses and query states
+#define TRACE_BP       0x4 // branch resolution side effects
+#define TRACE_MEMSTALL 0x8 // d_cache miss stalls in the MEM stage
+#define TRACE_ALL      0xF
+
+// Levels; a message is printed if its level is <= trace_level
+#define TRACE_LVL_OFF     0
+#define TRACE_LVL_EVENT   1 // misses, stalls, cancellations
+#define TRACE_LVL_VERBOSE 2 // every fetch and every hit
+
+#ifdef SIM_TRACE
+
+extern uint32_t trace_mask;
+extern int trace_level;
+
+#define TRACE(cat, lvl, ...)                                       \
+    do {                                                           \
+        if ((trace_mask & (cat)) && trace_level >= (lvl))          \
+            printf(__VA_ARGS__);                                   \
+    } while (0)
+
+#else
+
+#define TRACE(cat, lvl, ...) ((void)0)
+
+#endif
+
+#endif
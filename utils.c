@@ -28,7 +28,7 @@ uint64_t read_from_byte_array(uint8_t* const arr, size_t size, size_t offset) {
     assert(size <= 8); // We don't support reading >64 bits yet
 
     while(size > 0) {
-        assert(offset < BLOCK_SIZE);
+        assert(offset < MAX_BLOCK_SIZE);
         res += ((uint64_t)(arr[offset])) << shift;
         shift += 8;
         offset++;
@@ -42,7 +42,7 @@ void write_to_byte_array(uint8_t* arr, size_t size, size_t offset, uint64_t data
     assert(size <= 8); // We don't support reading >64 bits yet
 
     while(size > 0) {
-        assert(offset < BLOCK_SIZE);
+        assert(offset < MAX_BLOCK_SIZE);
         arr[offset] = (uint8_t)data;
         data >>= 8;
         offset++;